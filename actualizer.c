@@ -1,6 +1,15 @@
 #include "actualizer.h"
 
 #include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_RUNS
+#include <immintrin.h>
+#endif
 
 #include "json.h"
 
@@ -25,34 +34,89 @@ void Frame_destroy(Frame* this) {
 	free(this);
 }
 
-void colorizePixel(Frame* this, Coordinate* coord, RGBA_color* touch_color) {
-	if (coord->y > this->higth || coord->y < 0 || 
-		 coord->x > this->width || coord->x < 0) {
-		return;
+/* Pixel run kernels. A run is n consecutive RGBA pixels on one row. Inverting
+   XORs the color channels and keeps alpha, colorizing overwrites the pixels
+   with an opaque color. The SIMD versions are picked at runtime. */
+
+#define INVERT_MASK 0x00FFFFFFu // R, G and B bytes of a little endian pixel.
+
+void invertRunScalar(uint8_t* pixels, int n) {
+	uint32_t pixel;
+	for (int i=0; i<n; i++) {
+		memcpy(&pixel, pixels + i*4, 4);
+		pixel ^= INVERT_MASK;
+		memcpy(pixels + i*4, &pixel, 4);
+	}
+}
+
+void colorizeRunScalar(uint8_t* pixels, int n, uint32_t color) {
+	for (int i=0; i<n; i++) {
+		memcpy(pixels + i*4, &color, 4);
 	}
+}
 
-	uint8_t* pixel;
-	pixel = this->image_data + coord->y*this->linesize + coord->x*4;
+#ifdef HAVE_X86_RUNS
 
-	pixel[0] = touch_color->r; // Red
-	pixel[1] = touch_color->g; // Green
-	pixel[2] = touch_color->b; // Blue
-	pixel[3] = 255; 				// Alpha
+void invertRunSSE2(uint8_t* pixels, int n) {
+	__m128i mask = _mm_set1_epi32(INVERT_MASK);
+	int i = 0;
+	for (; i+4<=n; i+=4) {
+		__m128i* p = (__m128i*)(pixels + i*4);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask));
+	}
+	invertRunScalar(pixels + i*4, n - i);
 }
 
-void invertPixel(Frame* this, Coordinate* coord) {
-	if (coord->y > this->higth || coord->y < 0 || 
-		 coord->x > this->width || coord->x < 0) {
-		return;
+void colorizeRunSSE2(uint8_t* pixels, int n, uint32_t color) {
+	__m128i fill = _mm_set1_epi32(color);
+	int i = 0;
+	for (; i+4<=n; i+=4) {
+		_mm_storeu_si128((__m128i*)(pixels + i*4), fill);
 	}
+	colorizeRunScalar(pixels + i*4, n - i, color);
+}
 
-	uint8_t* pixel;
-	pixel = this->image_data + coord->y*this->linesize + coord->x*4;
+__attribute__((target("avx2")))
+void invertRunAVX2(uint8_t* pixels, int n) {
+	__m256i mask = _mm256_set1_epi32(INVERT_MASK);
+	int i = 0;
+	for (; i+8<=n; i+=8) {
+		__m256i* p = (__m256i*)(pixels + i*4);
+		_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask));
+	}
+	invertRunSSE2(pixels + i*4, n - i);
+}
 
-	pixel[0] ^= 0xFF; // Red
-	pixel[1] ^= 0xFF; // Green
-	pixel[2] ^= 0xFF; // Blue
-	pixel[3] ^= 0x00; // Alpha
+__attribute__((target("avx2")))
+void colorizeRunAVX2(uint8_t* pixels, int n, uint32_t color) {
+	__m256i fill = _mm256_set1_epi32(color);
+	int i = 0;
+	for (; i+8<=n; i+=8) {
+		_mm256_storeu_si256((__m256i*)(pixels + i*4), fill);
+	}
+	colorizeRunSSE2(pixels + i*4, n - i, color);
+}
+
+#endif // HAVE_X86_RUNS
+
+static void (*invertRun)(uint8_t* pixels, int n) = invertRunScalar;
+static void (*colorizeRun)(uint8_t* pixels, int n, uint32_t color) =
+		colorizeRunScalar;
+static pthread_once_t runKernelsOnce = PTHREAD_ONCE_INIT;
+
+/* Picks the widest run kernels the CPU supports, once per process through
+   runKernelsOnce, as actualizers are created on several threads. */
+static void selectRunKernels(void) {
+#ifdef HAVE_X86_RUNS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		invertRun = invertRunAVX2;
+		colorizeRun = colorizeRunAVX2;
+	} else {
+		invertRun = invertRunSSE2;
+		colorizeRun = colorizeRunSSE2;
+	}
+#endif
 }
 
 
@@ -72,25 +136,13 @@ void RGBA_color_destroy(RGBA_color* this) {
 }
 
 
-/* Coordinate methods */
-
-Coordinate* Coordinate_new(int x, int y) {
-	Coordinate* this = malloc(sizeof(Coordinate));
-	this->x = x;
-	this->y = y;
-	return this;
-}
-
-void Coordinate_destroy(Coordinate* this) {
-	free(this);
-}
-
-
 /* Event methods */
 
 enum ACTION parse_action(const char* str) {
 	enum ACTION action;
-	if (strncmp(str, "move", STRNCMP_LIMIT) == 0) {
+	if (str == NULL) {
+		action = up;
+	} else if (strncmp(str, "move", STRNCMP_LIMIT) == 0) {
 		action = move;
 	} else if (strncmp(str, "down", STRNCMP_LIMIT) == 0 ||
 	           strncmp(str, "5", STRNCMP_LIMIT) == 0 ||
@@ -108,55 +160,182 @@ enum ACTION parse_action(const char* str) {
 	return action;
 }
 
-Event* Event_new(enum ACTION action, int x, int y) {
-	Event* this = malloc(sizeof(Event));
-	this->action = action;
-	this->coord = Coordinate_new(x, y);
-	return this;
+
+/* TouchData methods */
+
+static void* TouchData_realloc(void* p, size_t size) {
+	p = realloc(p, size > 0 ? size : 1);
+	if (p == NULL) {
+		fprintf(stderr, "Fatal: could not allocate touch events\n");
+		exit(1);
+	}
+	return p;
 }
 
-void Event_destroy(Event* this) {
-	if (this == NULL) return;
-	free(this->coord);
-	free(this);
+static void TouchData_grow(TouchData* this) {
+	this->capacity = this->capacity ? 2*this->capacity : 1024;
+	this->actions = TouchData_realloc(this->actions, this->capacity*sizeof(uint8_t));
+	this->indices = TouchData_realloc(this->indices, this->capacity*sizeof(int));
+	this->xs = TouchData_realloc(this->xs, this->capacity*sizeof(int));
+	this->ys = TouchData_realloc(this->ys, this->capacity*sizeof(int));
+	this->timestamps = TouchData_realloc(this->timestamps, this->capacity*sizeof(long));
 }
 
+/* Adds one json event to the arrays, keeping them sorted by timestamp. */
+static void TouchData_add(TouchData* this, json_t* event) {
+	// A corrupt index would size the active set, skip it.
+	json_int_t index = json_integer_value(json_object_get(event, "index"));
+	if (index < 0 || index >= MAX_POINTERS) return;
+
+	long timestamp = json_integer_value(json_object_get(event, "timestamp"));
+	// Live events up to the horizon may already be applied, a late event
+	// takes effect right after it instead of being skipped.
+	if (timestamp <= this->horizon) timestamp = this->horizon + 1;
+
+	if (this->n_events == this->capacity) TouchData_grow(this);
+
+	// Usually an append, equal timestamps keep their file order.
+	int i = this->n_events;
+	if (i > 0 && this->timestamps[i-1] > timestamp) {
+		i = TouchData_find(this, timestamp);
+		int n = this->n_events - i;
+		memmove(&this->actions[i+1], &this->actions[i], n*sizeof(uint8_t));
+		memmove(&this->indices[i+1], &this->indices[i], n*sizeof(int));
+		memmove(&this->xs[i+1], &this->xs[i], n*sizeof(int));
+		memmove(&this->ys[i+1], &this->ys[i], n*sizeof(int));
+		memmove(&this->timestamps[i+1], &this->timestamps[i], n*sizeof(long));
+	}
+
+	const char* action_str = json_string_value(json_object_get(event, "action"));
 
-/* TouchData methods */
+	this->actions[i]    = parse_action(action_str);
+	this->indices[i]    = (int)index;
+	this->xs[i]         = json_integer_value(json_object_get(event, "x"));
+	this->ys[i]         = json_integer_value(json_object_get(event, "y"));
+	this->timestamps[i] = timestamp;
+	if (index >= this->n_pointers) this->n_pointers = (int)index + 1;
+	this->n_events++;
+}
+
+/* Reads the touch color, whenever it appears in the file. */
+static void TouchData_member(const char* key, json_t* value, void* opaque) {
+	TouchData* this = opaque;
+	if (strcmp(key, "color") != 0) return;
+	this->touch_color->r = json_integer_value(json_object_get(value, "r"));
+	this->touch_color->g = json_integer_value(json_object_get(value, "g"));
+	this->touch_color->b = json_integer_value(json_object_get(value, "b"));
+	this->touch_color->a = json_integer_value(json_object_get(value, "a"));
+}
 
 TouchData* TouchData_new(const char* filename) {
-	TouchData* this = malloc(sizeof(TouchData));
-	this->root = read_json((char*)filename);
-	this->json_events = json_object_get(this->root, EVENT_KEY);
-	json_t* color = json_object_get(this->root, "color");
-	int r = json_integer_value(json_object_get(color, "r"));
-	int g = json_integer_value(json_object_get(color, "g"));
-	int b = json_integer_value(json_object_get(color, "b"));
-	int a = json_integer_value(json_object_get(color, "a"));
-	this->touch_color = RGBA_color_new(r, g, b, a);
-	this->n_events = json_array_size(this->json_events);
-	this->next_event = 0;
+	TouchData* this = calloc(1, sizeof(TouchData));
+	this->touch_color = RGBA_color_new(0, 0, 0, 0);
+	this->horizon = LONG_MIN;
+	// All events are compiled and sorted up front, a render reaching them
+	// lazily would apply out of order events late.
+	this->stream = json_stream_open(filename, EVENT_KEY, TouchData_member, this);
+	if (this->stream == NULL) {
+		TouchData_destroy(this);
+		return NULL;
+	}
+	while (TouchData_load_next(this));
+	if (this->error) {
+		// Touches missing from the middle would render without a failure.
+		TouchData_destroy(this);
+		return NULL;
+	}
+	return this;
+}
+
+TouchData* TouchData_new_live(void) {
+	TouchData* this = calloc(1, sizeof(TouchData));
+	this->touch_color = RGBA_color_new(0, 0, 0, 0);
+	this->horizon = LONG_MIN;
+	this->stream = NULL; // events are added as they arrive
+	return this;
+}
+
+void TouchData_add_json(TouchData* this, json_t* object) {
+	json_t* color = json_object_get(object, "color");
+	if (color != NULL) {
+		TouchData_member("color", color, this);
+		return;
+	}
+	TouchData_add(this, object);
+}
+
+TouchData* TouchData_new_packed(int n_events, uint8_t* actions, int* indices,
+		int* xs, int* ys, long* timestamps, int n_pointers, RGBA_color color) {
+	TouchData* this = calloc(1, sizeof(TouchData));
+	this->touch_color = RGBA_color_new(color.r, color.g, color.b, color.a);
+	this->n_events = n_events;
+	this->capacity = n_events;
+	this->actions = actions;
+	this->indices = indices;
+	this->xs = xs;
+	this->ys = ys;
+	this->timestamps = timestamps;
+	this->n_pointers = n_pointers;
+	this->stream = NULL; // nothing left to load
+	this->horizon = LONG_MAX;
+	this->borrowed = 1;
 	return this;
 }
 
 void TouchData_destroy(TouchData* this) {
 	if (this == NULL) return;
-    RGBA_color_destroy(this->touch_color);
-	json_decref(this->root);
+	json_stream_close(this->stream);
+	RGBA_color_destroy(this->touch_color);
+	if (this->borrowed) {
+		free(this);
+		return;
+	}
+	free(this->actions);
+	free(this->indices);
+	free(this->xs);
+	free(this->ys);
+	free(this->timestamps);
 	free(this);
 }
 
-void parse_next_event(TouchData* this, int* index, enum ACTION* action, long* timestamp, int* x, int* y) {
-	json_t* event;
-	const char* action_str;
+int TouchData_load_next(TouchData* this) {
+	if (this->stream == NULL) return 0;
 
-	event = json_array_get(this->json_events, this->next_event);
-	action_str = json_string_value( json_object_get(event, "action"));
-	*index     = json_integer_value(json_object_get(event, "index"));
-	*timestamp = json_integer_value(json_object_get(event, "timestamp"));
-	*x         = json_integer_value(json_object_get(event, "x"));
-	*y         = json_integer_value(json_object_get(event, "y"));
-	*action    = parse_action(action_str);
+	json_t* event = json_stream_next(this->stream);
+	if (event == NULL) {
+		this->error = this->stream->error;
+		json_stream_close(this->stream);
+		this->stream = NULL;
+		return 0;
+	}
+	TouchData_add(this, event);
+	json_decref(event);
+	return 1;
+}
+
+void TouchData_load_until(TouchData* this, long timestamp) {
+	// Loaded data is only read, so it can be shared between threads.
+	if (this->stream == NULL) return;
+
+	while (this->n_events == 0 ||
+	       this->timestamps[this->n_events-1] <= timestamp) {
+		if (!TouchData_load_next(this)) break;
+	}
+	if (timestamp > this->horizon) this->horizon = timestamp;
+}
+
+int TouchData_find(TouchData* this, long timestamp) {
+	int low = 0;
+	int high = this->n_events;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (this->timestamps[mid] <= timestamp) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
 }
 
 
@@ -165,17 +344,15 @@ void parse_next_event(TouchData* this, int* index, enum ACTION* action, long* ti
 TouchMask* TouchMask_new(int radius) {
 	TouchMask* this = malloc(sizeof(TouchMask));
 	this->radius = radius;
-	this->mask  = malloc((2*radius+1)*(2*radius+1)*sizeof(uint8_t));
+	this->spans = malloc((2*radius+1)*sizeof(TouchSpan));
 
+	// Widest x with x*x+y*y <= radius*radius on each row.
 	for (int y=-radius; y<=radius; y++) {
-		for (int x=-radius; x<=radius; x++) {
-			int y_index = (y+radius)*2*radius;
-			if (x*x+y*y <= radius*radius) {
-				this->mask[y_index+x+radius] = 255;
-			} else {
-				this->mask[y_index+x+radius] = 0;
-			}
-		}
+		int half = (int)sqrt((double)(radius*radius - y*y));
+		while (half*half + y*y > radius*radius) half--;
+		while ((half+1)*(half+1) + y*y <= radius*radius) half++;
+		this->spans[y+radius].x_start = -half;
+		this->spans[y+radius].x_end = half + 1;
 	}
 
 	return this;
@@ -183,7 +360,7 @@ TouchMask* TouchMask_new(int radius) {
 
 void TouchMask_destroy(TouchMask* this) {
 	if (this == NULL) return;
-	free(this->mask);
+	free(this->spans);
 	free(this);
 }
 
@@ -192,12 +369,21 @@ void TouchMask_destroy(TouchMask* this) {
 
 TouchActualizer* TouchActualizer_new(const char* filename,
 		int width, int higth) {
+	TouchData* touch_data = TouchData_new(filename);
+	if (touch_data == NULL) return NULL;
+	return TouchActualizer_new_with_data(touch_data, width, higth);
+}
+
+TouchActualizer* TouchActualizer_new_with_data(TouchData* touch_data,
+		int width, int higth) {
+	pthread_once(&runKernelsOnce, selectRunKernels);
+
 	TouchActualizer* this = malloc(sizeof(TouchActualizer));
-	this->active_events = malloc(N_ACTIVE_EVENTS*sizeof(Event*));
-	for (int i=0; i<N_ACTIVE_EVENTS; i++) {
-		this->active_events[i] = NULL;
-	}
-	this->touch_data = TouchData_new(filename);
+	this->touch_data = touch_data;
+	this->owns_data = 1;
+	this->next_event = 0;
+	this->active_events = NULL;
+	this->n_slots = 0;
 	int min_size = width < higth ? width : higth;
 
 	this->move_touch_mask = TouchMask_new(min_size / R_MOVE_TOUCH_RADIUS);
@@ -205,73 +391,292 @@ TouchActualizer* TouchActualizer_new(const char* filename,
 	return this;
 }
 
+TouchActualizer* TouchActualizer_new_shared(TouchData* touch_data,
+		int width, int higth) {
+	TouchActualizer* this = TouchActualizer_new_with_data(touch_data,
+			width, higth);
+	this->owns_data = 0;
+	return this;
+}
+
 void TouchActualizer_destroy(TouchActualizer* this) {
 	if (this == NULL) return;
-	for (int i=0; i<N_ACTIVE_EVENTS; i++) {
-		Event_destroy(this->active_events[i]);
-	}
 	free(this->active_events);
-	TouchData_destroy(this->touch_data);
+	if (this->owns_data) TouchData_destroy(this->touch_data);
 	TouchMask_destroy(this->move_touch_mask);
 	TouchMask_destroy(this->down_touch_mask);
 	free(this);
 }
 
-void update_active_events(TouchActualizer* this, Frame* frame) {
-	int index;
-	enum ACTION action;
-	long timestamp;
-	int x, y;
+/* Grows the active set to the pointer indices loaded so far. */
+static void ensure_slots(TouchActualizer* this) {
+	int n = this->touch_data->n_pointers;
+	if (n <= this->n_slots) return;
 
+	this->active_events = realloc(this->active_events, n*sizeof(Event));
+	if (this->active_events == NULL) {
+		fprintf(stderr, "Fatal: could not allocate active events\n");
+		exit(1);
+	}
+	memset(&this->active_events[this->n_slots], 0,
+	       (n - this->n_slots)*sizeof(Event));
+	this->n_slots = n;
+}
+
+/* Applies the event at position i of the touch data to the active set. */
+static void apply_event(TouchActualizer* this, int i) {
 	TouchData* td = this->touch_data;
-	while (td->next_event < td->n_events) {
-		parse_next_event(td, &index, &action, &timestamp, &x, &y);
-		if (timestamp > frame->timestamp) break;
-		if (index >= td->n_events) break; // out of bounds.
-
-		if (action == up) {
-			Event_destroy(this->active_events[index]);
-			this->active_events[index] = NULL;
-		} else if (this->active_events[index] == NULL) {
-			this->active_events[index] = Event_new(action, x, y);
-		} else {
-			this->active_events[index]->action = action;
-			this->active_events[index]->coord->x = x;
-			this->active_events[index]->coord->y = y;
-		}
+	int index = td->indices[i];
+	if (index < 0 || index >= this->n_slots) return; // out of bounds.
 
-		td->next_event++;
+	Event* event = &this->active_events[index];
+	if (td->actions[i] == up) {
+		event->active = 0;
+	} else {
+		event->active = 1;
+		event->action = td->actions[i];
+		event->coord.x = td->xs[i];
+		event->coord.y = td->ys[i];
 	}
 }
 
+int update_active_events(TouchActualizer* this, Frame* frame) {
+	TouchData* td = this->touch_data;
+	int changed = 0;
+
+	TouchData_load_until(td, frame->timestamp);
+	ensure_slots(this);
+
+	while (this->next_event < td->n_events &&
+	       td->timestamps[this->next_event] <= frame->timestamp) {
+		apply_event(this, this->next_event);
+		this->next_event++;
+		changed++;
+	}
+	return changed;
+}
+
 void actualizeEvent(TouchActualizer* this, Event* event, Frame* frame) {
-	Coordinate coord;
 	TouchMask* touch_mask = this->move_touch_mask;
 	if (event->action == down) {
 		touch_mask = this->down_touch_mask;
 	}
 
-	for (int y=0; y<=2*touch_mask->radius; y++) {
-		int y_index = y*2*touch_mask->radius;
-		for (int x=0; x<=2*touch_mask->radius; x++) {
-			if (touch_mask->mask[y_index+x]) {
-				coord.x = event->coord->x - touch_mask->radius + x;
-				coord.y = event->coord->y - touch_mask->radius + y;
-				#ifdef INVERTED_TOUCH_COLOR
-					invertPixel(frame, &coord);
-				#else // user defined touch color.
-					colorizePixel(frame, &coord, this->touch_data->touch_color);
-				#endif
+	int radius = touch_mask->radius;
+	int cx = event->coord.x;
+	int cy = event->coord.y;
+
+	// Clip the rows once, then each span against the frame width.
+	int y_first = cy - radius < 0 ? 0 : cy - radius;
+	int y_last = cy + radius >= frame->higth ? frame->higth - 1 : cy + radius;
+
+	#ifndef INVERTED_TOUCH_COLOR
+		RGBA_color* c = this->touch_data->touch_color;
+		uint8_t rgba[4] = { c->r, c->g, c->b, 255 };
+		uint32_t color;
+		memcpy(&color, rgba, 4);
+	#endif
+
+	for (int y=y_first; y<=y_last; y++) {
+		TouchSpan* span = &touch_mask->spans[y - cy + radius];
+		int x_start = cx + span->x_start;
+		int x_end = cx + span->x_end;
+		if (x_start < 0) x_start = 0;
+		if (x_end > frame->width) x_end = frame->width;
+		if (x_start >= x_end) continue;
+
+		uint8_t* row = frame->image_data + y*frame->linesize + x_start*4;
+		#ifdef INVERTED_TOUCH_COLOR
+			invertRun(row, x_end - x_start);
+		#else // user defined touch color.
+			colorizeRun(row, x_end - x_start, color);
+		#endif
+	}
+}
+
+void actualizeEvents(TouchActualizer* this, Frame* frame) {
+	for (int i=0; i<this->n_slots; i++) {
+		if (!this->active_events[i].active) continue;
+		actualizeEvent(this, &this->active_events[i], frame);
+	}
+}
+
+/* YUV drawing. Inverting R, G and B mirrors Y within its range and U and V
+   around 128, as the BT.601 and BT.709 matrices are linear and the chroma
+   rows sum to zero. A user color is converted with BT.601. Chroma samples on
+   the edge of a circle are blended by how many of their pixels it covers, as
+   converting an RGBA overlay averages them. */
+
+static uint8_t clampByte(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Fills the lookup tables from an input sample to its drawn value.
+static void touchLuts(TouchActualizer* this, YUVFrame* frame,
+		uint8_t* y_lut, uint8_t* u_lut, uint8_t* v_lut) {
+	#ifdef INVERTED_TOUCH_COLOR
+		(void)this;
+		int y_sum = frame->full_range ? 255 : 16 + 235;
+		for (int i=0; i<256; i++) {
+			y_lut[i] = clampByte(y_sum - i);
+			u_lut[i] = clampByte(256 - i);
+			v_lut[i] = clampByte(256 - i);
+		}
+	#else // user defined touch color.
+		RGBA_color* c = this->touch_data->touch_color;
+		int y, u, v;
+		if (frame->full_range) {
+			y = (77*c->r + 150*c->g + 29*c->b + 128) >> 8;
+			u = ((-43*c->r - 85*c->g + 128*c->b + 128) >> 8) + 128;
+			v = ((128*c->r - 107*c->g - 21*c->b + 128) >> 8) + 128;
+		} else {
+			y = ((66*c->r + 129*c->g + 25*c->b + 128) >> 8) + 16;
+			u = ((-38*c->r - 74*c->g + 112*c->b + 128) >> 8) + 128;
+			v = ((112*c->r - 94*c->g - 18*c->b + 128) >> 8) + 128;
+		}
+		memset(y_lut, clampByte(y), 256);
+		memset(u_lut, clampByte(u), 256);
+		memset(v_lut, clampByte(v), 256);
+	#endif
+}
+
+static void drawLuma(TouchMask* mask, Event* event, YUVFrame* frame,
+		const uint8_t* lut) {
+	int radius = mask->radius;
+	int cx = event->coord.x;
+	int cy = event->coord.y;
+	int y_first = cy - radius < 0 ? 0 : cy - radius;
+	int y_last = cy + radius >= frame->higth ? frame->higth - 1 : cy + radius;
+
+	for (int y=y_first; y<=y_last; y++) {
+		TouchSpan* span = &mask->spans[y - cy + radius];
+		int x_start = cx + span->x_start;
+		int x_end = cx + span->x_end;
+		if (x_start < 0) x_start = 0;
+		if (x_end > frame->width) x_end = frame->width;
+
+		uint8_t* row = frame->planes[0] + y*frame->linesizes[0];
+		for (int x=x_start; x<x_end; x++) {
+			row[x] = lut[row[x]];
+		}
+	}
+}
+
+static void drawChroma(TouchMask* mask, Event* event, YUVFrame* frame,
+		const uint8_t* u_lut, const uint8_t* v_lut) {
+	int radius = mask->radius;
+	int cx = event->coord.x;
+	int cy = event->coord.y;
+	int sw = frame->chroma_w_shift;
+	int sh = frame->chroma_h_shift;
+	int x_first = cx - radius < 0 ? 0 : cx - radius;
+	int y_first = cy - radius < 0 ? 0 : cy - radius;
+	int x_last = cx + radius >= frame->width ? frame->width - 1 : cx + radius;
+	int y_last = cy + radius >= frame->higth ? frame->higth - 1 : cy + radius;
+	if (x_first > x_last || y_first > y_last) return;
+
+	for (int v=y_first >> sh; v<=y_last >> sh; v++) {
+		uint8_t* u_row = frame->planes[1] + v*frame->linesizes[1];
+		uint8_t* v_row = frame->planes[2] + v*frame->linesizes[2];
+		int y_start = v << sh;
+		int y_end = (v+1) << sh;
+		if (y_end > frame->higth) y_end = frame->higth;
+
+		// Pixels [inner_start, inner_end) are inside on every row.
+		int inner_start = INT_MIN;
+		int inner_end = INT_MAX;
+		for (int y=y_start; y<y_end; y++) {
+			if (y < cy - radius || y > cy + radius) {
+				inner_end = INT_MIN;
+				break;
+			}
+			TouchSpan* span = &mask->spans[y - cy + radius];
+			if (cx + span->x_start > inner_start) inner_start = cx + span->x_start;
+			if (cx + span->x_end < inner_end) inner_end = cx + span->x_end;
+		}
+
+		for (int u=x_first >> sw; u<=x_last >> sw; u++) {
+			int x_start = u << sw;
+			int x_end = (u+1) << sw;
+			if (x_end > frame->width) x_end = frame->width;
+
+			if (x_start >= inner_start && x_end <= inner_end) {
+				u_row[u] = u_lut[u_row[u]];
+				v_row[u] = v_lut[v_row[u]];
+				continue;
+			}
+
+			// Pixels of the sample inside the frame, and inside the circle.
+			int total = (x_end - x_start) * (y_end - y_start);
+			int covered = 0;
+			for (int y=y_start; y<y_end; y++) {
+				if (y < cy - radius || y > cy + radius) continue;
+				TouchSpan* span = &mask->spans[y - cy + radius];
+				int s = cx + span->x_start > x_start ? cx + span->x_start : x_start;
+				int e = cx + span->x_end < x_end ? cx + span->x_end : x_end;
+				if (e > s) covered += e - s;
+			}
+
+			if (covered == total) {
+				u_row[u] = u_lut[u_row[u]];
+				v_row[u] = v_lut[v_row[u]];
+			} else if (covered > 0) {
+				int rest = total - covered;
+				u_row[u] = (covered*u_lut[u_row[u]] + rest*u_row[u] + total/2)
+						/ total;
+				v_row[u] = (covered*v_lut[v_row[u]] + rest*v_row[u] + total/2)
+						/ total;
 			}
 		}
 	}
 }
 
-void actualizeEvents(TouchActualizer* this, Frame* frame) {
-	for (int i=0; i<N_ACTIVE_EVENTS; i++) {
-		if (this->active_events[i] == NULL) continue;
-		actualizeEvent(this, this->active_events[i], frame);
+static TouchMask* eventMask(TouchActualizer* this, Event* event) {
+	return event->action == down ? this->down_touch_mask
+	                             : this->move_touch_mask;
+}
+
+void draw_touches_yuv(TouchActualizer* this, YUVFrame* frame) {
+	uint8_t y_lut[256], u_lut[256], v_lut[256];
+	touchLuts(this, frame, y_lut, u_lut, v_lut);
+
+	for (int i=0; i<this->n_slots; i++) {
+		Event* event = &this->active_events[i];
+		if (!event->active) continue;
+		TouchMask* mask = eventMask(this, event);
+		drawLuma(mask, event, frame, y_lut);
+		drawChroma(mask, event, frame, u_lut, v_lut);
+	}
+}
+
+int touch_boxes(TouchActualizer* this, YUVFrame* frame, TouchBox* boxes) {
+	int x_align = (1 << frame->chroma_w_shift) - 1;
+	int y_align = (1 << frame->chroma_h_shift) - 1;
+	int n = 0;
+
+	for (int i=0; i<this->n_slots; i++) {
+		Event* event = &this->active_events[i];
+		if (!event->active) continue;
+		int radius = eventMask(this, event)->radius;
+
+		// Widened to whole chroma samples, then clipped.
+		int x0 = (event->coord.x - radius) & ~x_align;
+		int y0 = (event->coord.y - radius) & ~y_align;
+		int x1 = (event->coord.x + radius + 1 + x_align) & ~x_align;
+		int y1 = (event->coord.y + radius + 1 + y_align) & ~y_align;
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 > frame->width) x1 = frame->width;
+		if (y1 > frame->higth) y1 = frame->higth;
+		if (x0 >= x1 || y0 >= y1) continue;
+
+		boxes[n].x = x0;
+		boxes[n].y = y0;
+		boxes[n].width = x1 - x0;
+		boxes[n].higth = y1 - y0;
+		n++;
 	}
+	return n;
 }
 
 void actualize(TouchActualizer* this, Frame* frame) {
@@ -282,3 +687,56 @@ void actualize(TouchActualizer* this, Frame* frame) {
 void revert_actualize(TouchActualizer* this, Frame* frame) {
 	actualizeEvents(this, frame);
 }
+
+int update_touches(TouchActualizer* this, Frame* frame) {
+	return update_active_events(this, frame);
+}
+
+void draw_touches(TouchActualizer* this, Frame* frame) {
+	actualizeEvents(this, frame);
+}
+
+int touches_visible(TouchActualizer* this, long until) {
+	for (int i=0; i<this->n_slots; i++) {
+		if (this->active_events[i].active) return 1;
+	}
+	return next_touch_timestamp(this) <= until;
+}
+
+long next_touch_timestamp(TouchActualizer* this) {
+	TouchData* td = this->touch_data;
+	while (this->next_event >= td->n_events) {
+		if (!TouchData_load_next(td)) return LONG_MAX;
+	}
+	return td->timestamps[this->next_event];
+}
+
+void seek_touches(TouchActualizer* this, long timestamp) {
+	TouchData_load_until(this->touch_data, timestamp);
+	ensure_slots(this);
+	int end = TouchData_find(this->touch_data, timestamp);
+
+	// The active set depends on every earlier event, replay them.
+	memset(this->active_events, 0, this->n_slots*sizeof(Event));
+	for (int i=0; i<end; i++) {
+		apply_event(this, i);
+	}
+	this->next_event = end;
+}
+
+int restore_touches(TouchActualizer* this, int next_event, const Event* events,
+		int n_events) {
+	TouchData* td = this->touch_data;
+	while (td->n_events < next_event) {
+		if (!TouchData_load_next(td)) return 0;
+	}
+	if (n_events > td->n_pointers) return 0;
+	ensure_slots(this);
+
+	memset(this->active_events, 0, this->n_slots*sizeof(Event));
+	if (n_events > 0) {
+		memcpy(this->active_events, events, n_events*sizeof(Event));
+	}
+	this->next_event = next_event;
+	return 1;
+}
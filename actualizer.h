@@ -8,11 +8,12 @@
 #ifndef _TOUCH_ACTUALIZER_H_
 #define _TOUCH_ACTUALIZER_H_
 #include <stdint.h>
+#include <limits.h>
 #include <jansson.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define N_ACTIVE_EVENTS 10
+#include "json.h"
 
 // Touch radius is relative the image size.
 #define R_MOVE_TOUCH_RADIUS 25
@@ -21,6 +22,9 @@
 // Remove to enable user defined touch color.
 #define INVERTED_TOUCH_COLOR
 
+// Events with a pointer index outside [0, MAX_POINTERS) are dropped.
+#define MAX_POINTERS 32
+
 /*** Frame ***/
 
 typedef struct Frame {
@@ -40,6 +44,25 @@ Frame* Frame_new(uint8_t* image_data, int linesize, int width, int higth,
 /* Destructor. Note: Does not free image_data. */
 void Frame_destroy(Frame* this);
 
+// A planar YUV frame, such as a screenshot after color conversion. The chroma
+// planes are subsampled by 1 << chroma_w_shift and 1 << chroma_h_shift, and
+// full_range is set for JPEG range samples.
+typedef struct YUVFrame {
+	uint8_t* planes[3];
+	int linesizes[3];
+	int width;
+	int higth;
+	int chroma_w_shift;
+	int chroma_h_shift;
+	int full_range;
+} YUVFrame;
+
+// The pixels [x, x+width) of rows [y, y+higth).
+typedef struct TouchBox {
+	int x, y;
+	int width, higth;
+} TouchBox;
+
 
 /*** TouchActualizer and sub-modules ***/
 
@@ -57,34 +80,70 @@ typedef struct Coordinate {
 	int x, y;
 } Coordinate;
 
+// State of one pointer, inactive between its up and next down event.
 typedef struct Event {
 	enum ACTION action;
-	Coordinate* coord;
+	Coordinate coord;
+	int active;
 } Event;
 
+// The touch events of a session, compiled into packed arrays sorted by
+// timestamp. Event i is (actions[i], indices[i], xs[i], ys[i], timestamps[i]).
+// The events of a json file are streamed into the arrays when it is opened,
+// without a tree of the whole file, and sorted once, so every render of the
+// session applies them at the same times. Live events are added as they
+// arrive, and the horizon moves those logged too late to right after it.
 typedef struct TouchData {
-	json_t* root;
-	json_t* json_events;
 	int n_events;
-	int next_event;
+	int capacity;
+	uint8_t* actions;
+	int* indices;
+	int* xs;
+	int* ys;
+	long* timestamps;
+	int n_pointers; // largest pointer index + 1
 	RGBA_color* touch_color;
+	JsonStream* stream; // NULL once every event is loaded
+	long horizon;       // latest timestamp rendered (live only)
+	int borrowed;       // the arrays belong to someone else
+	int error;          // the stream stopped on a parse error
 } TouchData;
 
+// Pixels [x_start, x_end) of one row of a touch circle, relative its center.
+typedef struct TouchSpan {
+	int x_start, x_end;
+} TouchSpan;
+
+// A filled circle as one span per row, from -radius to radius.
 typedef struct TouchMask {
-	uint8_t* mask;
+	TouchSpan* spans;
 	int radius;
 } TouchMask;
 
 typedef struct TouchActualizer {
-	Event** active_events;
+	Event* active_events; // indexed by pointer index
+	int n_slots;
+	int next_event;       // first event not applied yet
 	TouchData* touch_data;
+	int owns_data;
 	TouchMask* move_touch_mask;
 	TouchMask* down_touch_mask;
 } TouchActualizer;
 
-/* Contructor, free with TouchActualizer_destroy. */
+/* Contructor, free with TouchActualizer_destroy. Returns NULL if the file can
+   not be read. */
 TouchActualizer* TouchActualizer_new(const char* filename, int width, int higth);
 
+/* Contructor over already loaded touch data, which the TouchActualizer takes
+   ownership of. */
+TouchActualizer* TouchActualizer_new_with_data(TouchData* touch_data,
+		int width, int higth);
+
+/* Contructor over touch data shared by several TouchActualizers, such as one
+   per thread. The data must be fully loaded and outlive the TouchActualizer. */
+TouchActualizer* TouchActualizer_new_shared(TouchData* touch_data,
+		int width, int higth);
+
 /* Destructor. */
 void TouchActualizer_destroy(TouchActualizer* this);
 
@@ -92,6 +151,101 @@ void TouchActualizer_destroy(TouchActualizer* this);
    image_timestamp. */
 void actualize(TouchActualizer* this, Frame* frame);
 
+/* The two halves of actualize(). update_touches() advances the active events
+   to the frame timestamp and returns the number of events that changed, so
+   zero means the overlay looks the same as at the previous call.
+   draw_touches() draws the active events into the frame. */
+int update_touches(TouchActualizer* this, Frame* frame);
+
+void draw_touches(TouchActualizer* this, Frame* frame);
+
 void revert_actualize(TouchActualizer* this, Frame* frame);
 
+/* Draws the active events into a converted YUV frame, looking like
+   draw_touches() on the screenshot before conversion. */
+void draw_touches_yuv(TouchActualizer* this, YUVFrame* frame);
+
+/* Writes the box of each active event to boxes, which needs room for n_slots,
+   and returns their number. Boxes are clipped to the frame and widened to
+   whole chroma samples, so copying them restores every pixel the touches
+   were drawn over. */
+int touch_boxes(TouchActualizer* this, YUVFrame* frame, TouchBox* boxes);
+
+/* Returns the timestamp of the next touch event that has not been actualized
+   yet, or LONG_MAX when there are no more events. */
+long next_touch_timestamp(TouchActualizer* this);
+
+/* Returns 1 if any touch is drawn from now until the given timestamp, either
+   one still active or one whose event is due by then, and 0 if the frames up
+   to it look the same as without touches. */
+int touches_visible(TouchActualizer* this, long until);
+
+/* Sets the active events to their state at the given timestamp, so that the
+   next actualize() continues from there. Works in both directions. */
+void seek_touches(TouchActualizer* this, long timestamp);
+
+/* Sets the active events to a state saved from an earlier render, where
+   next_event events had been applied and events[i] was the state of pointer i.
+   Returns 0 if the touch data does not have that many events, and the state
+   is left alone. */
+int restore_touches(TouchActualizer* this, int next_event, const Event* events,
+		int n_events);
+
+/* Contructor loading every event of a touch json file, free with
+   TouchData_destroy. Returns NULL if the file can not be read or parsed. */
+TouchData* TouchData_new(const char* filename);
+
+/* Contructor over events that are already packed and sorted, such as those of
+   a session index. The arrays are not copied and must outlive the TouchData. */
+TouchData* TouchData_new_packed(int n_events, uint8_t* actions, int* indices,
+		int* xs, int* ys, long* timestamps, int n_pointers, RGBA_color color);
+
+/* Contructor for events that arrive during rendering, such as those of a
+   live session, which are added with TouchData_add_json. Free with
+   TouchData_destroy. */
+TouchData* TouchData_new_live(void);
+
+/* Destructor. */
+void TouchData_destroy(TouchData* this);
+
+/* Adds one event, or the touch color, from a json object of a touch log.
+   Events at or before the horizon take effect right after it. */
+void TouchData_add_json(TouchData* this, json_t* object);
+
+/* Returns the position of the first loaded event later than timestamp. */
+int TouchData_find(TouchData* this, long timestamp);
+
+/* Loads events until one later than timestamp is loaded, or all of them.
+   TouchData_load_next() loads one event and returns 0 when there are none
+   left. Pass LONG_MAX to load the whole session. */
+void TouchData_load_until(TouchData* this, long timestamp);
+
+int TouchData_load_next(TouchData* this);
+
+
+/*** Kernels, exposed for bench/kernels.c ***/
+
+/* Draws one event into the frame with the kernels picked when the first
+   TouchActualizer was created. */
+void actualizeEvent(TouchActualizer* this, Event* event, Frame* frame);
+
+/* Constructor of the circle spans of a radius, free with TouchMask_destroy. */
+TouchMask* TouchMask_new(int radius);
+
+void TouchMask_destroy(TouchMask* this);
+
+/* Inverts or colorizes a run of n RGBA pixels. The SSE2 and AVX2 versions
+   only exist on x86, and the AVX2 ones only run where the CPU has it. */
+void invertRunScalar(uint8_t* pixels, int n);
+
+void colorizeRunScalar(uint8_t* pixels, int n, uint32_t color);
+
+void invertRunSSE2(uint8_t* pixels, int n);
+
+void colorizeRunSSE2(uint8_t* pixels, int n, uint32_t color);
+
+void invertRunAVX2(uint8_t* pixels, int n);
+
+void colorizeRunAVX2(uint8_t* pixels, int n, uint32_t color);
+
 #endif // _TOUCH_ACTUALIZER_H_
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "actualizer.h"
+#include "append.h"
+
+#define APPEND_STATE_VERSION 1
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * append_state_filename returns the sidecar filename of
+ * the output
+ *
+ * side effects: allocates the filename, which must be freed
+ */
+char * append_state_filename(const char *dst_filename) {
+    char *filename;
+
+    if (asprintf(&filename, "%s%s", dst_filename, APPEND_STATE_SUFFIX) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+    return filename;
+}
+
+static int get_integer(json_t *root, const char *key, json_int_t *value) {
+    json_t *item = json_object_get(root, key);
+
+    if (!json_is_integer(item)) {
+        return 0;
+    }
+    *value = json_integer_value(item);
+    return 1;
+}
+
+static int hex_value(char c) {
+    const char *p = strchr(hex_digits, c);
+
+    return c != '\0' && p ? (int)(p - hex_digits) : -1;
+}
+
+/*
+ * read_extradata decodes the hex string of the encoder
+ * stream header
+ *
+ * returns 0 if it is not valid hex
+ */
+static int read_extradata(AppendState *state, json_t *item) {
+    const char *hex;
+    size_t      len, i;
+    int         hi, lo;
+
+    if (!json_is_string(item)) {
+        return 0;
+    }
+    hex = json_string_value(item);
+    len = strlen(hex);
+    if (len % 2 != 0) {
+        return 0;
+    }
+
+    state->extradata_size = len / 2;
+    state->extradata = malloc(len / 2 + 1);
+    if (!state->extradata) {
+        fprintf(stderr, "Fatal: could not allocate append state\n");
+        exit(1);
+    }
+    for (i = 0; i < len / 2; i++) {
+        hi = hex_value(hex[2*i]);
+        lo = hex_value(hex[2*i + 1]);
+        if (hi < 0 || lo < 0) {
+            return 0;
+        }
+        state->extradata[i] = hi << 4 | lo;
+    }
+    return 1;
+}
+
+/*
+ * read_pointers reads the pointer states, each one an
+ * array of [active, action, x, y]
+ *
+ * returns 0 if they are not valid
+ */
+static int read_pointers(AppendState *state, json_t *item) {
+    json_t *pointer;
+    size_t  i;
+    int     j, values[4];
+
+    if (!json_is_array(item)) {
+        return 0;
+    }
+
+    state->n_pointers = json_array_size(item);
+    state->pointers = calloc(state->n_pointers + 1, sizeof(Event));
+    if (!state->pointers) {
+        fprintf(stderr, "Fatal: could not allocate append state\n");
+        exit(1);
+    }
+
+    json_array_foreach(item, i, pointer) {
+        if (!json_is_array(pointer) || json_array_size(pointer) != 4) {
+            return 0;
+        }
+        for (j = 0; j < 4; j++) {
+            if (!json_is_integer(json_array_get(pointer, j))) {
+                return 0;
+            }
+            values[j] = json_integer_value(json_array_get(pointer, j));
+        }
+        if (values[1] < down || values[1] > up) {
+            return 0;
+        }
+        state->pointers[i].active = values[0];
+        state->pointers[i].action = values[1];
+        state->pointers[i].coord.x = values[2];
+        state->pointers[i].coord.y = values[3];
+    }
+    return 1;
+}
+
+/*
+ * append_state_read reads the sidecar
+ *
+ * returns 0 on success, -1 if there is none or it can not
+ * be used, which is only reported if it exists
+ *
+ * side effects: allocates the state, which must be freed
+ * with append_state_free
+ */
+int append_state_read(const char *filename, AppendState *state) {
+    json_error_t error;
+    json_t      *root;
+    json_int_t   version, base_time, fps, vfr, width, height;
+    json_int_t   n_shots, end_time, pts, n_fragments, media_end;
+    json_int_t   next_event, event_time;
+    int          ok;
+
+    memset(state, 0, sizeof(AppendState));
+    if (access(filename, F_OK) != 0) {
+        return -1;
+    }
+
+    root = json_load_file(filename, 0, &error);
+    ok = root != NULL &&
+         get_integer(root, "version", &version) &&
+         version == APPEND_STATE_VERSION &&
+         get_integer(root, "base_time", &base_time) &&
+         get_integer(root, "fps", &fps) &&
+         get_integer(root, "vfr", &vfr) &&
+         get_integer(root, "width", &width) &&
+         get_integer(root, "height", &height) &&
+         get_integer(root, "shots", &n_shots) &&
+         get_integer(root, "end_time", &end_time) &&
+         get_integer(root, "pts", &pts) &&
+         get_integer(root, "fragments", &n_fragments) &&
+         get_integer(root, "media_end", &media_end) &&
+         get_integer(root, "next_event", &next_event) &&
+         get_integer(root, "event_time", &event_time) &&
+         read_extradata(state, json_object_get(root, "extradata")) &&
+         read_pointers(state, json_object_get(root, "pointers"));
+    json_decref(root);
+
+    if (!ok) {
+        fprintf(stderr, "Warning: ignoring invalid append state %s\n",
+                filename);
+        append_state_free(state);
+        return -1;
+    }
+
+    state->base_time = base_time;
+    state->fps = fps;
+    state->vfr = vfr;
+    state->width = width;
+    state->height = height;
+    state->n_shots = n_shots;
+    state->end_time = end_time;
+    state->pts = pts;
+    state->n_fragments = n_fragments;
+    state->media_end = media_end;
+    state->next_event = next_event;
+    state->event_time = event_time;
+
+    return 0;
+}
+
+static char * write_extradata(const AppendState *state) {
+    char *hex;
+    int   i;
+
+    hex = malloc(2 * state->extradata_size + 1);
+    if (!hex) {
+        fprintf(stderr, "Fatal: could not allocate append state\n");
+        exit(1);
+    }
+    for (i = 0; i < state->extradata_size; i++) {
+        hex[2*i] = hex_digits[state->extradata[i] >> 4];
+        hex[2*i + 1] = hex_digits[state->extradata[i] & 0xf];
+    }
+    hex[2 * state->extradata_size] = '\0';
+
+    return hex;
+}
+
+/*
+ * append_state_write writes the sidecar next to the final
+ * file and renames it, so it never holds half a state
+ *
+ * returns 0 on success
+ */
+int append_state_write(const char *filename, const AppendState *state) {
+    json_t *root, *pointers, *pointer;
+    char   *hex, *tmp_filename;
+    int     i, ret = 0;
+
+    pointers = json_array();
+    for (i = 0; i < state->n_pointers; i++) {
+        pointer = json_array();
+        json_array_append_new(pointer, json_integer(state->pointers[i].active));
+        json_array_append_new(pointer, json_integer(state->pointers[i].action));
+        json_array_append_new(pointer,
+                              json_integer(state->pointers[i].coord.x));
+        json_array_append_new(pointer,
+                              json_integer(state->pointers[i].coord.y));
+        json_array_append_new(pointers, pointer);
+    }
+
+    hex = write_extradata(state);
+
+    root = json_object();
+    json_object_set_new(root, "version", json_integer(APPEND_STATE_VERSION));
+    json_object_set_new(root, "base_time", json_integer(state->base_time));
+    json_object_set_new(root, "fps", json_integer(state->fps));
+    json_object_set_new(root, "vfr", json_integer(state->vfr));
+    json_object_set_new(root, "width", json_integer(state->width));
+    json_object_set_new(root, "height", json_integer(state->height));
+    json_object_set_new(root, "extradata", json_string(hex));
+    json_object_set_new(root, "shots", json_integer(state->n_shots));
+    json_object_set_new(root, "end_time", json_integer(state->end_time));
+    json_object_set_new(root, "pts", json_integer(state->pts));
+    json_object_set_new(root, "fragments", json_integer(state->n_fragments));
+    json_object_set_new(root, "media_end", json_integer(state->media_end));
+    json_object_set_new(root, "next_event", json_integer(state->next_event));
+    json_object_set_new(root, "event_time", json_integer(state->event_time));
+    json_object_set_new(root, "pointers", pointers);
+    free(hex);
+
+    if (asprintf(&tmp_filename, "%s.tmp", filename) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    if (json_dump_file(root, tmp_filename,
+                       JSON_INDENT(2) | JSON_PRESERVE_ORDER) != 0 ||
+        rename(tmp_filename, filename) != 0) {
+        fprintf(stderr, "Error: could not write %s\n", filename);
+        unlink(tmp_filename);
+        ret = -1;
+    }
+
+    free(tmp_filename);
+    json_decref(root);
+
+    return ret;
+}
+
+void append_state_free(AppendState *state) {
+    free(state->extradata);
+    free(state->pointers);
+    state->extradata = NULL;
+    state->pointers = NULL;
+}
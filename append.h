@@ -0,0 +1,49 @@
+#ifndef _APPEND_H_
+#define _APPEND_H_
+
+#include <stdint.h>
+
+#include "actualizer.h"
+
+/* the sidecar of an output is named after it */
+#define APPEND_STATE_SUFFIX ".state"
+
+/*
+ * AppendState is the sidecar of an output rendered with
+ * --append: how far the session was rendered, where the
+ * output and the touch overlay stopped, and what the
+ * fragments appended to it have to match.
+ */
+typedef struct AppendState {
+    /* the session and output settings */
+    long     base_time;
+    int      fps, vfr;
+    int      width, height;
+    uint8_t *extradata;      /* encoder stream header */
+    int      extradata_size;
+
+    /* progress */
+    int      n_shots;        /* screenshots rendered */
+    long     end_time;       /* where the next screenshot starts */
+    int64_t  pts;            /* pts of the next frame */
+
+    /* the output file */
+    int      n_fragments;
+    int64_t  media_end;      /* end of the last fragment */
+
+    /* touch cursor */
+    int      next_event;     /* events applied so far */
+    long     event_time;     /* timestamp of the last one */
+    Event   *pointers;       /* state of each pointer */
+    int      n_pointers;
+} AppendState;
+
+char * append_state_filename(const char *dst_filename);
+
+int append_state_read(const char *filename, AppendState *state);
+
+int append_state_write(const char *filename, const AppendState *state);
+
+void append_state_free(AppendState *state);
+
+#endif
@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/time.h>
+#include <jansson.h>
+
+#include "batch.h"
+#include "options.h"
+#include "profile.h"
+#include "render.h"
+#include "session.h"
+#include "trace.h"
+#include "utils.h"
+
+/* jobs read ahead of the workers */
+#define JOB_QUEUE_SIZE 64
+
+/* seconds between scans of an idle spool folder */
+#define SPOOL_POLL_SECS 1
+
+#define JOB_SUFFIX    ".json"
+#define CLAIM_SUFFIX  ".work"
+#define RESULT_SUFFIX ".result.json"
+
+#define JOB_ERROR_SIZE 256
+
+/*
+ * Job is one render, with the batch options and the
+ * overrides of the job applied
+ */
+typedef struct Job {
+    char    *id;
+    char    *session;
+    char    *output;
+    Options  opts;
+
+    /* set if the job itself is invalid */
+    char     error[JOB_ERROR_SIZE];
+
+    /* spool mode, NULL otherwise */
+    char    *claim;   /* the job file, renamed while it runs */
+    char    *result;  /* where the result goes */
+} Job;
+
+/*
+ * JobQueue hands the jobs to the workers, the reader
+ * blocks while it is full
+ */
+typedef struct JobQueue {
+    Job            *jobs[JOB_QUEUE_SIZE];
+    int             head, count;
+    int             closed;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty, not_full;
+} JobQueue;
+
+typedef struct Batch {
+    const Options  *opts;
+    JobQueue        queue;
+
+    /* results are written one line at a time */
+    pthread_mutex_t out_lock;
+    int             n_jobs, n_failed;
+} Batch;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static char * copy_string(const char *s) {
+    char *copy;
+
+    copy = strdup(s);
+    if (!copy) {
+        fprintf(stderr, "Fatal: could not allocate job\n");
+        exit(1);
+    }
+    return copy;
+}
+
+static void queue_push(JobQueue *q, Job *job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == JOB_QUEUE_SIZE) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->jobs[(q->head + q->count) % JOB_QUEUE_SIZE] = job;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * queue_pop returns the next job, NULL once the
+ * queue is closed and empty
+ */
+static Job * queue_pop(JobQueue *q) {
+    Job *job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0) {
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % JOB_QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+static void queue_close(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static Job * job_new(const Options *opts, const char *id) {
+    Job *job;
+
+    job = calloc(1, sizeof(Job));
+    if (!job) {
+        fprintf(stderr, "Fatal: could not allocate job\n");
+        exit(1);
+    }
+    job->id = copy_string(id);
+    job->opts = *opts;
+
+    return job;
+}
+
+static void job_free(Job *job) {
+    free(job->id);
+    free(job->session);
+    free(job->output);
+    free(job->claim);
+    free(job->result);
+    free(job);
+}
+
+/*
+ * parse_job_field applies one field of the job object
+ *
+ * returns 0 on success, else sets the job error
+ */
+static int parse_job_field(Job *job, const char *key, json_t *value) {
+    char **string = NULL;
+    int   *flag = NULL;
+    int    ret;
+
+    if (strcmp(key, "id") == 0) {
+        string = &job->id;
+    } else if (strcmp(key, "session") == 0) {
+        string = &job->session;
+    } else if (strcmp(key, "output") == 0) {
+        string = &job->output;
+    }
+    if (string) {
+        if (!json_is_string(value)) {
+            snprintf(job->error, JOB_ERROR_SIZE, "%s must be a string", key);
+            return -1;
+        }
+        free(*string);
+        *string = copy_string(json_string_value(value));
+        return 0;
+    }
+
+    if (strcmp(key, "fps") == 0) {
+        if (!json_is_integer(value) || json_integer_value(value) <= 0 ||
+            json_integer_value(value) > 4096) {
+            snprintf(job->error, JOB_ERROR_SIZE, "invalid fps");
+            return -1;
+        }
+        job->opts.fps = (int)json_integer_value(value);
+        return 0;
+    }
+    if (strcmp(key, "vfr") == 0) {
+        flag = &job->opts.vfr;
+    } else if (strcmp(key, "index") == 0) {
+        flag = &job->opts.use_index;
+    } else if (strcmp(key, "append") == 0) {
+        flag = &job->opts.append;
+    }
+    if (flag) {
+        if (!json_is_boolean(value)) {
+            snprintf(job->error, JOB_ERROR_SIZE, "%s must be a boolean", key);
+            return -1;
+        }
+        *flag = json_is_true(value);
+        return 0;
+    }
+
+    ret = profile_parse_json_field(&job->opts.profile, key, value);
+    if (ret == -2) {
+        snprintf(job->error, JOB_ERROR_SIZE, "unknown field %s", key);
+    } else if (ret != 0) {
+        snprintf(job->error, JOB_ERROR_SIZE, "invalid value for %s", key);
+    }
+    return ret;
+}
+
+/*
+ * parse_job reads a job from a json object. The profile is
+ * picked first, so the other fields override it whatever
+ * their order.
+ *
+ * returns the job, which carries an error instead of
+ * failing if the object is not a valid job
+ */
+static Job * parse_job(const Options *opts, json_t *root, const char *id) {
+    const EncoderProfile *profile;
+    Job                  *job;
+    json_t               *value;
+    const char           *key;
+
+    job = job_new(opts, id);
+    if (!json_is_object(root)) {
+        snprintf(job->error, JOB_ERROR_SIZE, "job is not a json object");
+        return job;
+    }
+
+    value = json_object_get(root, "profile");
+    if (value) {
+        profile = json_is_string(value) ?
+                  profile_find(json_string_value(value)) : NULL;
+        if (!profile) {
+            snprintf(job->error, JOB_ERROR_SIZE,
+                     "profile must name a built-in profile");
+            return job;
+        }
+        job->opts.profile = *profile;
+    }
+
+    json_object_foreach(root, key, value) {
+        if (strcmp(key, "profile") == 0) {
+            continue;
+        }
+        if (parse_job_field(job, key, value) != 0) {
+            return job;
+        }
+    }
+
+    if (!job->session || !job->output) {
+        snprintf(job->error, JOB_ERROR_SIZE, "session and output are required");
+    }
+    return job;
+}
+
+/*
+ * parse_job_text reads a job from its json text
+ */
+static Job * parse_job_text(const Options *opts, const char *text, size_t len,
+                            const char *id) {
+    json_error_t  error;
+    json_t       *root;
+    Job          *job;
+
+    root = json_loadb(text, len, 0, &error);
+    if (!root) {
+        job = job_new(opts, id);
+        snprintf(job->error, JOB_ERROR_SIZE, "invalid json: %s", error.text);
+        return job;
+    }
+
+    job = parse_job(opts, root, id);
+    json_decref(root);
+    return job;
+}
+
+/*
+ * write_result writes the result line to the spool folder
+ * and removes the claimed job file. The result is written
+ * under a temporary name and renamed, so it appears whole.
+ */
+static void write_result(Job *job, const char *line) {
+    char *tmp_filename;
+    FILE *f;
+
+    if (asprintf(&tmp_filename, "%s.tmp", job->result) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    f = fopen(tmp_filename, "w");
+    if (!f || fprintf(f, "%s\n", line) < 0 || fclose(f) != 0 ||
+        rename(tmp_filename, job->result) != 0) {
+        fprintf(stderr, "Error: could not write %s\n", job->result);
+        unlink(tmp_filename);
+    }
+    free(tmp_filename);
+
+    unlink(job->claim);
+}
+
+/*
+ * report writes the result of the job as one json line,
+ * stage names what failed, or is NULL on success
+ */
+static void report(Batch *b, Job *job, const char *stage,
+                   const char *error, double seconds) {
+    json_t *result;
+    char   *line;
+
+    result = json_object();
+    json_object_set_new(result, "id", json_string(job->id));
+    json_object_set_new(result, "session", job->session ?
+                        json_string(job->session) : json_null());
+    json_object_set_new(result, "output", job->output ?
+                        json_string(job->output) : json_null());
+    json_object_set_new(result, "status", json_string(stage ? "error" : "ok"));
+    json_object_set_new(result, "exit_code", json_integer(stage ? 1 : 0));
+    if (stage) {
+        json_object_set_new(result, "stage", json_string(stage));
+        json_object_set_new(result, "error", json_string(error));
+    }
+    json_object_set_new(result, "seconds", json_real(seconds));
+
+    line = json_dumps(result, JSON_COMPACT | JSON_PRESERVE_ORDER);
+    json_decref(result);
+    if (!line) {
+        fprintf(stderr, "Fatal: could not format job result\n");
+        exit(1);
+    }
+
+    if (job->result) {
+        write_result(job, line);
+    }
+
+    pthread_mutex_lock(&b->out_lock);
+    printf("%s\n", line);
+    fflush(stdout);
+    b->n_jobs++;
+    if (stage) b->n_failed++;
+    pthread_mutex_unlock(&b->out_lock);
+
+    free(line);
+}
+
+/*
+ * run_job renders one job with the decoder and scaler
+ * of the worker, and reports the result
+ */
+static void run_job(Batch *b, Job *job, RenderCache *cache) {
+    Session    *session;
+    const char *stage = NULL, *error = NULL;
+    int64_t     start;
+
+    start = av_gettime();
+
+    if (job->error[0]) {
+        stage = "job";
+        error = job->error;
+    } else {
+        session = session_open(job->session, job->opts.use_index);
+        if (!session) {
+            stage = "session";
+            error = "could not read the session";
+        } else {
+            if (render_session(session, &job->opts, job->output, cache) != 0) {
+                stage = "render";
+                error = "could not render the session";
+            }
+            session_free(session);
+        }
+    }
+
+    report(b, job, stage, error, (av_gettime() - start) / 1000000.0);
+}
+
+static void * batch_worker(void *arg) {
+    Batch       *b = arg;
+    RenderCache  cache;
+    Job         *job;
+
+    trace_thread_name("batch worker", 0);
+    render_cache_init(&cache);
+    while ((job = queue_pop(&b->queue))) {
+        run_job(b, job, &cache);
+        job_free(job);
+    }
+    render_cache_free(&cache);
+
+    return NULL;
+}
+
+/*
+ * read_job_list queues one job per line of the file,
+ * skipping blank lines and lines starting with #
+ */
+static void read_job_list(Batch *b, FILE *f) {
+    char    *line = NULL, *text;
+    char     id[32];
+    size_t   size = 0;
+    ssize_t  len;
+    long     line_no = 0;
+
+    while ((len = getline(&line, &size, f)) != -1) {
+        line_no++;
+
+        text = line;
+        while (*text == ' ' || *text == '\t') text++;
+        if (*text == '\0' || *text == '\n' || *text == '\r' || *text == '#') {
+            continue;
+        }
+
+        snprintf(id, sizeof(id), "%ld", line_no);
+        queue_push(&b->queue, parse_job_text(b->opts, text,
+                                             len - (text - line), id));
+    }
+
+    free(line);
+}
+
+static int is_directory(const char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t n = strlen(name), k = strlen(suffix);
+
+    return n > k && strcmp(name + n - k, suffix) == 0;
+}
+
+static int is_job_file(const struct dirent *entry) {
+    return entry->d_name[0] != '.' &&
+           has_suffix(entry->d_name, JOB_SUFFIX) &&
+           !has_suffix(entry->d_name, RESULT_SUFFIX);
+}
+
+/*
+ * claim_job takes the job file by renaming it, so that other
+ * processes watching the folder skip it
+ *
+ * returns the job, or NULL if someone else claimed it first
+ */
+static Job * claim_job(Batch *b, const char *dir, const char *name) {
+    char         *path, *claim, *result, *id;
+    json_error_t  error;
+    json_t       *root;
+    Job          *job;
+    size_t        id_len;
+
+    id_len = strlen(name) - strlen(JOB_SUFFIX);
+    if (asprintf(&path, "%s/%s", dir, name) < 0 ||
+        asprintf(&claim, "%s%s", path, CLAIM_SUFFIX) < 0 ||
+        asprintf(&result, "%s/%.*s%s", dir, (int)id_len, name,
+                 RESULT_SUFFIX) < 0 ||
+        asprintf(&id, "%.*s", (int)id_len, name) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    if (rename(path, claim) != 0) {
+        free(path);
+        free(claim);
+        free(result);
+        free(id);
+        return NULL;
+    }
+
+    root = json_load_file(claim, 0, &error);
+    if (root) {
+        job = parse_job(b->opts, root, id);
+        json_decref(root);
+    } else {
+        job = job_new(b->opts, id);
+        snprintf(job->error, JOB_ERROR_SIZE, "invalid json: %s", error.text);
+    }
+    job->claim = claim;
+    job->result = result;
+
+    free(path);
+    free(id);
+    return job;
+}
+
+/*
+ * watch_spool queues the job files of the folder in name
+ * order as they appear, until SIGINT or SIGTERM. Producers
+ * should write a job under another name and rename it to
+ * *.json once it is complete.
+ */
+static void watch_spool(Batch *b, const char *dir) {
+    struct dirent **entries;
+    Job            *job;
+    int             n, i, claimed;
+
+    while (!stop_requested) {
+        n = scandir(dir, &entries, is_job_file, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "Error: could not read spool folder %s\n", dir);
+            return;
+        }
+
+        claimed = 0;
+        for (i = 0; i < n; i++) {
+            if (!stop_requested) {
+                job = claim_job(b, dir, entries[i]->d_name);
+                if (job) {
+                    queue_push(&b->queue, job);
+                    claimed++;
+                }
+            }
+            free(entries[i]);
+        }
+        free(entries);
+
+        if (claimed == 0) {
+            sleep(SPOOL_POLL_SECS);
+        }
+    }
+}
+
+/*
+ * batch_run renders the jobs of opts->jobs, a job file, -
+ * for stdin or a spool folder, on opts->workers threads
+ *
+ * returns 0 if every job succeeded, 1 otherwise
+ */
+int batch_run(const Options *opts) {
+    struct sigaction  action;
+    sigset_t          signals, old_signals;
+    pthread_t        *workers;
+    Batch             b;
+    FILE             *f;
+    int               n_workers, i, spool;
+    long              cores;
+
+    spool = strcmp(opts->jobs, "-") != 0 && is_directory(opts->jobs);
+
+    b.opts = opts;
+    b.n_jobs = 0;
+    b.n_failed = 0;
+    b.queue.head = 0;
+    b.queue.count = 0;
+    b.queue.closed = 0;
+    pthread_mutex_init(&b.queue.lock, NULL);
+    pthread_cond_init(&b.queue.not_empty, NULL);
+    pthread_cond_init(&b.queue.not_full, NULL);
+    pthread_mutex_init(&b.out_lock, NULL);
+
+    /* the workers open codecs concurrently */
+    register_lock_manager();
+
+    n_workers = opts->workers;
+    if (n_workers == 0) {
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = cores > 0 ? (int)cores : 1;
+    }
+
+    workers = malloc(n_workers * sizeof(pthread_t));
+    if (!workers) {
+        fprintf(stderr, "Fatal: could not allocate workers\n");
+        exit(1);
+    }
+
+    /* stop signals go to the reading thread only */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, batch_worker, &b) != 0) {
+            fprintf(stderr, "Fatal: could not start batch worker\n");
+            exit(1);
+        }
+    }
+
+    if (spool) {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_stop;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    if (spool) {
+        watch_spool(&b, opts->jobs);
+    } else if (strcmp(opts->jobs, "-") == 0) {
+        read_job_list(&b, stdin);
+    } else {
+        f = fopen(opts->jobs, "r");
+        if (!f) {
+            fprintf(stderr, "Error: could not open job file %s\n", opts->jobs);
+            b.n_failed++;
+        } else {
+            read_job_list(&b, f);
+            fclose(f);
+        }
+    }
+
+    /* the jobs already queued still run */
+    queue_close(&b.queue);
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    fprintf(stderr, "Batch: %d jobs, %d failed\n", b.n_jobs, b.n_failed);
+
+    pthread_mutex_destroy(&b.out_lock);
+    pthread_cond_destroy(&b.queue.not_full);
+    pthread_cond_destroy(&b.queue.not_empty);
+    pthread_mutex_destroy(&b.queue.lock);
+
+    return b.n_failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "options.h"
+
+/*
+ * Batch mode renders many sessions in one process, on a
+ * fixed pool of worker threads that each keep their decoder
+ * and scaler from one job to the next.
+ *
+ * Jobs are json objects, one per line of a job file or of
+ * stdin, or one per file in a spool folder:
+ *
+ *   {"id": "run-42", "session": "/data/42", "output": "/out/42.mp4",
+ *    "profile": "fast", "fps": 10, "vfr": true, "crf": 28}
+ *
+ * "session" and "output" are required, "id" defaults to the
+ * line number or the file name. "profile" names a built-in
+ * profile, "fps", "vfr", "index" and "append" override the
+ * command line and any other key is a profile field. One
+ * json result per job is written to stdout, and in spool
+ * mode also next to the job file.
+ */
+
+int batch_run(const Options *opts);
+
+#endif
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Runs cruncher over a fixed matrix of synthetic sessions and render
+modes, and compares frames per second, millisecs per screenshot and peak
+memory with a stored baseline.
+
+Sessions are generated once with bench/gensession into bench/work and
+kept until their parameters change. Each run is repeated and the fastest
+one counts. The numbers come from cruncher --stats.
+
+    bench/bench.py                    compare with bench/baseline.json
+    bench/bench.py --save-baseline    store this machine's numbers
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+WORK = os.path.join(HERE, "work")
+CRUNCHER = os.path.join(ROOT, "cruncher")
+GENSESSION = os.path.join(HERE, "gensession")
+BASELINE = os.path.join(HERE, "baseline.json")
+
+# name -> gensession arguments
+SESSIONS = {
+    "phone-static": ["--size", "1080x1920", "--shots", "300",
+                     "--change", "0.1", "--duplicates", "0.5",
+                     "--gestures", "10"],
+    "phone-busy":   ["--size", "1080x1920", "--shots", "300",
+                     "--change", "0.6", "--duplicates", "0.05",
+                     "--gestures", "60"],
+    "phone-1440p":  ["--size", "1440x2560", "--shots", "150",
+                     "--change", "0.3", "--duplicates", "0.2",
+                     "--gestures", "20"],
+    "tablet-clock": ["--size", "2048x1536", "--shots", "150",
+                     "--change", "0.3", "--duplicates", "0.2",
+                     "--clock", "--gestures", "20"],
+}
+
+# name -> cruncher arguments
+MODES = {
+    "default": [],
+    "threads": ["--decode-threads", "4", "--profile", "fast"],
+    "vfr":     ["--vfr"],
+    "convert": ["--scaler", "fast_bilinear", "--convert-threads", "4"],
+}
+
+# metric -> True if higher is better
+METRICS = {
+    "fps": True,
+    "ms_per_shot": False,
+    "peak_rss_kb": False,
+}
+
+
+def session_dir(name):
+    """Generates the session unless it exists with the same arguments."""
+    path = os.path.join(WORK, name)
+    stamp = os.path.join(path, ".args")
+    args = SESSIONS[name]
+    if os.path.exists(stamp):
+        with open(stamp) as f:
+            if json.load(f) == args:
+                return path
+    subprocess.run(["rm", "-rf", path], check=True)
+    print("generating %s" % name, flush=True)
+    subprocess.run([GENSESSION] + args + [path], check=True,
+                   stdout=subprocess.DEVNULL)
+    with open(stamp, "w") as f:
+        json.dump(args, f)
+    return path
+
+
+def count_shots(path):
+    with open(os.path.join(path, "Screen", "videodata.json")) as f:
+        return len(json.load(f)["timestamps"])
+
+
+def run_once(session, mode):
+    """Renders the session once and returns its metrics."""
+    out = os.path.join(WORK, "out.mp4")
+    stats = os.path.join(WORK, "stats.json")
+    cmd = [CRUNCHER, "--quiet", "--no-index", "--stats", stats] + \
+        MODES[mode] + [session, out]
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+    with open(stats) as f:
+        s = json.load(f)
+    os.unlink(out)
+    return {
+        "fps": s["frames_per_second"],
+        "ms_per_shot": 1000.0 * s["wall_seconds"] / count_shots(session),
+        "peak_rss_kb": s["peak_rss_kb"],
+    }
+
+
+def best(runs):
+    return {m: (max if up else min)(r[m] for r in runs)
+            for m, up in METRICS.items()}
+
+
+def change(metric, value, base):
+    """Returns the relative change, positive when better."""
+    if not base:
+        return 0.0
+    delta = (value - base) / base
+    return delta if METRICS[metric] else -delta
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--save-baseline", action="store_true",
+                        help="store the results as the baseline")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs per case, the best counts (default 3)")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="percent worse than the baseline that fails "
+                             "(default 10)")
+    parser.add_argument("--only", help="run the cases containing this")
+    args = parser.parse_args()
+
+    for tool in (CRUNCHER, GENSESSION):
+        if not os.access(tool, os.X_OK):
+            sys.exit("%s is missing, run make bench" % tool)
+    os.makedirs(WORK, exist_ok=True)
+
+    baseline = {}
+    if os.path.exists(BASELINE):
+        with open(BASELINE) as f:
+            baseline = json.load(f)
+    elif not args.save_baseline:
+        print("no baseline yet, store one with make bench-baseline")
+
+    results = {}
+    failed = []
+    print("%-22s %10s %12s %12s" % ("case", "fps", "ms/shot", "peak MB"))
+    for name in SESSIONS:
+        for mode in MODES:
+            case = "%s/%s" % (name, mode)
+            if args.only and args.only not in case:
+                continue
+            path = session_dir(name)
+            r = best([run_once(path, mode) for _ in range(args.repeat)])
+            results[case] = r
+
+            line = "%-22s %10.1f %12.2f %12.1f" % (
+                case, r["fps"], r["ms_per_shot"], r["peak_rss_kb"] / 1024.0)
+            base = baseline.get(case)
+            if base:
+                deltas = {m: change(m, r[m], base.get(m)) for m in METRICS}
+                line += "   " + " ".join(
+                    "%s %+.1f%%" % (m, 100 * d) for m, d in deltas.items())
+                if any(d < -args.threshold / 100 for d in deltas.values()):
+                    line += "  REGRESSION"
+                    failed.append(case)
+            print(line, flush=True)
+
+    if args.save_baseline:
+        baseline.update(results)
+        with open(BASELINE, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("baseline saved to %s" % BASELINE)
+    elif failed:
+        sys.exit("%d cases more than %.0f%% worse than the baseline" %
+                 (len(failed), args.threshold))
+
+
+if __name__ == "__main__":
+    main()
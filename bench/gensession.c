@@ -0,0 +1,442 @@
+/*
+ * gensession writes a synthetic recording session, the
+ * Screen folder of PNG screenshots with videodata.json and
+ * the Touch folder with touch.json, for benchmarks.
+ *
+ * The screenshots look like a list of cards on a plain
+ * background. Each new screenshot redraws a band of cards
+ * covering a share of the screen, some screenshots repeat
+ * the one before them byte for byte, and with --clock a
+ * small status bar clock changes on every screenshot. The
+ * touch file holds swipe gestures at a given rate. All
+ * choices come from a seeded generator, so the same
+ * arguments give the same session.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <jansson.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+
+#define BASE_TIME 1456789012345L
+#define CARD_HEIGHT_DIV 12  /* cards per screen height */
+#define CLOCK_HEIGHT_DIV 40
+#define MOVE_INTERVAL 16    /* millisecs between move events */
+
+typedef struct GenOptions {
+    const char *dst;
+    int         width, height;
+    int         shots;
+    int         interval;    /* mean millisecs between screenshots */
+    double      change;      /* share of the screen redrawn */
+    double      duplicates;  /* share of repeated screenshots */
+    double      gestures;    /* swipe gestures per minute */
+    int         clock;
+    unsigned    seed;
+} GenOptions;
+
+static unsigned long long rng_state;
+
+/*
+ * rng returns the next number of a 64 bit xorshift generator
+ */
+static unsigned long long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* rng_int returns a number in [lo, hi] */
+static int rng_int(int lo, int hi) {
+    return lo + (int)(rng() % (unsigned long long)(hi - lo + 1));
+}
+
+static double rng_unit(void) {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void fill_rect(AVFrame *frame, int x0, int y0, int x1, int y1,
+                      uint32_t rgba) {
+    uint8_t c[4] = { rgba >> 24, rgba >> 16, rgba >> 8, 255 };
+    int     x, y;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > frame->width) x1 = frame->width;
+    if (y1 > frame->height) y1 = frame->height;
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *p = frame->data[0] + y*frame->linesize[0] + x0*4;
+        for (x = x0; x < x1; x++, p += 4) {
+            memcpy(p, c, 4);
+        }
+    }
+}
+
+/*
+ * draw_cards redraws the rows [y0, y1) as list cards with a
+ * picture and a few lines of text in random colors
+ */
+static void draw_cards(AVFrame *frame, int y0, int y1) {
+    int      card = frame->height / CARD_HEIGHT_DIV;
+    int      margin = card / 8, y, line, lines;
+    uint32_t color;
+
+    if (card < 8) card = 8;
+    fill_rect(frame, 0, y0, frame->width, y1, 0xf2f2f2ff);
+
+    for (y = y0 - y0 % card; y < y1; y += card) {
+        color = (uint32_t)rng() | 0xff;
+        /* picture */
+        fill_rect(frame, margin, y + margin, margin + card - 2*margin,
+                  y + card - margin, color);
+        /* text lines */
+        lines = rng_int(1, 3);
+        for (line = 0; line < lines; line++) {
+            int ty = y + margin + line * (card - 2*margin) / 3;
+            fill_rect(frame, card + margin, ty,
+                      rng_int(card + 4*margin, frame->width - margin),
+                      ty + margin, 0x333333ff);
+        }
+    }
+}
+
+static void draw_clock(AVFrame *frame, int tick) {
+    int h = frame->height / CLOCK_HEIGHT_DIV;
+
+    fill_rect(frame, 0, 0, frame->width, h, 0x202020ff);
+    /* the digits, as bars of changing width */
+    fill_rect(frame, frame->width - 6*h, h/4,
+              frame->width - 6*h + (tick % 60 + 1) * 4*h / 60, 3*h/4,
+              0xffffffff);
+}
+
+/*
+ * write_png encodes the frame into the file
+ *
+ * returns the encoded size, exits on failure
+ */
+static int write_png(AVCodecContext *enc, AVFrame *frame, const char *path) {
+    AVPacket pkt;
+    FILE    *f;
+    int      got, size;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    if (avcodec_encode_video2(enc, &pkt, frame, &got) < 0 || !got) {
+        fprintf(stderr, "Fatal: could not encode %s\n", path);
+        exit(1);
+    }
+
+    f = fopen(path, "wb");
+    if (!f || fwrite(pkt.data, 1, pkt.size, f) != (size_t)pkt.size ||
+        fclose(f) != 0) {
+        fprintf(stderr, "Fatal: could not write %s\n", path);
+        exit(1);
+    }
+    size = pkt.size;
+    av_free_packet(&pkt);
+    return size;
+}
+
+static void copy_file(const char *src, const char *dst) {
+    char   buf[1 << 16];
+    FILE  *in, *out;
+    size_t n;
+
+    in = fopen(src, "rb");
+    out = fopen(dst, "wb");
+    if (!in || !out) {
+        fprintf(stderr, "Fatal: could not copy %s\n", src);
+        exit(1);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            fprintf(stderr, "Fatal: could not write %s\n", dst);
+            exit(1);
+        }
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Fatal: could not write %s\n", dst);
+        exit(1);
+    }
+}
+
+static char * join(const char *dir, const char *name) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+    return path;
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && access(path, W_OK) != 0) {
+        fprintf(stderr, "Fatal: could not create %s\n", path);
+        exit(1);
+    }
+}
+
+/*
+ * gen_screenshots writes the screenshots and videodata.json
+ *
+ * returns the time of the last screenshot
+ */
+static long gen_screenshots(const GenOptions *o, const char *screen_dir) {
+    AVCodec        *codec;
+    AVCodecContext *enc;
+    AVFrame        *frame;
+    json_t         *root, *stamps, *stamp;
+    char            name[32], prev_name[32] = "";
+    char           *path, *prev_path, *json_path;
+    long            time = BASE_TIME;
+    long            bytes = 0;
+    int             i, band, y, repeat, dups = 0;
+
+    codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    enc = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!enc) {
+        fprintf(stderr, "Fatal: no PNG encoder\n");
+        exit(1);
+    }
+    enc->width = o->width;
+    enc->height = o->height;
+    enc->pix_fmt = AV_PIX_FMT_RGBA;
+    enc->time_base = (AVRational){ 1, 25 };
+    if (avcodec_open2(enc, codec, NULL) < 0) {
+        fprintf(stderr, "Fatal: could not open the PNG encoder\n");
+        exit(1);
+    }
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Fatal: could not allocate frame\n");
+        exit(1);
+    }
+    frame->width = o->width;
+    frame->height = o->height;
+    frame->format = AV_PIX_FMT_RGBA;
+    if (av_frame_get_buffer(frame, 32) < 0) {
+        fprintf(stderr, "Fatal: could not allocate frame\n");
+        exit(1);
+    }
+    draw_cards(frame, 0, o->height);
+
+    root = json_object();
+    stamps = json_array();
+    json_object_set_new(root, "timestamps", stamps);
+
+    for (i = 0; i < o->shots; i++) {
+        snprintf(name, sizeof(name), "%06d.png", i);
+        path = join(screen_dir, name);
+
+        repeat = i > 0 && rng_unit() < o->duplicates;
+        dups += repeat;
+
+        if (repeat && !o->clock) {
+            prev_path = join(screen_dir, prev_name);
+            copy_file(prev_path, path);
+            free(prev_path);
+        } else {
+            if (i > 0 && !repeat) {
+                /* a band of new cards */
+                band = (int)(o->change * o->height);
+                if (band < 1) band = 1;
+                y = rng_int(0, o->height - band);
+                draw_cards(frame, y, y + band);
+            }
+            if (o->clock) {
+                draw_clock(frame, i);
+            }
+            bytes += write_png(enc, frame, path);
+        }
+        free(path);
+
+        stamp = json_object();
+        json_object_set_new(stamp, "name", json_string(name));
+        json_object_set_new(stamp, "time", json_integer(time));
+        json_array_append_new(stamps, stamp);
+
+        strcpy(prev_name, name);
+        if (i < o->shots - 1) {
+            time += rng_int(o->interval / 2 + 1, o->interval * 3 / 2 + 1);
+        }
+    }
+
+    json_path = join(screen_dir, "videodata.json");
+    if (json_dump_file(root, json_path, JSON_INDENT(1)) != 0) {
+        fprintf(stderr, "Fatal: could not write %s\n", json_path);
+        exit(1);
+    }
+    printf("%d screenshots, %d repeated, %ld KB of PNG\n", o->shots, dups,
+           bytes / 1024);
+
+    free(json_path);
+    json_decref(root);
+    av_frame_free(&frame);
+    avcodec_close(enc);
+    av_free(enc);
+
+    return time;
+}
+
+static void add_event(json_t *events, long time, const char *action,
+                      int x, int y) {
+    json_t *event = json_object();
+
+    json_object_set_new(event, "timestamp", json_integer(time));
+    json_object_set_new(event, "action", json_string(action));
+    json_object_set_new(event, "index", json_integer(0));
+    json_object_set_new(event, "x", json_integer(x));
+    json_object_set_new(event, "y", json_integer(y));
+    json_array_append_new(events, event);
+}
+
+/*
+ * gen_touches writes touch.json with swipes spread over
+ * the session up to end
+ */
+static void gen_touches(const GenOptions *o, const char *touch_dir, long end) {
+    json_t *root, *color, *events;
+    char   *json_path;
+    long    time, stop, gap;
+    int     x, y, dx, dy, n = 0;
+
+    root = json_object();
+    color = json_object();
+    json_object_set_new(color, "r", json_integer(255));
+    json_object_set_new(color, "g", json_integer(0));
+    json_object_set_new(color, "b", json_integer(0));
+    json_object_set_new(color, "a", json_integer(255));
+    json_object_set_new(root, "color", color);
+    events = json_array();
+    json_object_set_new(root, "events", events);
+
+    gap = o->gestures > 0 ? (long)(60000 / o->gestures) : 0;
+    for (time = BASE_TIME; gap > 0; ) {
+        time += rng_int(gap / 2 + 1, gap * 3 / 2 + 1);
+        stop = time + rng_int(100, 600);
+        if (stop >= end) break;
+
+        x = rng_int(0, o->width - 1);
+        y = rng_int(0, o->height - 1);
+        dx = rng_int(-o->width / 40, o->width / 40);
+        dy = rng_int(-o->height / 40, o->height / 40);
+
+        add_event(events, time, "down", x, y);
+        for (time += MOVE_INTERVAL; time < stop; time += MOVE_INTERVAL) {
+            x += dx;
+            y += dy;
+            add_event(events, time, "move", x, y);
+        }
+        add_event(events, time, "up", x, y);
+        n++;
+    }
+
+    json_path = join(touch_dir, "touch.json");
+    if (json_dump_file(root, json_path, JSON_INDENT(1)) != 0) {
+        fprintf(stderr, "Fatal: could not write %s\n", json_path);
+        exit(1);
+    }
+    printf("%d gestures, %zu touch events\n", n, json_array_size(events));
+
+    free(json_path);
+    json_decref(root);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <session folder>\n"
+           "\n"
+           "Options:\n"
+           "  --size WxH          screenshot size (default 1080x1920)\n"
+           "  --shots N           number of screenshots (default 200)\n"
+           "  --interval MS       mean time between screenshots (default 500)\n"
+           "  --change F          share of the screen redrawn per screenshot,\n"
+           "                      0 to 1 (default 0.3)\n"
+           "  --duplicates F      share of screenshots repeating the one\n"
+           "                      before, 0 to 1 (default 0.2)\n"
+           "  --clock             change a status bar clock on every\n"
+           "                      screenshot, repeats then differ there\n"
+           "  --gestures N        swipe gestures per minute (default 20)\n"
+           "  --seed N            random seed (default 1)\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        { "size",       required_argument, NULL, 's' },
+        { "shots",      required_argument, NULL, 'n' },
+        { "interval",   required_argument, NULL, 'i' },
+        { "change",     required_argument, NULL, 'c' },
+        { "duplicates", required_argument, NULL, 'd' },
+        { "clock",      no_argument,       NULL, 'k' },
+        { "gestures",   required_argument, NULL, 'g' },
+        { "seed",       required_argument, NULL, 'r' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    GenOptions o = { NULL, 1080, 1920, 200, 500, 0.3, 0.2, 20, 0, 1 };
+    char      *screen_dir, *touch_dir;
+    long       end;
+    int        c;
+
+    while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            if (sscanf(optarg, "%dx%d", &o.width, &o.height) != 2 ||
+                o.width < 16 || o.height < 16) {
+                fprintf(stderr, "Fatal: invalid size '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n': o.shots = atoi(optarg); break;
+        case 'i': o.interval = atoi(optarg); break;
+        case 'c': o.change = atof(optarg); break;
+        case 'd': o.duplicates = atof(optarg); break;
+        case 'k': o.clock = 1; break;
+        case 'g': o.gestures = atof(optarg); break;
+        case 'r': o.seed = (unsigned)atoi(optarg); break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || o.shots < 2 || o.interval < 1 ||
+        o.change < 0 || o.change > 1 ||
+        o.duplicates < 0 || o.duplicates > 1 || o.gestures < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    o.dst = argv[optind];
+    rng_state = 0x9e3779b97f4a7c15ULL ^ o.seed;
+
+    avcodec_register_all();
+
+    make_dir(o.dst);
+    screen_dir = join(o.dst, "Screen");
+    touch_dir = join(o.dst, "Touch");
+    make_dir(screen_dir);
+    make_dir(touch_dir);
+
+    end = gen_screenshots(&o, screen_dir);
+    gen_touches(&o, touch_dir, end);
+
+    free(screen_dir);
+    free(touch_dir);
+    return 0;
+}
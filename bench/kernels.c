@@ -0,0 +1,719 @@
+/*
+ * kernels times the inner loops of a render in isolation,
+ * on fixed frames at a range of resolutions: the touch
+ * overlay run kernels, drawing touches in RGBA and in YUV,
+ * building the touch masks, the RGBA to YUV420P conversion by
+ * swscale and by the SIMD converter, the timestamp
+ * arithmetic and frame allocation.
+ *
+ * Each kernel runs a few warmup rounds and then a number of
+ * timed repetitions. The median and fastest repetition are
+ * reported as nanosecs per frame, together with nanosecs
+ * per pixel and TSC cycles per frame, so changes to the
+ * overlay or conversion paths can be held against the
+ * scalar code. After the table of each resolution the
+ * largest difference of the SIMD converter from swscale
+ * is printed, and whether swscale converting in bands of
+ * rows, as for touch strips and --convert-threads, gives
+ * the same frame as converting it whole.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "actualizer.h"
+#include "video.h"
+#include "yuvconv.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_RUNS
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_SIZES  "720x1280,1080x1920,1440x2560"
+#define DEFAULT_WARMUP 5
+#define DEFAULT_REPS   50
+#define MAX_SIZES      16
+#define TIMESTAMP_CALLS 1000 /* timestamp calls per repetition */
+#define ALLOC_CALLS     16   /* allocations per repetition */
+#define TOUCH_COLOR    0xff3366ffu
+#define STRIP_BANDS    4    /* bands of the strip comparison */
+
+/* instruction sets a kernel needs */
+#define NEEDS_SSE4     1
+#define NEEDS_AVX2     2
+
+/* the fixed frames and state of one resolution */
+typedef struct Bench {
+    int                 width, height;
+    AVFrame            *rgba;
+    AVFrame            *yuv;
+    struct SwsContext  *sc_bilinear;
+    struct SwsContext  *sc_fast;
+    YUVConverter       *conv[3]; /* C, SSE4.1 and AVX2, if supported */
+    AVFrame            *yuv_conv;
+    TouchActualizer    *ta;     /* a down and a move touch active */
+    Frame              *frame;
+    YUVFrame            yuv_frame;
+    volatile long       sink;  /* keeps results alive */
+} Bench;
+
+typedef struct Kernel {
+    const char *name;
+    /* runs calls frames of work, returns the pixels of one */
+    long      (*run)(Bench *b);
+    int         calls;
+    int         needs;
+} Kernel;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_X86_RUNS
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * frame_pixels returns the width times the height of the
+ * bench frames
+ */
+static long frame_pixels(Bench *b) {
+    return (long)b->width * b->height;
+}
+
+/*
+ * mask_pixels returns the number of pixels of a touch mask
+ */
+static long mask_pixels(TouchMask *mask) {
+    long n = 0;
+    int  i;
+
+    for (i = 0; i <= 2 * mask->radius; i++) {
+        n += mask->spans[i].x_end - mask->spans[i].x_start;
+    }
+    return n;
+}
+
+/*
+ * The run kernels go over every row of the frame, so the
+ * pixels per nanosec are those of long runs. Touch circles
+ * have runs of a few dozen pixels, see actualize_event.
+ */
+static long invert_rows(Bench *b, void (*kernel)(uint8_t *, int)) {
+    int y;
+
+    for (y = 0; y < b->height; y++) {
+        kernel(b->rgba->data[0] + y * b->rgba->linesize[0], b->width);
+    }
+    return frame_pixels(b);
+}
+
+static long colorize_rows(Bench *b, void (*kernel)(uint8_t *, int, uint32_t)) {
+    int y;
+
+    for (y = 0; y < b->height; y++) {
+        kernel(b->rgba->data[0] + y * b->rgba->linesize[0], b->width,
+               TOUCH_COLOR);
+    }
+    return frame_pixels(b);
+}
+
+static long invert_scalar(Bench *b) {
+    return invert_rows(b, invertRunScalar);
+}
+
+static long colorize_scalar(Bench *b) {
+    return colorize_rows(b, colorizeRunScalar);
+}
+
+#ifdef HAVE_X86_RUNS
+static long invert_sse2(Bench *b) {
+    return invert_rows(b, invertRunSSE2);
+}
+
+static long colorize_sse2(Bench *b) {
+    return colorize_rows(b, colorizeRunSSE2);
+}
+
+static long invert_avx2(Bench *b) {
+    return invert_rows(b, invertRunAVX2);
+}
+
+static long colorize_avx2(Bench *b) {
+    return colorize_rows(b, colorizeRunAVX2);
+}
+#endif
+
+/*
+ * actualize_event draws a down and a move touch in the
+ * middle of the frame, as one frame with two fingers
+ */
+static long actualize_event(Bench *b) {
+    actualizeEvent(b->ta, &b->ta->active_events[0], b->frame);
+    actualizeEvent(b->ta, &b->ta->active_events[1], b->frame);
+    return mask_pixels(b->ta->down_touch_mask) +
+           mask_pixels(b->ta->move_touch_mask);
+}
+
+/*
+ * draw_touches_yuv draws the same touches into the converted
+ * frame, as for planar YUV output
+ */
+static long draw_yuv(Bench *b) {
+    draw_touches_yuv(b->ta, &b->yuv_frame);
+    return mask_pixels(b->ta->down_touch_mask) +
+           mask_pixels(b->ta->move_touch_mask);
+}
+
+/*
+ * touch_mask_new builds and frees the two masks of a
+ * TouchActualizer for the frame size
+ */
+static long touch_mask_new(Bench *b) {
+    int        min_size = b->width < b->height ? b->width : b->height;
+    TouchMask *down, *move;
+    long       pixels;
+
+    down = TouchMask_new(min_size / R_DOWN_TOUCH_RADIUS);
+    move = TouchMask_new(min_size / R_MOVE_TOUCH_RADIUS);
+    pixels = mask_pixels(down) + mask_pixels(move);
+    b->sink += down->spans[0].x_end + move->spans[0].x_end;
+    TouchMask_destroy(down);
+    TouchMask_destroy(move);
+    return pixels;
+}
+
+static long scale(Bench *b, struct SwsContext *sc) {
+    sws_scale(sc, (const unsigned char *const *)b->rgba->data,
+              (const int *)b->rgba->linesize, 0, b->height,
+              b->yuv->data, b->yuv->linesize);
+    return frame_pixels(b);
+}
+
+/* the scaler of the default profile */
+static long sws_bilinear(Bench *b) {
+    return scale(b, b->sc_bilinear);
+}
+
+/* the scaler of the fast profile */
+static long sws_fast_bilinear(Bench *b) {
+    return scale(b, b->sc_fast);
+}
+
+static long yuvconv(Bench *b, YUVConverter *conv) {
+    yuv_converter_convert(conv, b->rgba, b->yuv_conv);
+    return frame_pixels(b);
+}
+
+static long yuvconv_c(Bench *b) {
+    return yuvconv(b, b->conv[0]);
+}
+
+static long yuvconv_sse4(Bench *b) {
+    return yuvconv(b, b->conv[1]);
+}
+
+static long yuvconv_avx2(Bench *b) {
+    return yuvconv(b, b->conv[2]);
+}
+
+/*
+ * timestamps does the arithmetic of one constant frame rate
+ * frame: the frames of a screenshot interval and the
+ * timestamp of a pts
+ */
+static long timestamps(Bench *b) {
+    static int pts;
+    int        i;
+
+    for (i = 0; i < TIMESTAMP_CALLS; i++) {
+        b->sink += interval_to_frames(500 + (i & 255), 25);
+        b->sink += pts_to_timestamp(1456789012345L, pts++, 25);
+    }
+    return 0;
+}
+
+/*
+ * alloc_yuv allocates and frees an output frame, what each
+ * frame costs without a frame pool
+ */
+static long alloc_yuv(Bench *b) {
+    AVFrame *frame;
+    int      i;
+
+    for (i = 0; i < ALLOC_CALLS; i++) {
+        frame = alloc_frame(b->width, b->height, AV_PIX_FMT_YUV420P);
+        b->sink += frame->linesize[0];
+        av_frame_free(&frame);
+    }
+    return 0;
+}
+
+static const Kernel kernels[] = {
+    { "invert_scalar",     invert_scalar,     1, 0 },
+#ifdef HAVE_X86_RUNS
+    { "invert_sse2",       invert_sse2,       1, 0 },
+    { "invert_avx2",       invert_avx2,       1, NEEDS_AVX2 },
+#endif
+    { "colorize_scalar",   colorize_scalar,   1, 0 },
+#ifdef HAVE_X86_RUNS
+    { "colorize_sse2",     colorize_sse2,     1, 0 },
+    { "colorize_avx2",     colorize_avx2,     1, NEEDS_AVX2 },
+#endif
+    { "actualize_event",   actualize_event,   1, 0 },
+    { "draw_touches_yuv",  draw_yuv,          1, 0 },
+    { "touch_mask_new",    touch_mask_new,    1, 0 },
+    { "sws_bilinear",      sws_bilinear,      1, 0 },
+    { "sws_fast_bilinear", sws_fast_bilinear, 1, 0 },
+    { "yuvconv_c",         yuvconv_c,         1, 0 },
+#ifdef HAVE_X86_RUNS
+    { "yuvconv_sse4",      yuvconv_sse4,      1, NEEDS_SSE4 },
+    { "yuvconv_avx2",      yuvconv_avx2,      1, NEEDS_AVX2 },
+#endif
+    { "timestamps",        timestamps,        TIMESTAMP_CALLS, 0 },
+    { "alloc_frame",       alloc_yuv,         ALLOC_CALLS, 0 },
+};
+
+#define N_KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+/*
+ * fill_frame draws a fixed pattern of gradients and noise,
+ * so the conversion does not run on a flat color
+ */
+static void fill_frame(AVFrame *frame) {
+    unsigned state = 1;
+    uint8_t *p;
+    int      x, y;
+
+    for (y = 0; y < frame->height; y++) {
+        p = frame->data[0] + y * frame->linesize[0];
+        for (x = 0; x < frame->width; x++) {
+            state = state * 1103515245u + 12345u;
+            p[4 * x + 0] = (uint8_t)(x + (state >> 28));
+            p[4 * x + 1] = (uint8_t)(y + (state >> 24));
+            p[4 * x + 2] = (uint8_t)(x ^ y);
+            p[4 * x + 3] = 255;
+        }
+    }
+}
+
+static struct SwsContext * scaler(int width, int height, int format,
+                                  int method) {
+    struct SwsContext *sc;
+
+    sc = sws_getContext(width, height, AV_PIX_FMT_RGBA,
+                        width, height, format,
+                        method, NULL, NULL, NULL);
+    if (!sc) {
+        fprintf(stderr, "Fatal: Could not allocate scaling context\n");
+        exit(1);
+    }
+    return sc;
+}
+
+/*
+ * bench_new sets up the frames, scalers and touches of one
+ * resolution
+ *
+ * side effects: allocates a Bench, must be freed with
+ * bench_free
+ */
+static Bench * bench_new(int width, int height) {
+    static const enum YUVKernel conv_kernels[3] = {
+        YUV_KERNEL_C, YUV_KERNEL_SSE4, YUV_KERNEL_AVX2
+    };
+    Bench *b;
+    int    i;
+
+    b = calloc(1, sizeof(Bench));
+    if (!b) {
+        fprintf(stderr, "Fatal: could not allocate bench\n");
+        exit(1);
+    }
+    b->width = width;
+    b->height = height;
+    b->rgba = alloc_frame(width, height, AV_PIX_FMT_RGBA);
+    b->yuv = alloc_frame(width, height, AV_PIX_FMT_YUV420P);
+    fill_frame(b->rgba);
+
+    b->sc_bilinear = scaler(width, height, AV_PIX_FMT_YUV420P, SWS_BILINEAR);
+    b->sc_fast = scaler(width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR);
+    b->yuv_conv = alloc_frame(width, height, AV_PIX_FMT_YUV420P);
+    for (i = 0; i < 3; i++) {
+        b->conv[i] = yuv_converter_new(width, height, AV_PIX_FMT_RGBA,
+                                       width, height, AV_PIX_FMT_YUV420P,
+                                       YUV_BT601, conv_kernels[i]);
+    }
+
+    /* no events, the two touches are set active directly */
+    b->ta = TouchActualizer_new_with_data(
+        TouchData_new_packed(0, NULL, NULL, NULL, NULL, NULL, 0,
+                             (RGBA_color){ 255, 51, 102, 255 }),
+        width, height);
+    b->ta->active_events = calloc(2, sizeof(Event));
+    if (!b->ta->active_events) {
+        fprintf(stderr, "Fatal: could not allocate touches\n");
+        exit(1);
+    }
+    b->ta->n_slots = 2;
+    b->ta->active_events[0] = (Event){ down, { width / 3, height / 2 }, 1 };
+    b->ta->active_events[1] = (Event){ move, { 2 * width / 3, height / 2 }, 1 };
+
+    b->frame = Frame_new(b->rgba->data[0], b->rgba->linesize[0],
+                         width, height, 0);
+    b->yuv_frame = (YUVFrame){
+        { b->yuv->data[0], b->yuv->data[1], b->yuv->data[2] },
+        { b->yuv->linesize[0], b->yuv->linesize[1], b->yuv->linesize[2] },
+        width, height, 1, 1, 0
+    };
+    return b;
+}
+
+static void bench_free(Bench *b) {
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        yuv_converter_free(b->conv[i]);
+    }
+    av_frame_free(&b->yuv_conv);
+    Frame_destroy(b->frame);
+    TouchActualizer_destroy(b->ta);
+    sws_freeContext(b->sc_bilinear);
+    sws_freeContext(b->sc_fast);
+    av_frame_free(&b->rgba);
+    av_frame_free(&b->yuv);
+    free(b);
+}
+
+/*
+ * max_diff returns the largest difference between the
+ * samples of plane p of two YUV420P frames
+ */
+static int max_diff(AVFrame *a, AVFrame *b, int p) {
+    int width = p ? (a->width + 1) / 2 : a->width;
+    int height = p ? (a->height + 1) / 2 : a->height;
+    int x, y, d, max = 0;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            d = a->data[p][y * a->linesize[p] + x] -
+                b->data[p][y * b->linesize[p] + x];
+            if (d < 0) d = -d;
+            if (d > max) max = d;
+        }
+    }
+    return max;
+}
+
+/*
+ * print_diffs prints how far the SIMD converter is from
+ * the two swscale scalers on the bench frame
+ *
+ * returns the largest difference from the fast bilinear
+ * scaler, the one the converter stands in for
+ */
+static int print_diffs(Bench *b) {
+    struct SwsContext *sc[2] = { b->sc_bilinear, b->sc_fast };
+    const char        *names[2] = { "bilinear", "fast_bilinear" };
+    int                i, p, d, max = 0;
+
+    yuv_converter_convert(b->conv[0], b->rgba, b->yuv_conv);
+    for (i = 0; i < 2; i++) {
+        scale(b, sc[i]);
+        printf("yuvconv max diff from %s at %dx%d: Y %d U %d V %d\n",
+               names[i], b->width, b->height,
+               max_diff(b->yuv, b->yuv_conv, 0),
+               max_diff(b->yuv, b->yuv_conv, 1),
+               max_diff(b->yuv, b->yuv_conv, 2));
+        for (p = 0; i == 1 && p < 3; p++) {
+            d = max_diff(b->yuv, b->yuv_conv, p);
+            if (d > max) max = d;
+        }
+    }
+    return max;
+}
+
+/*
+ * same_frame tells if two frames of the same format and size
+ * hold the same samples
+ */
+static int same_frame(const AVFrame *a, const AVFrame *b) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+    int                       n_planes = av_pix_fmt_count_planes(a->format);
+    int                       p, y, sh, width, height;
+
+    for (p = 0; p < n_planes; p++) {
+        sh = p == 1 || p == 2 ? desc->log2_chroma_h : 0;
+        width = av_image_get_linesize(a->format, a->width, p);
+        height = (a->height + (1 << sh) - 1) >> sh;
+        for (y = 0; y < height; y++) {
+            if (memcmp(a->data[p] + y * a->linesize[p],
+                       b->data[p] + y * b->linesize[p], width)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * strips_match converts the bench frame to format with the
+ * scaler method as a whole, and again in STRIP_BANDS bands
+ * of macroblock rows with scale_window, each from a context
+ * for the band and STRIP_MARGIN rows on either side
+ *
+ * returns 1 if both give the same frame
+ */
+static int strips_match(Bench *b, int format, int method) {
+    struct SwsContext *sc;
+    AVFrame           *whole, *banded, *window;
+    int                n_mbs = (b->height + STRIP_ALIGN - 1) / STRIP_ALIGN;
+    int                i, first, end, top, bottom, same;
+
+    whole = alloc_frame(b->width, b->height, format);
+    banded = alloc_frame(b->width, b->height, format);
+    window = alloc_frame(b->width, b->height, format);
+
+    sc = scaler(b->width, b->height, format, method);
+    sws_scale(sc, (const uint8_t *const *)b->rgba->data, b->rgba->linesize,
+              0, b->height, whole->data, whole->linesize);
+    sws_freeContext(sc);
+
+    for (i = 0; i < STRIP_BANDS; i++) {
+        first = n_mbs * i / STRIP_BANDS * STRIP_ALIGN;
+        end = n_mbs * (i + 1) / STRIP_BANDS * STRIP_ALIGN;
+        if (end > b->height) end = b->height;
+        if (first >= end) {
+            continue;
+        }
+        top = first - STRIP_MARGIN;
+        if (top < 0) top = 0;
+        bottom = end + STRIP_MARGIN;
+        if (bottom > b->height) bottom = b->height;
+
+        sc = scaler(b->width, bottom - top, format, method);
+        scale_window(sc, AV_PIX_FMT_RGBA, window, b->rgba, banded,
+                     first, end, top, bottom - top);
+        sws_freeContext(sc);
+    }
+
+    same = same_frame(whole, banded);
+    av_frame_free(&whole);
+    av_frame_free(&banded);
+    av_frame_free(&window);
+    return same;
+}
+
+/*
+ * print_strips prints if converting in bands gives the same
+ * frame as a whole, for both scalers, to the YUV420P of
+ * --convert-threads and the NV12 of the touch strips
+ *
+ * returns the number of conversions that differ
+ */
+static int print_strips(Bench *b) {
+    static const int   formats[2] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 };
+    static const int   methods[2] = { SWS_BILINEAR, SWS_FAST_BILINEAR };
+    static const char *names[2] = { "bilinear", "fast_bilinear" };
+    int                i, j, n = 0;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (strips_match(b, formats[i], methods[j])) {
+                printf("strips to %s with %s at %dx%d: same as whole\n",
+                       av_get_pix_fmt_name(formats[i]), names[j],
+                       b->width, b->height);
+            } else {
+                printf("strips to %s with %s at %dx%d: DIFFER from whole\n",
+                       av_get_pix_fmt_name(formats[i]), names[j],
+                       b->width, b->height);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * run_kernel times one kernel on one resolution and prints
+ * a row of the table
+ */
+static void run_kernel(const Kernel *k, Bench *b, int warmup, int reps) {
+    int64_t *ns, *cy;
+    int64_t  t, c;
+    long     pixels = 0;
+    double   median;
+    int      i;
+
+    ns = malloc(reps * sizeof(int64_t));
+    cy = malloc(reps * sizeof(int64_t));
+    if (!ns || !cy) {
+        fprintf(stderr, "Fatal: could not allocate timings\n");
+        exit(1);
+    }
+
+    for (i = 0; i < warmup; i++) {
+        k->run(b);
+    }
+    for (i = 0; i < reps; i++) {
+        t = now_ns();
+        c = cycles();
+        pixels = k->run(b);
+        cy[i] = cycles() - c;
+        ns[i] = now_ns() - t;
+    }
+    qsort(ns, reps, sizeof(int64_t), compare_int64);
+    qsort(cy, reps, sizeof(int64_t), compare_int64);
+
+    median = (double)ns[reps / 2] / k->calls;
+    printf("%-18s %5dx%-5d %12.0f %12.0f", k->name, b->width, b->height,
+           median, (double)ns[0] / k->calls);
+    if (pixels > 0) {
+        printf(" %9.3f", median / pixels);
+    } else {
+        printf(" %9s", "-");
+    }
+    if (cy[reps / 2] > 0) {
+        printf(" %14.0f\n", (double)cy[reps / 2] / k->calls);
+    } else {
+        printf(" %14s\n", "-");
+    }
+    fflush(stdout);
+
+    free(ns);
+    free(cy);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  --sizes WxH,...     frame sizes (default %s)\n"
+           "  --warmup N          untimed runs per kernel (default %d)\n"
+           "  --reps N            timed runs per kernel (default %d)\n"
+           "  --only NAME         run the kernels whose name holds NAME\n"
+           "\n"
+           "Times are per frame, the median and the fastest run, with the\n"
+           "median per pixel and in TSC cycles. actualize_event and\n"
+           "draw_touches_yuv count the pixels of the two touches they draw,\n"
+           "touch_mask_new those of the masks it builds, timestamps and\n"
+           "alloc_frame are per call. The yuvconv kernels are followed\n"
+           "by their largest difference from the swscale output, and the\n"
+           "sws kernels by a check that converting in bands of rows gives\n"
+           "the same frame as converting it whole.\n",
+           prog, DEFAULT_SIZES, DEFAULT_WARMUP, DEFAULT_REPS);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        { "sizes",  required_argument, NULL, 's' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "reps",   required_argument, NULL, 'r' },
+        { "only",   required_argument, NULL, 'o' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *sizes = DEFAULT_SIZES;
+    const char *only = NULL;
+    const char *p;
+    int         widths[MAX_SIZES], heights[MAX_SIZES];
+    int         n_sizes = 0;
+    int         warmup = DEFAULT_WARMUP, reps = DEFAULT_REPS;
+    int         have = 0;
+    int         converted, scaled, ret = 0;
+    int         c, i, j, n;
+    Bench      *b;
+
+    while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 's': sizes = optarg; break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        case 'o': only = optarg; break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc || warmup < 0 || reps < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    for (p = sizes; *p; p += n) {
+        if (n_sizes == MAX_SIZES ||
+            sscanf(p, "%dx%d%n", &widths[n_sizes], &heights[n_sizes], &n) != 2 ||
+            widths[n_sizes] < 2 || heights[n_sizes] < 2) {
+            fprintf(stderr, "Fatal: invalid sizes '%s'\n", sizes);
+            exit(1);
+        }
+        n_sizes++;
+        if (p[n] == ',') {
+            n++;
+        }
+    }
+
+#ifdef HAVE_X86_RUNS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) have |= NEEDS_SSE4;
+    if (__builtin_cpu_supports("avx2")) have |= NEEDS_AVX2;
+#endif
+
+    printf("%-18s %11s %12s %12s %9s %14s\n", "kernel", "size",
+           "ns/frame", "min ns", "ns/px", "cycles/frame");
+    for (i = 0; i < n_sizes; i++) {
+        b = bench_new(widths[i], heights[i]);
+        converted = 0;
+        scaled = 0;
+        for (j = 0; j < N_KERNELS; j++) {
+            if (only && !strstr(kernels[j].name, only)) {
+                continue;
+            }
+            if ((kernels[j].needs & have) != kernels[j].needs) {
+                continue;
+            }
+            run_kernel(&kernels[j], b, warmup, reps);
+            converted |= !strncmp(kernels[j].name, "yuvconv", 7);
+            scaled |= !strncmp(kernels[j].name, "sws", 3);
+        }
+        if (converted && print_diffs(b) > 1) {
+            fprintf(stderr, "Error: yuvconv is more than 1 from "
+                    "fast_bilinear at %dx%d\n", b->width, b->height);
+            ret = 1;
+        }
+        if (scaled && print_strips(b) > 0) {
+            fprintf(stderr, "Error: converting in strips differs from "
+                    "the whole frame at %dx%d\n", b->width, b->height);
+            ret = 1;
+        }
+        bench_free(b);
+    }
+    return ret;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "decoder.h"
+#include "stats.h"
+#include "video.h"
+
+/*
+ * probe_codec detects the codec of the picture file
+ * with the avformat probing
+ *
+ * returns AV_CODEC_ID_NONE if the format could not be detected
+ */
+static enum AVCodecID probe_codec(const char *filename) {
+    AVFormatContext *fctx;
+    enum AVCodecID   codec_id;
+    int              stream_no;
+
+    fctx = get_fcontext(filename);
+    if (fctx == NULL) {
+        return AV_CODEC_ID_NONE;
+    }
+
+    stream_no = get_video_stream(fctx);
+    if (stream_no == -1) {
+        avformat_close_input(&fctx);
+        return AV_CODEC_ID_NONE;
+    }
+
+    codec_id = get_ccontext(fctx, stream_no)->codec_id;
+    avformat_close_input(&fctx);
+
+    return codec_id;
+}
+
+/*
+ * open_decoder allocates and opens a decoder context
+ *
+ * Slice threading is used where the codec supports it.
+ * Frame threading is left off: it only pays off with several
+ * packets in flight, and here every file is a single packet
+ * that is needed right away. Decoding several screenshots at
+ * once is the job of the decode pipeline instead.
+ *
+ * threads is the slice thread count, 0 picks one per core
+ *
+ * returns NULL if there is no usable decoder
+ */
+static ImageDecoder * open_decoder(enum AVCodecID codec_id, int threads) {
+    ImageDecoder *dec;
+    AVCodec      *c;
+
+    c = avcodec_find_decoder(codec_id);
+    if (c == NULL) {
+        fprintf(stderr, "Error: could not find decoder for '%s'\n",
+                avcodec_get_name(codec_id));
+        return NULL;
+    }
+
+    dec = malloc(sizeof(ImageDecoder));
+    if (!dec) {
+        fprintf(stderr, "Fatal: could not allocate image decoder\n");
+        exit(1);
+    }
+
+    dec->codec_id = codec_id;
+    rawfb_format_init(&dec->raw);
+    dec->buf = NULL;
+    dec->buf_size = 0;
+
+    dec->cctx = avcodec_alloc_context3(c);
+    if (!dec->cctx) {
+        fprintf(stderr, "Fatal: could not allocate decoder context\n");
+        exit(1);
+    }
+
+    /* decoded frames own their buffers, so they stay valid
+     * while the decoder moves on to the next file */
+    dec->cctx->refcounted_frames = 1;
+
+    if (c->capabilities & CODEC_CAP_SLICE_THREADS) {
+        dec->cctx->thread_type = FF_THREAD_SLICE;
+        dec->cctx->thread_count = threads;
+    } else {
+        dec->cctx->thread_count = 1;
+    }
+
+    if (avcodec_open2(dec->cctx, c, NULL) < 0) {
+        fprintf(stderr, "Error: could not open codec\n");
+        av_free(dec->cctx);
+        free(dec);
+        return NULL;
+    }
+
+    return dec;
+}
+
+/*
+ * image_decoder_new_raw sets up the mapping of raw framebuffer
+ * screenshots of the format raw
+ *
+ * side effects: allocates an ImageDecoder which must
+ * be freed with image_decoder_free
+ */
+ImageDecoder * image_decoder_new_raw(const RawFormat *raw) {
+    ImageDecoder *dec;
+
+    dec = malloc(sizeof(ImageDecoder));
+    if (!dec) {
+        fprintf(stderr, "Fatal: could not allocate image decoder\n");
+        exit(1);
+    }
+
+    dec->codec_id = AV_CODEC_ID_RAWVIDEO;
+    dec->cctx = NULL;
+    dec->raw = *raw;
+    dec->buf = NULL;
+    dec->buf_size = 0;
+
+    return dec;
+}
+
+/*
+ * image_decoder_new detects the picture format from probe_file
+ * and opens a decoder for it, all other pictures are
+ * assumed to share the format. Raw framebuffers are known
+ * by their extension and describe themselves.
+ *
+ * returns NULL if the format is not known
+ *
+ * side effects: allocates an ImageDecoder which must
+ * be freed with image_decoder_free
+ */
+ImageDecoder * image_decoder_new(const char *probe_file, int threads) {
+    enum AVCodecID codec_id;
+    RawFormat      raw;
+
+    if (rawfb_is_raw(probe_file)) {
+        rawfb_format_init(&raw);
+        return image_decoder_new_raw(&raw);
+    }
+
+    codec_id = probe_codec(probe_file);
+    if (codec_id == AV_CODEC_ID_NONE) {
+        fprintf(stderr, "Error: could not detect the format of %s\n",
+                probe_file);
+        return NULL;
+    }
+
+    return open_decoder(codec_id, threads);
+}
+
+/*
+ * image_decoder_new_codec opens a decoder for a picture format
+ * that is already known, skipping the probe, raw is the
+ * format of raw framebuffers and ignored for other codecs
+ *
+ * returns NULL if there is no usable decoder
+ *
+ * side effects: allocates an ImageDecoder which must
+ * be freed with image_decoder_free
+ */
+ImageDecoder * image_decoder_new_codec(enum AVCodecID codec_id,
+                                       const RawFormat *raw, int threads) {
+    if (codec_id == AV_CODEC_ID_RAWVIDEO) {
+        return image_decoder_new_raw(raw);
+    }
+    return open_decoder(codec_id, threads);
+}
+
+/*
+ * image_decoder_clone opens a second decoder for the same
+ * format, for use on another thread
+ *
+ * side effects: allocates an ImageDecoder which must
+ * be freed with image_decoder_free
+ */
+ImageDecoder * image_decoder_clone(const ImageDecoder *dec, int threads) {
+    return image_decoder_new_codec(dec->codec_id, &dec->raw, threads);
+}
+
+/*
+ * read_file reads the whole file into the decoder buffer,
+ * followed by the zeroed padding the decoders require
+ *
+ * returns the file size, or -1 if it could not be read
+ */
+static long read_file(ImageDecoder *dec, const char *filepath) {
+    FILE        *file;
+    struct stat  st;
+    size_t       size;
+
+    file = fopen(filepath, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return -1;
+    }
+    size = st.st_size;
+
+    av_fast_padded_malloc(&dec->buf, &dec->buf_size, size);
+    if (!dec->buf) {
+        fprintf(stderr, "Fatal: could not allocate file buffer\n");
+        exit(1);
+    }
+
+    if (fread(dec->buf, 1, size, file) != size) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    return (long)size;
+}
+
+static AVFrame * decode_file(ImageDecoder *dec, const char *filepath) {
+    AVFrame  *frame;
+    AVPacket  pkt;
+    long      size;
+    int       ret, got_frame = 0;
+
+    size = read_file(dec, filepath);
+    if (size < 0) {
+        fprintf(stderr, "Error: could not read %s\n", filepath);
+        return NULL;
+    }
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Fatal: could not allocate frame\n");
+        exit(1);
+    }
+
+    av_init_packet(&pkt);
+    pkt.data = dec->buf;
+    pkt.size = (int)size;
+
+    ret = avcodec_decode_video2(dec->cctx, frame, &got_frame, &pkt);
+
+    if (ret >= 0 && !got_frame) {
+        /* the decoder kept the picture back, drain it
+         * and reset for the next file */
+        pkt.data = NULL;
+        pkt.size = 0;
+        ret = avcodec_decode_video2(dec->cctx, frame, &got_frame, &pkt);
+        avcodec_flush_buffers(dec->cctx);
+    }
+
+    if (ret < 0 || !got_frame) {
+        /* can not decode frame, possible image corruption */
+        fprintf(stderr, "Error: could not decode %s\n", filepath);
+        av_frame_free(&frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/*
+ * image_decoder_decode reads and decodes the picture file
+ *
+ * returns NULL if the file could not be read or decoded
+ *
+ * side effects: allocates an AVFrame which
+ * must be freed with av_frame_free
+ */
+AVFrame * image_decoder_decode(ImageDecoder *dec, const char *filepath) {
+    StatsSpan  span;
+    AVFrame   *frame;
+
+    stats_begin(&span);
+    if (dec->codec_id == AV_CODEC_ID_RAWVIDEO) {
+        frame = rawfb_map(filepath, &dec->raw);
+    } else {
+        frame = decode_file(dec, filepath);
+    }
+    stats_end(&span, STATS_DECODE);
+
+    return frame;
+}
+
+void image_decoder_free(ImageDecoder *dec) {
+    if (dec == NULL) return;
+    if (dec->cctx) {
+        avcodec_close(dec->cctx);
+        av_free(dec->cctx);
+    }
+    av_free(dec->buf);
+    free(dec);
+}
@@ -0,0 +1,42 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+
+#include "rawfb.h"
+
+/*
+ * An ImageDecoder decodes screenshot files with one codec
+ * context that stays open for the whole session. The format
+ * is probed once, every file after that is read straight
+ * into a packet and sent to the decoder.
+ *
+ * Raw framebuffer screenshots, see rawfb.h, have the codec
+ * AV_CODEC_ID_RAWVIDEO and no codec context. They are mapped
+ * instead of decoded.
+ */
+typedef struct ImageDecoder {
+    enum AVCodecID  codec_id;
+    AVCodecContext *cctx; /* NULL for raw framebuffers */
+    RawFormat       raw;
+
+    /* file contents, reused between files */
+    uint8_t        *buf;
+    unsigned int    buf_size;
+} ImageDecoder;
+
+ImageDecoder * image_decoder_new(const char *probe_file, int threads);
+
+ImageDecoder * image_decoder_new_codec(enum AVCodecID codec_id,
+                                       const RawFormat *raw, int threads);
+
+ImageDecoder * image_decoder_new_raw(const RawFormat *raw);
+
+ImageDecoder * image_decoder_clone(const ImageDecoder *dec, int threads);
+
+AVFrame * image_decoder_decode(ImageDecoder *dec, const char *filepath);
+
+void image_decoder_free(ImageDecoder *dec);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/murmur3.h>
+#include <libavutil/pixdesc.h>
+
+#include "dedup.h"
+#include "utils.h"
+
+#define HASH_CHUNK_SIZE (1 << 16)
+
+static struct AVMurMur3 * hash_new(void) {
+    struct AVMurMur3 *ctx;
+
+    ctx = av_murmur3_alloc();
+    if (!ctx) {
+        fprintf(stderr, "Fatal: could not allocate hash context\n");
+        exit(1);
+    }
+    av_murmur3_init(ctx);
+    return ctx;
+}
+
+/*
+ * dedup_parse_region reads a region given as x,y,width,height
+ *
+ * returns 0 on success, -1 if the value is not a region
+ */
+int dedup_parse_region(const char *value, DedupRegion *region) {
+    char end;
+
+    if (sscanf(value, "%d,%d,%d,%d%c", &region->x, &region->y,
+               &region->width, &region->height, &end) != 4 ||
+        region->x < 0 || region->y < 0 ||
+        region->width <= 0 || region->height <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * dedup_hash_file hashes the bytes of the file
+ *
+ * returns 0 on success, -1 if it can not be read
+ */
+int dedup_hash_file(const char *filepath, uint8_t hash[DEDUP_HASH_SIZE]) {
+    struct AVMurMur3 *ctx;
+    uint8_t          *buf;
+    FILE             *file;
+    size_t            n;
+    int               ret = 0;
+
+    file = fopen(filepath, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    buf = malloc(HASH_CHUNK_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Fatal: could not allocate hash buffer\n");
+        exit(1);
+    }
+    ctx = hash_new();
+
+    while ((n = fread(buf, 1, HASH_CHUNK_SIZE, file)) > 0) {
+        av_murmur3_update(ctx, buf, n);
+    }
+    if (ferror(file)) {
+        ret = -1;
+    }
+    av_murmur3_final(ctx, hash);
+
+    av_free(ctx);
+    free(buf);
+    fclose(file);
+
+    return ret;
+}
+
+static int compare_spans(const void *a, const void *b) {
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+/*
+ * dedup_hash_pixels hashes the picture of the frame, leaving
+ * out the ignored regions of the first plane, which holds
+ * all of the pixels of the packed RGB screenshots
+ */
+void dedup_hash_pixels(const AVFrame *frame, const DedupRegion *ignore,
+                       int n_ignore, uint8_t hash[DEDUP_HASH_SIZE]) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    struct AVMurMur3         *ctx;
+    int                       spans[DEDUP_MAX_REGIONS][2];
+    int                       plane, y, i, n, x, bpp, row_bytes, height;
+
+    ctx = hash_new();
+
+    for (plane = 0; plane < AV_NUM_DATA_POINTERS && frame->data[plane];
+         plane++) {
+        row_bytes = av_image_get_linesize(frame->format, frame->width, plane);
+        height = frame->height;
+        if (plane > 0 && desc && !(desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+            height = -((-frame->height) >> desc->log2_chroma_h);
+        }
+        if (row_bytes <= 0) break;
+        bpp = frame->width > 0 ? row_bytes / frame->width : 0;
+
+        for (y = 0; y < height; y++) {
+            const uint8_t *row = frame->data[plane] + y*frame->linesize[plane];
+
+            /* the ignored spans of this row, left to right */
+            n = 0;
+            for (i = 0; plane == 0 && bpp > 0 && i < n_ignore; i++) {
+                if (y >= ignore[i].y && y < ignore[i].y + ignore[i].height) {
+                    spans[n][0] = ignore[i].x * bpp;
+                    spans[n][1] = (ignore[i].x + ignore[i].width) * bpp;
+                    n++;
+                }
+            }
+            qsort(spans, n, sizeof(spans[0]), compare_spans);
+
+            x = 0;
+            for (i = 0; i < n; i++) {
+                if (spans[i][0] > x) {
+                    av_murmur3_update(ctx, row + x,
+                                      FFMIN(spans[i][0], row_bytes) - x);
+                }
+                x = FFMAX(x, spans[i][1]);
+                if (x >= row_bytes) break;
+            }
+            if (x < row_bytes) {
+                av_murmur3_update(ctx, row + x, row_bytes - x);
+            }
+        }
+    }
+
+    av_murmur3_final(ctx, hash);
+    av_free(ctx);
+}
+
+/*
+ * dedup_screenshots merges each run of consecutive screenshots
+ * whose files are identical into its first screenshot, shown
+ * for the whole run. A file that can not be read is left to
+ * fail in the decoder.
+ *
+ * returns the merged list, its file paths point into shots
+ *
+ * side effects: allocates the list, which must be
+ * freed with free
+ */
+Screenshot * dedup_screenshots(const Screenshot *shots, int n_shots,
+                               int *n_merged) {
+    Screenshot *merged;
+    uint8_t     hash[DEDUP_HASH_SIZE], last_hash[DEDUP_HASH_SIZE];
+    int         i, n = 0, have_last = 0;
+
+    merged = malloc((n_shots > 0 ? n_shots : 1) * sizeof(Screenshot));
+    if (!merged) {
+        fprintf(stderr, "Fatal: could not allocate screenshot list\n");
+        exit(1);
+    }
+
+    for (i = 0; i < n_shots; i++) {
+        if (dedup_hash_file(shots[i].filepath, hash) != 0) {
+            merged[n++] = shots[i];
+            have_last = 0;
+            continue;
+        }
+
+        if (have_last && memcmp(hash, last_hash, DEDUP_HASH_SIZE) == 0) {
+            merged[n-1].interval += shots[i].interval;
+            continue;
+        }
+
+        merged[n++] = shots[i];
+        memcpy(last_hash, hash, DEDUP_HASH_SIZE);
+        have_last = 1;
+    }
+
+    *n_merged = n;
+    return merged;
+}
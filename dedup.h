@@ -0,0 +1,40 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+/* utils.h includes video.h, which includes this header */
+struct Screenshot;
+
+#define DEDUP_HASH_SIZE 16
+#define DEDUP_MAX_REGIONS 8
+
+/*
+ * Screen recorders often capture the same screen many times
+ * in a row. Runs of screenshots whose files are identical
+ * are merged before rendering, so each run is decoded and
+ * converted once and shown for the whole run. Screenshots
+ * whose files differ but whose pixels match the previous
+ * screenshot, outside of any ignored regions such as the
+ * status bar clock, are decoded but not converted again.
+ */
+
+/* a rectangle of the screenshots, in pixels */
+typedef struct DedupRegion {
+    int x, y;
+    int width, height;
+} DedupRegion;
+
+int dedup_parse_region(const char *value, DedupRegion *region);
+
+int dedup_hash_file(const char *filepath, uint8_t hash[DEDUP_HASH_SIZE]);
+
+void dedup_hash_pixels(const AVFrame *frame, const DedupRegion *ignore,
+                       int n_ignore, uint8_t hash[DEDUP_HASH_SIZE]);
+
+struct Screenshot * dedup_screenshots(const struct Screenshot *shots,
+                                     int n_shots, int *n_merged);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "fmp4.h"
+
+#define COPY_BUFFER_SIZE (1 << 16)
+
+static uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * walk_boxes walks the top level boxes of the file up to
+ * limit, the fragments end at the mfra box, if any, or at
+ * the end. end is where the walk stopped.
+ *
+ * returns 0 on success, -1 if the file can not be read
+ */
+static int walk_boxes(const char *filename, int64_t limit,
+                      Fmp4Layout *layout, int64_t *end) {
+    FILE    *f;
+    uint8_t  header[16];
+    uint64_t size;
+    int64_t  offset = 0, file_size;
+    int      header_size;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: could not open %s\n", filename);
+        return -1;
+    }
+    fseeko(f, 0, SEEK_END);
+    file_size = ftello(f);
+
+    layout->first_fragment = -1;
+    layout->media_end = file_size;
+    layout->n_fragments = 0;
+
+    while (offset + 8 <= file_size && offset < limit) {
+        fseeko(f, offset, SEEK_SET);
+        if (fread(header, 1, 8, f) != 8) {
+            break;
+        }
+        size = read_u32(header);
+        header_size = 8;
+        if (size == 1) {
+            /* 64 bit size follows the type */
+            if (fread(header + 8, 1, 8, f) != 8) {
+                break;
+            }
+            size = (uint64_t)read_u32(header + 8) << 32 |
+                   read_u32(header + 12);
+            header_size = 16;
+        } else if (size == 0) {
+            /* the box runs to the end of the file */
+            size = file_size - offset;
+        }
+        if (size < (uint64_t)header_size ||
+            size > (uint64_t)(file_size - offset)) {
+            fprintf(stderr, "Error: %s: broken box at %ld\n", filename,
+                    (long)offset);
+            fclose(f);
+            return -1;
+        }
+
+        if (memcmp(header + 4, "moof", 4) == 0) {
+            if (layout->first_fragment < 0) {
+                layout->first_fragment = offset;
+            }
+            layout->n_fragments++;
+        } else if (memcmp(header + 4, "mfra", 4) == 0) {
+            layout->media_end = offset;
+            break;
+        }
+        offset += size;
+    }
+    fclose(f);
+
+    *end = offset;
+    return 0;
+}
+
+/*
+ * fmp4_scan walks the top level boxes of the file, the
+ * fragments end at the mfra box, if any, or at the end
+ *
+ * returns 0 on success, -1 if the file can not be read
+ * or has no fragments
+ */
+int fmp4_scan(const char *filename, Fmp4Layout *layout) {
+    int64_t end;
+
+    if (walk_boxes(filename, INT64_MAX, layout, &end) != 0) {
+        return -1;
+    }
+    if (layout->first_fragment < 0) {
+        fprintf(stderr, "Error: %s is not a fragmented MP4 file\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * fmp4_matches tells if the file still holds the n_fragments
+ * fragments an earlier append left ending at media_end,
+ * whatever an interrupted append wrote after them
+ */
+int fmp4_matches(const char *filename, int64_t media_end, int n_fragments) {
+    Fmp4Layout layout;
+    int64_t    end;
+
+    return walk_boxes(filename, media_end, &layout, &end) == 0 &&
+           end == media_end && layout.media_end >= media_end &&
+           layout.n_fragments == n_fragments;
+}
+
+/*
+ * fmp4_truncate cuts the file after its last fragment
+ *
+ * returns 0 on success
+ */
+int fmp4_truncate(const char *filename, int64_t media_end) {
+    if (truncate(filename, media_end) != 0) {
+        fprintf(stderr, "Error: could not truncate %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * fmp4_append cuts dst after the fragments it had at
+ * dst_media_end, which drops anything an interrupted append
+ * left behind, and copies the fragments of src after them
+ *
+ * returns 0 on success
+ */
+int fmp4_append(const char *dst_filename, int64_t dst_media_end,
+                const char *src_filename, const Fmp4Layout *src) {
+    FILE    *in, *out;
+    uint8_t *buf;
+    int64_t  left;
+    size_t   n;
+    int      ret = 0;
+
+    if (fmp4_truncate(dst_filename, dst_media_end) != 0) {
+        return -1;
+    }
+
+    in = fopen(src_filename, "rb");
+    out = fopen(dst_filename, "ab");
+    buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Fatal: could not allocate copy buffer\n");
+        exit(1);
+    }
+    if (!in || !out) {
+        fprintf(stderr, "Error: could not open %s\n",
+                in ? dst_filename : src_filename);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        fseeko(in, src->first_fragment, SEEK_SET);
+        left = src->media_end - src->first_fragment;
+        while (left > 0) {
+            n = left < COPY_BUFFER_SIZE ? (size_t)left : COPY_BUFFER_SIZE;
+            if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n) {
+                fprintf(stderr, "Error: could not append to %s\n",
+                        dst_filename);
+                ret = -1;
+                break;
+            }
+            left -= n;
+        }
+    }
+
+    free(buf);
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
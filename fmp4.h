@@ -0,0 +1,27 @@
+#ifndef _FMP4_H_
+#define _FMP4_H_
+
+#include <stdint.h>
+
+/*
+ * The top level layout of a fragmented MP4 file: the ftyp
+ * and moov boxes, then one moof and mdat pair per fragment,
+ * then an optional mfra index, which is not needed to play
+ * the file and is dropped so that fragments can be appended.
+ */
+typedef struct Fmp4Layout {
+    int64_t first_fragment; /* offset of the first moof */
+    int64_t media_end;      /* offset after the last mdat */
+    int     n_fragments;
+} Fmp4Layout;
+
+int fmp4_scan(const char *filename, Fmp4Layout *layout);
+
+int fmp4_matches(const char *filename, int64_t media_end, int n_fragments);
+
+int fmp4_truncate(const char *filename, int64_t media_end);
+
+int fmp4_append(const char *dst_filename, int64_t dst_media_end,
+                const char *src_filename, const Fmp4Layout *src);
+
+#endif
@@ -0,0 +1,449 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lz4.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/murmur3.h>
+
+#include "dedup.h"
+#include "framecache.h"
+
+#define ENTRY_SUFFIX ".frame"
+#define ENTRY_MAGIC "CRFC"
+#define ENTRY_VERSION 2
+
+/* evicting makes room for this many 1/16ths of the limit */
+#define EVICT_TO_SIXTEENTHS 14
+
+typedef struct EntryHeader {
+    char     magic[4];
+    uint32_t version;
+    int32_t  width, height, pix_fmt;
+    uint32_t compressed;
+    uint32_t raw_size;   /* packed planes */
+    uint32_t data_size;  /* bytes following the header */
+} EntryHeader;
+
+typedef struct EntryInfo {
+    char   *name;
+    time_t  mtime;
+    off_t   size;
+} EntryInfo;
+
+static int is_entry(const char *name) {
+    size_t len = strlen(name), suffix = strlen(ENTRY_SUFFIX);
+
+    return name[0] != '.' && len > suffix &&
+           strcmp(name + len - suffix, ENTRY_SUFFIX) == 0;
+}
+
+static char * entry_path(FrameCache *cache,
+                         const uint8_t key[FRAME_CACHE_KEY_SIZE]) {
+    char  hex[2*FRAME_CACHE_KEY_SIZE + 1];
+    char *path;
+    int   i;
+
+    for (i = 0; i < FRAME_CACHE_KEY_SIZE; i++) {
+        sprintf(hex + 2*i, "%02x", key[i]);
+    }
+    if (asprintf(&path, "%s/%s%s", cache->dir, hex, ENTRY_SUFFIX) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+    return path;
+}
+
+/*
+ * grow makes buf hold at least size bytes
+ */
+static void grow(uint8_t **buf, int *buf_size, int size) {
+    if (*buf_size >= size) {
+        return;
+    }
+    free(*buf);
+    *buf = malloc(size);
+    if (!*buf) {
+        fprintf(stderr, "Fatal: could not allocate frame cache buffer\n");
+        exit(1);
+    }
+    *buf_size = size;
+}
+
+static int read_all(int fd, uint8_t *buf, size_t size) {
+    ssize_t n;
+
+    while (size > 0) {
+        n = read(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t size) {
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * scan_entries lists the entries of the cache folder
+ *
+ * returns the number of entries, their total size goes to size
+ *
+ * side effects: allocates the list, free it with free_entries
+ */
+static int scan_entries(const char *dir, EntryInfo **entries, int64_t *size) {
+    DIR           *d;
+    struct dirent *ent;
+    struct stat    st;
+    EntryInfo     *list = NULL, *grown;
+    char          *path;
+    int            n = 0, capacity = 0;
+
+    *size = 0;
+    d = opendir(dir);
+    if (!d) {
+        *entries = NULL;
+        return 0;
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+        if (!is_entry(ent->d_name)) continue;
+
+        if (asprintf(&path, "%s/%s", dir, ent->d_name) < 0) {
+            fprintf(stderr, "Fatal: asprintf failure\n");
+            exit(1);
+        }
+        if (stat(path, &st) != 0) {
+            /* removed by another render meanwhile */
+            free(path);
+            continue;
+        }
+
+        if (n == capacity) {
+            capacity = capacity ? 2*capacity : 256;
+            grown = realloc(list, capacity * sizeof(EntryInfo));
+            if (!grown) {
+                fprintf(stderr, "Fatal: could not allocate entry list\n");
+                exit(1);
+            }
+            list = grown;
+        }
+        list[n].name = path;
+        list[n].mtime = st.st_mtime;
+        list[n].size = st.st_size;
+        *size += st.st_size;
+        n++;
+    }
+    closedir(d);
+
+    *entries = list;
+    return n;
+}
+
+static void free_entries(EntryInfo *entries, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+static int compare_mtime(const void *a, const void *b) {
+    const EntryInfo *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * evict removes the least recently used entries until the
+ * folder is comfortably below its size limit. The folder is
+ * rescanned, since other renders may share it.
+ */
+static void evict(FrameCache *cache) {
+    EntryInfo *entries;
+    int64_t    target;
+    int        i, n;
+
+    n = scan_entries(cache->dir, &entries, &cache->size);
+    qsort(entries, n, sizeof(EntryInfo), compare_mtime);
+
+    target = cache->max_size / 16 * EVICT_TO_SIXTEENTHS;
+    for (i = 0; i < n && cache->size > target; i++) {
+        if (unlink(entries[i].name) == 0) {
+            cache->size -= entries[i].size;
+            cache->stats.evictions++;
+        }
+    }
+
+    free_entries(entries, n);
+}
+
+/*
+ * frame_cache_open opens the cache folder, creating it if it
+ * does not exist, with room for max_size bytes of entries
+ *
+ * returns the cache, or NULL if the folder can not be used
+ *
+ * side effects: allocates a FrameCache which must be
+ * freed with frame_cache_close
+ */
+FrameCache * frame_cache_open(const char *dir, int64_t max_size,
+                              int compress) {
+    FrameCache *cache;
+    EntryInfo  *entries;
+    int         n;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create frame cache '%s'\n", dir);
+        return NULL;
+    }
+    if (access(dir, R_OK | W_OK | X_OK) != 0) {
+        fprintf(stderr, "Error: frame cache '%s' is not writable\n", dir);
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(FrameCache));
+    if (!cache) {
+        fprintf(stderr, "Fatal: could not allocate frame cache\n");
+        exit(1);
+    }
+    cache->dir = strdup(dir);
+    if (!cache->dir) {
+        fprintf(stderr, "Fatal: could not allocate frame cache\n");
+        exit(1);
+    }
+    cache->max_size = max_size;
+    cache->compress = compress;
+
+    n = scan_entries(dir, &entries, &cache->size);
+    free_entries(entries, n);
+    if (cache->size > cache->max_size) {
+        evict(cache);
+    }
+
+    return cache;
+}
+
+/*
+ * frame_cache_key derives the key of a screenshot file
+ * converted with the given format
+ *
+ * returns 0 on success, -1 if the file can not be read
+ */
+int frame_cache_key(const char *filepath, const FrameCacheFormat *format,
+                    uint8_t key[FRAME_CACHE_KEY_SIZE]) {
+    struct AVMurMur3 *ctx;
+    uint8_t           content[DEDUP_HASH_SIZE];
+    int32_t           params[9];
+
+    if (dedup_hash_file(filepath, content) != 0) {
+        return -1;
+    }
+
+    params[0] = ENTRY_VERSION;
+    params[1] = format->in_width;
+    params[2] = format->in_height;
+    params[3] = format->in_pix_fmt;
+    params[4] = format->out_width;
+    params[5] = format->out_height;
+    params[6] = format->out_pix_fmt;
+    params[7] = format->scale_method;
+    params[8] = format->converter;
+
+    ctx = av_murmur3_alloc();
+    if (!ctx) {
+        fprintf(stderr, "Fatal: could not allocate hash context\n");
+        exit(1);
+    }
+    av_murmur3_init(ctx);
+    av_murmur3_update(ctx, content, sizeof(content));
+    av_murmur3_update(ctx, (const uint8_t *)params, sizeof(params));
+    av_murmur3_final(ctx, key);
+    av_free(ctx);
+
+    return 0;
+}
+
+/*
+ * frame_cache_contains tells if the cache has an entry for
+ * key, without reading it or counting a hit or miss
+ */
+int frame_cache_contains(FrameCache *cache,
+                         const uint8_t key[FRAME_CACHE_KEY_SIZE]) {
+    char *path = entry_path(cache, key);
+    int   found = access(path, R_OK) == 0;
+
+    free(path);
+    return found;
+}
+
+/*
+ * frame_cache_get reads the entry of key into frame, which
+ * must be allocated with the cached size and pixel format
+ *
+ * returns 0 on a hit, -1 on a miss, which includes entries
+ * that are damaged or of another format
+ *
+ * side effects: marks the entry as recently used
+ */
+int frame_cache_get(FrameCache *cache, const uint8_t key[FRAME_CACHE_KEY_SIZE],
+                    AVFrame *frame) {
+    EntryHeader  header;
+    const uint8_t *src_data[4];
+    int          src_linesize[4];
+    char        *path;
+    int          fd, raw_size, ok = 0;
+
+    raw_size = av_image_get_buffer_size(frame->format, frame->width,
+                                        frame->height, 1);
+
+    path = entry_path(cache, key);
+    fd = open(path, O_RDONLY);
+    free(path);
+
+    if (fd >= 0 &&
+        read_all(fd, (uint8_t *)&header, sizeof(header)) == 0 &&
+        memcmp(header.magic, ENTRY_MAGIC, 4) == 0 &&
+        header.version == ENTRY_VERSION &&
+        header.width == frame->width && header.height == frame->height &&
+        header.pix_fmt == frame->format &&
+        (int)header.raw_size == raw_size &&
+        header.data_size <= (uint32_t)LZ4_compressBound(raw_size)) {
+
+        grow(&cache->raw, &cache->raw_size, raw_size);
+        if (header.compressed) {
+            grow(&cache->packed, &cache->packed_size, header.data_size);
+            ok = read_all(fd, cache->packed, header.data_size) == 0 &&
+                 LZ4_decompress_safe((const char *)cache->packed,
+                                     (char *)cache->raw, header.data_size,
+                                     raw_size) == raw_size;
+        } else {
+            ok = header.data_size == (uint32_t)raw_size &&
+                 read_all(fd, cache->raw, raw_size) == 0;
+        }
+    }
+
+    if (ok) {
+        /* the modification time orders the entries for eviction */
+        futimens(fd, NULL);
+
+        av_image_fill_arrays((uint8_t **)src_data, src_linesize, cache->raw,
+                             frame->format, frame->width, frame->height, 1);
+        av_image_copy(frame->data, frame->linesize, src_data, src_linesize,
+                      frame->format, frame->width, frame->height);
+
+        cache->stats.hits++;
+        cache->stats.bytes_read += sizeof(header) + header.data_size;
+    } else {
+        cache->stats.misses++;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok ? 0 : -1;
+}
+
+/*
+ * frame_cache_put stores frame as the entry of key, evicting
+ * old entries if the cache grows past its size limit. A
+ * frame that can not be stored is skipped with a warning.
+ */
+void frame_cache_put(FrameCache *cache,
+                     const uint8_t key[FRAME_CACHE_KEY_SIZE],
+                     const AVFrame *frame) {
+    EntryHeader  header;
+    const uint8_t *data;
+    char        *path, *tmp_path;
+    int          fd, raw_size, data_size, ok;
+
+    raw_size = av_image_get_buffer_size(frame->format, frame->width,
+                                        frame->height, 1);
+    grow(&cache->raw, &cache->raw_size, raw_size);
+    av_image_copy_to_buffer(cache->raw, raw_size,
+                            (const uint8_t * const *)frame->data,
+                            frame->linesize, frame->format,
+                            frame->width, frame->height, 1);
+
+    data = cache->raw;
+    data_size = raw_size;
+    if (cache->compress) {
+        grow(&cache->packed, &cache->packed_size,
+             LZ4_compressBound(raw_size));
+        data_size = LZ4_compress_default((const char *)cache->raw,
+                                         (char *)cache->packed, raw_size,
+                                         cache->packed_size);
+        data = cache->packed;
+    }
+    if (data_size <= 0) {
+        fprintf(stderr, "Warning: could not compress cached frame\n");
+        return;
+    }
+
+    memcpy(header.magic, ENTRY_MAGIC, 4);
+    header.version = ENTRY_VERSION;
+    header.width = frame->width;
+    header.height = frame->height;
+    header.pix_fmt = frame->format;
+    header.compressed = cache->compress;
+    header.raw_size = raw_size;
+    header.data_size = data_size;
+
+    path = entry_path(cache, key);
+    if (asprintf(&tmp_path, "%s/.tmp-XXXXXX", cache->dir) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    fd = mkstemp(tmp_path);
+    ok = fd >= 0 &&
+         write_all(fd, (const uint8_t *)&header, sizeof(header)) == 0 &&
+         write_all(fd, data, data_size) == 0;
+    if (fd >= 0 && close(fd) != 0) {
+        ok = 0;
+    }
+    if (ok && rename(tmp_path, path) == 0) {
+        cache->size += sizeof(header) + data_size;
+        cache->stats.stores++;
+        cache->stats.bytes_written += sizeof(header) + data_size;
+    } else {
+        fprintf(stderr, "Warning: could not write frame cache entry\n");
+        if (fd >= 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+
+    if (cache->size > cache->max_size) {
+        evict(cache);
+    }
+}
+
+void frame_cache_close(FrameCache *cache) {
+    free(cache->dir);
+    free(cache->raw);
+    free(cache->packed);
+    free(cache);
+}
@@ -0,0 +1,76 @@
+#ifndef _FRAMECACHE_H_
+#define _FRAMECACHE_H_
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+#define FRAME_CACHE_KEY_SIZE 16
+
+/*
+ * A FrameCache keeps converted screenshots, the clean output
+ * frames before any touches are drawn, in a folder that
+ * outlives the render. Entries are keyed by the contents of
+ * the screenshot file and the conversion that was applied,
+ * so renders of the same session with other encoder settings
+ * find them, and a changed file or output format does not.
+ *
+ * Each entry is one file holding the packed planes, LZ4
+ * compressed if enabled when it was written. Reading an entry
+ * marks it as used, and when the folder grows past its size
+ * limit the least recently used entries are removed. Entries
+ * are written under a temporary name and renamed, so several
+ * renders may share the folder.
+ */
+
+/* the conversion that produced a cached frame */
+typedef struct FrameCacheFormat {
+    int in_width, in_height, in_pix_fmt;
+    int out_width, out_height, out_pix_fmt;
+    int scale_method;
+    int converter;    /* 1 for the SIMD converter, 0 for swscale */
+} FrameCacheFormat;
+
+typedef struct FrameCacheStats {
+    long    hits;
+    long    misses;
+    long    stores;
+    long    evictions;
+    int64_t bytes_read;    /* entry file bytes */
+    int64_t bytes_written;
+} FrameCacheStats;
+
+typedef struct FrameCache {
+    char            *dir;
+    int64_t          max_size;
+    int64_t          size;     /* bytes of the entries in dir */
+    int              compress; /* LZ4 compress new entries */
+
+    /* packed frame and compressed entry, reused between frames */
+    uint8_t         *raw;
+    int              raw_size;
+    uint8_t         *packed;
+    int              packed_size;
+
+    FrameCacheStats  stats;
+} FrameCache;
+
+FrameCache * frame_cache_open(const char *dir, int64_t max_size,
+                              int compress);
+
+int frame_cache_key(const char *filepath, const FrameCacheFormat *format,
+                    uint8_t key[FRAME_CACHE_KEY_SIZE]);
+
+int frame_cache_contains(FrameCache *cache,
+                         const uint8_t key[FRAME_CACHE_KEY_SIZE]);
+
+int frame_cache_get(FrameCache *cache, const uint8_t key[FRAME_CACHE_KEY_SIZE],
+                    AVFrame *frame);
+
+void frame_cache_put(FrameCache *cache,
+                     const uint8_t key[FRAME_CACHE_KEY_SIZE],
+                     const AVFrame *frame);
+
+void frame_cache_close(FrameCache *cache);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+
+#include "framepool.h"
+
+#define POOL_ALIGN 32
+
+/*
+ * destroy_pool frees the pool and every buffer in it,
+ * must be called with no buffers outstanding
+ */
+static void destroy_pool(FramePool *pool) {
+    PoolBuffer *buf;
+
+    while ((buf = pool->free_list) != NULL) {
+        pool->free_list = buf->next;
+        av_free(buf->mem);
+        free(buf);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/*
+ * release_buffer is called by libavutil when the last
+ * reference to a pool buffer is dropped, possibly on
+ * an encoder thread, and puts it back on the free list
+ */
+static void release_buffer(void *opaque, uint8_t *data) {
+    PoolBuffer *buf = opaque;
+    FramePool  *pool = buf->pool;
+    int         destroy;
+
+    (void)data;
+
+    pthread_mutex_lock(&pool->lock);
+    buf->next = pool->free_list;
+    pool->free_list = buf;
+    pool->stats.outstanding--;
+    destroy = pool->closed && pool->stats.outstanding == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (destroy) {
+        destroy_pool(pool);
+    }
+}
+
+/*
+ * frame_pool_new creates an empty pool for frames of the
+ * specified width, height and pixel format
+ *
+ * side effects: allocates a FramePool which must be
+ * freed with frame_pool_free
+ */
+FramePool * frame_pool_new(int width, int height, int pix_fmt) {
+    FramePool *pool;
+    uint8_t   *data[4];
+    int        i, size;
+
+    pool = calloc(1, sizeof(FramePool));
+    if (!pool) {
+        fprintf(stderr, "Fatal: Could not allocate frame pool\n");
+        exit(1);
+    }
+
+    pool->width = width;
+    pool->height = height;
+    pool->pix_fmt = pix_fmt;
+
+    /* every line, and so every plane, starts 32 byte aligned */
+    if (av_image_fill_linesizes(pool->linesize, pix_fmt, width) < 0) {
+        fprintf(stderr, "Fatal: Unsupported frame pool format\n");
+        exit(1);
+    }
+    for (i = 0; i < 4; i++) {
+        pool->linesize[i] = FFALIGN(pool->linesize[i], POOL_ALIGN);
+    }
+
+    size = av_image_fill_pointers(data, pix_fmt, height, NULL,
+                                  pool->linesize);
+    if (size < 0) {
+        fprintf(stderr, "Fatal: Unsupported frame pool format\n");
+        exit(1);
+    }
+    pool->size = size;
+
+    pool->free_list = NULL;
+    pool->closed = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+/*
+ * frame_pool_get makes frame reference a pool buffer,
+ * reusing a returned buffer if there is one. frame must
+ * not hold any references already.
+ */
+void frame_pool_get(FramePool *pool, AVFrame *frame) {
+    PoolBuffer *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    buf = pool->free_list;
+    if (buf) {
+        pool->free_list = buf->next;
+        pool->stats.hits++;
+    }
+    pool->stats.gets++;
+    pool->stats.outstanding++;
+    if (pool->stats.outstanding > pool->stats.peak_outstanding) {
+        pool->stats.peak_outstanding = pool->stats.outstanding;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buf) {
+        buf = malloc(sizeof(PoolBuffer));
+        if (buf) {
+            buf->mem = av_malloc(pool->size + POOL_ALIGN);
+        }
+        if (!buf || !buf->mem) {
+            fprintf(stderr, "Fatal: Could not allocate pool frame\n");
+            exit(1);
+        }
+        buf->pool = pool;
+        buf->data = (uint8_t *)FFALIGN((uintptr_t)buf->mem, POOL_ALIGN);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.allocated++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    frame->buf[0] = av_buffer_create(buf->data, pool->size,
+                                     release_buffer, buf, 0);
+    if (!frame->buf[0]) {
+        fprintf(stderr, "Fatal: Could not reference pool frame\n");
+        exit(1);
+    }
+
+    frame->width = pool->width;
+    frame->height = pool->height;
+    frame->format = pool->pix_fmt;
+    av_image_fill_pointers(frame->data, pool->pix_fmt, pool->height,
+                           buf->data, pool->linesize);
+    frame->linesize[0] = pool->linesize[0];
+    frame->linesize[1] = pool->linesize[1];
+    frame->linesize[2] = pool->linesize[2];
+    frame->linesize[3] = pool->linesize[3];
+}
+
+void frame_pool_get_stats(FramePool *pool, FramePoolStats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * frame_pool_free frees the pool, or once the encoder has
+ * released them if some buffers are still referenced
+ */
+void frame_pool_free(FramePool *pool) {
+    int destroy;
+
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    destroy = pool->stats.outstanding == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (destroy) {
+        destroy_pool(pool);
+    }
+}
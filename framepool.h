@@ -0,0 +1,51 @@
+#ifndef _FRAMEPOOL_H_
+#define _FRAMEPOOL_H_
+
+#include <pthread.h>
+
+#include <libavutil/frame.h>
+
+/*
+ * A FramePool hands out reference counted frames of one
+ * size and pixel format. The image buffers are 32 byte
+ * aligned and return to the pool when the last reference
+ * to them is dropped, by us or by the encoder, so a steady
+ * stream of frames stops allocating image memory once the
+ * pool has grown to the number of frames in flight.
+ */
+
+typedef struct PoolBuffer {
+    struct FramePool  *pool;
+    uint8_t           *mem;  /* allocation, freed with av_free */
+    uint8_t           *data; /* 32 byte aligned image start */
+    struct PoolBuffer *next;
+} PoolBuffer;
+
+typedef struct FramePoolStats {
+    long gets;             /* frames handed out */
+    long hits;             /* frames that reused a returned buffer */
+    long allocated;        /* buffers allocated */
+    long outstanding;      /* buffers currently referenced */
+    long peak_outstanding;
+} FramePoolStats;
+
+typedef struct FramePool {
+    int              width, height, pix_fmt;
+    int              linesize[4];
+    int              size;     /* image bytes per buffer */
+
+    PoolBuffer      *free_list;
+    int              closed;   /* freed while buffers were outstanding */
+    FramePoolStats   stats;
+    pthread_mutex_t  lock;
+} FramePool;
+
+FramePool * frame_pool_new(int width, int height, int pix_fmt);
+
+void frame_pool_get(FramePool *pool, AVFrame *frame);
+
+void frame_pool_get_stats(FramePool *pool, FramePoolStats *stats);
+
+void frame_pool_free(FramePool *pool);
+
+#endif
@@ -1,38 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <jansson.h>
 
+#include "json.h"
+
+/* consumed input is dropped from memory in steps of this size */
+#define RELEASE_STEP (4 << 20)
+
 /*
- * get_string_contents reads the file into a
- * null terminated string.
+ * map_file maps the whole file read only
  *
- * side effects: allocates a string which
- * must be freed with 'free'
+ * returns NULL if the file could not be read
+ *
+ * side effects: maps the file, which must be
+ * unmapped with munmap
  */
-static char * get_string_contents(char *filename) {
-    FILE *file;
-    long file_size;
-    char *contents;
+static const char * map_file(const char *filename, size_t *size) {
+    struct stat  st;
+    void        *data;
+    int          fd;
 
-    file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Fatal: could not open %s\n", filename);
-        exit(1);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open %s\n", filename);
+        return NULL;
     }
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    rewind(file);
-    contents = malloc((file_size + 1) * (sizeof(char)));
-    fread(contents, sizeof(char), file_size, file);
-    fclose(file);
-    contents[file_size] = 0; /* add null termination */
 
-    return contents;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: could not read %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map %s\n", filename);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return data;
 }
 
 /*
  * read_json parses and returns
  * the root json object of the file
  *
- * side effects: allocates a json context 
+ * side effects: allocates a json context
  * which must be freed with 'json_decref'
  *
  * Actual memory management is managed by the
@@ -40,13 +61,18 @@ static char * get_string_contents(char *filename) {
  * see https://jansson.readthedocs.org/en/
  */
 json_t * read_json(char *filename) {
-    char *jsonString;
+    const char *data;
+    size_t size;
     json_t *root;
     json_error_t error;
 
-    jsonString = get_string_contents(filename);
-    root = json_loads(jsonString, 0, &error);
-    free(jsonString);
+    /* parse straight from the mapping, no copy of the file */
+    data = map_file(filename, &size);
+    if (!data) {
+        exit(1);
+    }
+    root = json_loadb(data, size, 0, &error);
+    munmap((void *)data, size);
     if (!root) {
         fprintf(stderr, "Fatal: %s parse error on line %d: %s\n", filename, error.line, error.text);
         exit(1);
@@ -54,3 +80,240 @@ json_t * read_json(char *filename) {
 
     return root;
 }
+
+static void skip_whitespace(JsonStream *js) {
+    while (js->pos < js->size &&
+           (js->data[js->pos] == ' ' || js->data[js->pos] == '\t' ||
+            js->data[js->pos] == '\n' || js->data[js->pos] == '\r')) {
+        js->pos++;
+    }
+}
+
+/*
+ * peek returns the next non whitespace character,
+ * or 0 at the end of the file
+ */
+static char peek(JsonStream *js) {
+    skip_whitespace(js);
+    return js->pos < js->size ? js->data[js->pos] : 0;
+}
+
+/*
+ * fail stops the stream on a parse error,
+ * every later read returns nothing
+ */
+static void fail(JsonStream *js) {
+    js->error = 1;
+    js->state = JSON_STREAM_DONE;
+}
+
+/*
+ * expect moves past the character c
+ *
+ * returns 0 and stops the stream if it is not next
+ */
+static int expect(JsonStream *js, char c) {
+    if (peek(js) != c) {
+        fprintf(stderr, "Error: %s parse error at byte %lu: expected '%c'\n",
+                js->filename, (unsigned long)js->pos, c);
+        fail(js);
+        return 0;
+    }
+    js->pos++;
+    return 1;
+}
+
+/*
+ * parse_value parses the single json value at the
+ * current position and moves past it
+ *
+ * returns NULL and stops the stream on a parse error
+ *
+ * side effects: allocates a json value which must
+ * be freed with json_decref
+ */
+static json_t * parse_value(JsonStream *js) {
+    json_t       *value;
+    json_error_t  error;
+
+    skip_whitespace(js);
+    value = json_loadb(js->data + js->pos, js->size - js->pos,
+                       JSON_DISABLE_EOF_CHECK | JSON_DECODE_ANY, &error);
+    if (!value) {
+        fprintf(stderr, "Error: %s parse error on line %d: %s\n",
+                js->filename, error.line, error.text);
+        fail(js);
+        return NULL;
+    }
+
+    /* without the eof check, position is the length of the value */
+    js->pos += error.position;
+
+    return value;
+}
+
+/*
+ * release_consumed drops the mapped pages that have been
+ * parsed, so the resident size does not grow with the file
+ */
+static void release_consumed(JsonStream *js) {
+    long   page = sysconf(_SC_PAGESIZE);
+    size_t end = js->pos - js->pos % page;
+
+    if (end - js->released >= RELEASE_STEP) {
+        madvise((char *)js->data + js->released, end - js->released,
+                MADV_DONTNEED);
+        js->released = end;
+    }
+}
+
+/*
+ * read_members reads top level members up to the start of
+ * the streamed array, or to the end of the object
+ */
+static void read_members(JsonStream *js) {
+    json_t     *key, *value;
+    const char *name;
+    char        c;
+
+    for (;;) {
+        c = peek(js);
+        if (c == ',') {
+            js->pos++;
+            continue;
+        }
+        if (c == '}') {
+            js->pos++;
+            js->state = JSON_STREAM_DONE;
+            return;
+        }
+        if (c != '"') {
+            expect(js, '"');
+            return;
+        }
+
+        key = parse_value(js);
+        if (!key) {
+            return;
+        }
+        name = json_string_value(key);
+        if (!expect(js, ':')) {
+            json_decref(key);
+            return;
+        }
+
+        if (!js->found && strcmp(name, js->array_key) == 0) {
+            if (peek(js) != '[') {
+                fprintf(stderr, "Error: %s: %s is not an array\n",
+                        js->filename, js->array_key);
+                json_decref(key);
+                fail(js);
+                return;
+            }
+            js->pos++;
+            js->found = 1;
+            js->state = JSON_STREAM_ARRAY;
+            json_decref(key);
+            return;
+        }
+
+        value = parse_value(js);
+        if (!value) {
+            json_decref(key);
+            return;
+        }
+        if (js->on_member) {
+            js->on_member(name, value, js->opaque);
+        }
+        json_decref(value);
+        json_decref(key);
+    }
+}
+
+/*
+ * json_stream_open maps the file and reads the top level
+ * members before array_key, passing each to on_member,
+ * which may be NULL
+ *
+ * returns NULL if the file can not be read or
+ * does not start with a valid object
+ *
+ * side effects: allocates a JsonStream which must be
+ * freed with json_stream_close
+ */
+JsonStream * json_stream_open(const char *filename, const char *array_key,
+                              json_member_cb on_member, void *opaque) {
+    JsonStream *js;
+
+    js = malloc(sizeof(JsonStream));
+    if (!js) {
+        fprintf(stderr, "Fatal: could not allocate json stream\n");
+        exit(1);
+    }
+
+    js->data = map_file(filename, &js->size);
+    if (!js->data) {
+        free(js);
+        return NULL;
+    }
+    js->filename = strdup(filename);
+    js->array_key = array_key;
+    js->on_member = on_member;
+    js->opaque = opaque;
+    js->pos = 0;
+    js->released = 0;
+    js->found = 0;
+    js->error = 0;
+
+    madvise((char *)js->data, js->size, MADV_SEQUENTIAL);
+
+    js->state = JSON_STREAM_MEMBERS;
+    if (expect(js, '{')) {
+        read_members(js);
+    }
+    if (js->error) {
+        json_stream_close(js);
+        return NULL;
+    }
+
+    return js;
+}
+
+/*
+ * json_stream_next returns the next element of the array,
+ * or NULL after the last one. Members following the array
+ * are passed to on_member before NULL is returned. After a
+ * parse error it returns NULL with error set.
+ *
+ * side effects: allocates a json value which must
+ * be freed with json_decref
+ */
+json_t * json_stream_next(JsonStream *js) {
+    char c;
+
+    if (js->state != JSON_STREAM_ARRAY) {
+        return NULL;
+    }
+
+    c = peek(js);
+    if (c == ',') {
+        js->pos++;
+        c = peek(js);
+    }
+    if (c == ']') {
+        js->pos++;
+        js->state = JSON_STREAM_MEMBERS;
+        read_members(js);
+        return NULL;
+    }
+
+    release_consumed(js);
+    return parse_value(js);
+}
+
+void json_stream_close(JsonStream *js) {
+    if (js == NULL) return;
+    munmap((void *)js->data, js->size);
+    free(js->filename);
+    free(js);
+}
@@ -1,7 +1,48 @@
 #ifndef _JSON_H_
 #define _JSON_H_
 
+#include <stddef.h>
 #include <jansson.h>
+
 json_t * read_json(char* filename);
 
+/*
+ * A JsonStream walks a top level json object in a memory
+ * mapped file without building a DOM for all of it. The
+ * elements of one array member are returned one at a time
+ * by json_stream_next, every other member is parsed whole
+ * and passed to a callback as it is reached.
+ */
+
+typedef void (*json_member_cb)(const char *key, json_t *value, void *opaque);
+
+enum JsonStreamState {
+    JSON_STREAM_MEMBERS, /* between top level members */
+    JSON_STREAM_ARRAY,   /* inside the streamed array */
+    JSON_STREAM_DONE
+};
+
+typedef struct JsonStream {
+    char                 *filename;
+    const char           *array_key;
+    json_member_cb        on_member;
+    void                 *opaque;
+
+    const char           *data;
+    size_t                size;
+    size_t                pos;
+    size_t                released; /* pages before this are dropped */
+
+    enum JsonStreamState  state;
+    int                   found;    /* the array member was seen */
+    int                   error;    /* stopped on a parse error */
+} JsonStream;
+
+JsonStream * json_stream_open(const char *filename, const char *array_key,
+                              json_member_cb on_member, void *opaque);
+
+json_t * json_stream_next(JsonStream *js);
+
+void json_stream_close(JsonStream *js);
+
 #endif
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <jansson.h>
+
+#include "actualizer.h"
+#include "decoder.h"
+#include "live.h"
+#include "options.h"
+#include "utils.h"
+#include "video.h"
+
+#define SCREEN_LOG_FILE "videodata.log"
+#define TOUCH_LOG_FILE  "touch.log"
+#define VIDEO_DATA_FILE "videodata.json"
+
+#define LOG_CHUNK_SIZE 4096
+
+/* inotify events read at once */
+#define EVENT_BUFFER_SIZE (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/*
+ * LogReader follows a file that is only appended to, and
+ * hands over each line once it is complete
+ */
+typedef struct LogReader {
+    char   *filename;
+    off_t   offset;
+    char   *line;    /* the incomplete last line */
+    size_t  len, size;
+} LogReader;
+
+/*
+ * Live is the state of a live render. The timeline is
+ * rendered up to rendered, the current screenshot is held
+ * in frame and extended as time passes until the next one
+ * is reached.
+ */
+typedef struct Live {
+    const Options     *opts;
+    char              *video_folder;
+    char              *video_json_filename;
+    LogReader          screen_log, touch_log;
+    int                done;       /* videodata.json appeared */
+
+    /* screenshots of the log, and the one shown */
+    Screenshot        *shots;
+    int                n_shots, shots_size;
+    int                current;
+    int                next_closed; /* the next one was closed after
+                                       writing since it became next */
+    AVFrame           *frame;
+    long               rendered;
+    RawFormat          raw;        /* layout of raw framebuffers */
+
+    /* session time estimate, from the latest screenshot */
+    long               clock_time;
+    int64_t            clock_wall;
+
+    /* output, opened with the first screenshot */
+    ImageDecoder      *dec;
+    TouchData         *touch_data;
+    TouchActualizer   *ta;
+    AVFormatContext   *oc;
+    AVStream          *st;
+    struct SwsContext *sc;
+    VideoOutput       *vo;
+    int                hls;
+} Live;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static char * join_path(const char *folder, const char *name) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s", folder, name) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+    return path;
+}
+
+/*
+ * log_read passes the lines appended to the log since the
+ * last call to on_line, parsed as json. A missing log has
+ * no lines yet.
+ */
+static void log_read(LogReader *log, Live *live,
+                     void (*on_line)(Live *, json_t *)) {
+    json_error_t  error;
+    json_t       *object;
+    char          chunk[LOG_CHUNK_SIZE];
+    char         *start, *end;
+    ssize_t       n;
+    int           fd;
+
+    fd = open(log->filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    while ((n = pread(fd, chunk, sizeof(chunk), log->offset)) > 0) {
+        log->offset += n;
+
+        if (log->len + n > log->size) {
+            log->size = 2 * (log->len + n);
+            log->line = realloc(log->line, log->size);
+            if (!log->line) {
+                fprintf(stderr, "Fatal: could not allocate log line\n");
+                exit(1);
+            }
+        }
+        memcpy(log->line + log->len, chunk, n);
+        log->len += n;
+
+        start = log->line;
+        while ((end = memchr(start, '\n', log->line + log->len - start))) {
+            if (end > start) {
+                object = json_loadb(start, end - start, 0, &error);
+                if (object) {
+                    on_line(live, object);
+                    json_decref(object);
+                } else {
+                    fprintf(stderr, "Warning: %s: skipping invalid line: %s\n",
+                            log->filename, error.text);
+                }
+            }
+            start = end + 1;
+        }
+        log->len -= start - log->line;
+        memmove(log->line, start, log->len);
+    }
+
+    close(fd);
+}
+
+static long session_now(Live *live) {
+    return live->clock_time + (long)((av_gettime() - live->clock_wall) / 1000);
+}
+
+/*
+ * add_shot appends a screenshot of the screen log. The session
+ * clock follows the screenshots, so a backlog is rendered at
+ * once and the timeline then runs on in real time. A line with
+ * the framebuffer format of raw screenshots, which must come
+ * before them, sets it instead.
+ */
+static void add_shot(Live *live, json_t *data) {
+    Screenshot *shot;
+    json_t     *raw;
+    long        time;
+
+    raw = json_object_get(data, RAWFB_JSON_KEY);
+    if (raw) {
+        if (live->dec || rawfb_parse_json(raw, &live->raw) != 0) {
+            fprintf(stderr, "Warning: ignoring framebuffer format\n");
+        }
+        return;
+    }
+
+    time = json_integer_value(json_object_get(data, "time"));
+    if (!json_is_string(json_object_get(data, "name"))) {
+        fprintf(stderr, "Warning: screenshot without a name\n");
+        return;
+    }
+    if (live->n_shots > 0 && time < live->shots[live->n_shots-1].time) {
+        fprintf(stderr, "Warning: skipping screenshot out of order\n");
+        return;
+    }
+
+    if (live->n_shots == live->shots_size) {
+        live->shots_size = live->shots_size ? 2 * live->shots_size : 256;
+        live->shots = realloc(live->shots,
+                              live->shots_size * sizeof(Screenshot));
+        if (!live->shots) {
+            fprintf(stderr, "Fatal: could not allocate screenshot list\n");
+            exit(1);
+        }
+    }
+
+    if (live->n_shots > 0) {
+        live->shots[live->n_shots-1].interval =
+            time - live->shots[live->n_shots-1].time;
+    }
+    shot = &live->shots[live->n_shots++];
+    shot->filepath = join_path(live->video_folder,
+                               json_string_value(json_object_get(data, "name")));
+    shot->time = time;
+    shot->interval = 0;
+
+    if (live->n_shots == 1 || time > session_now(live)) {
+        live->clock_time = time;
+        live->clock_wall = av_gettime();
+    }
+}
+
+static void add_touch(Live *live, json_t *object) {
+    TouchData_add_json(live->touch_data, object);
+}
+
+/*
+ * open_live_output opens the output for the size of the first
+ * screenshot. The encoder runs without lookahead, frame threads
+ * or B-frames, so every frame comes out as soon as it goes in.
+ *
+ * returns 0 on success
+ */
+static int open_live_output(Live *live, AVFrame *first) {
+    const Options  *opts = live->opts;
+    EncoderProfile  profile = opts->profile;
+    AVDictionary   *mux_opts = NULL;
+    AVCodec        *codec;
+    AVRational      time_base;
+    char            value[32];
+    int             out_width, out_height, segment_secs, ret;
+
+    /* FFMPEG requires dimensions to be
+     * multiple of 2 */
+    out_width = first->width + first->width % 2;
+    out_height = first->height + first->height % 2;
+
+    live->oc = open_output(opts->dst_filename, NULL);
+    if (!live->oc) {
+        return -1;
+    }
+    live->hls = strcmp(live->oc->oformat->name, "hls") == 0;
+
+    /* segments cut at keyframes, half the latency apart */
+    segment_secs = opts->latency / 2000;
+    if (segment_secs < 1) segment_secs = 1;
+
+    profile.lookahead = 0;
+    profile.thread_type = FF_THREAD_SLICE;
+    if (live->hls) {
+        profile.gop_size = opts->fps * segment_secs;
+    }
+
+    time_base.num = 1;
+    time_base.den = opts->vfr ? VFR_TIME_BASE_DEN : opts->fps;
+
+    live->st = add_video_stream(live->oc, &codec, &profile,
+                                out_width, out_height, time_base);
+    if (!live->st) {
+        return -1;
+    }
+    live->st->codec->max_b_frames = 0;
+
+    ret = avcodec_open2(live->st->codec, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
+        return -1;
+    }
+
+    if (live->hls) {
+        snprintf(value, sizeof(value), "%d", segment_secs);
+        av_dict_set(&mux_opts, "hls_time", value, 0);
+        av_dict_set(&mux_opts, "hls_list_size", "0", 0);
+    } else {
+        /* a fragment is cut at every flush */
+        av_dict_set(&mux_opts, "movflags",
+                    "frag_custom+empty_moov+default_base_moof", 0);
+    }
+    ret = write_header(live->oc, &mux_opts);
+    av_dict_free(&mux_opts);
+    if (ret != 0) {
+        return -1;
+    }
+
+    live->sc = get_scale_ctx(first->width, first->height, first->format,
+                             out_width, out_height, profile.pix_fmt,
+                             profile.scale_method);
+    live->ta = TouchActualizer_new_shared(live->touch_data,
+                                          first->width, first->height);
+    live->vo = video_output_new(live->oc, live->st, live->sc, live->ta,
+                                opts->fps, opts->vfr,
+                                live->shots[live->current + 1].time);
+    video_output_set_convert_threads(live->vo, opts->convert_threads);
+    if (live->hls) {
+        /* with --vfr the GOP size alone does not bound the segments */
+        video_output_set_keyframe_interval(live->vo, segment_secs * 1000L);
+    }
+    return 0;
+}
+
+/*
+ * still_written tells if a screenshot that could not be
+ * decoded may still be being written: its close after writing
+ * was not seen, and it was modified within the latency
+ */
+static int still_written(Live *live, const Screenshot *shot) {
+    struct stat st;
+
+    if (live->next_closed || stat(shot->filepath, &st) != 0) {
+        return 0;
+    }
+    return (time(NULL) - st.st_mtime) * 1000L <= live->opts->latency;
+}
+
+/*
+ * decode_next decodes the screenshot after the current one
+ * and makes it current
+ *
+ * returns 0 if its picture is not there yet, or may still be
+ * being written, 1 if it is now shown, and 1 as well if it
+ * could not be decoded, in which case the previous picture
+ * stays on
+ */
+static int decode_next(Live *live) {
+    Screenshot *shot = &live->shots[live->current + 1];
+    AVFrame    *frame;
+
+    if (access(shot->filepath, R_OK) != 0) {
+        return 0;
+    }
+
+    if (!live->dec && live->raw.header != RAWFB_OWN_HEADER) {
+        live->dec = image_decoder_new_raw(&live->raw);
+    } else if (!live->dec) {
+        live->dec = image_decoder_new(shot->filepath, 0);
+    }
+    frame = live->dec ? image_decoder_decode(live->dec, shot->filepath) : NULL;
+    if (!frame && still_written(live, shot)) {
+        /* tried again on the next tick */
+        return 0;
+    }
+    if (!frame) {
+        fprintf(stderr, "Warning: could not decode %s\n", shot->filepath);
+        live->current++;
+        live->next_closed = 0;
+        return 1;
+    }
+
+    if (!live->oc) {
+        if (open_live_output(live, frame) != 0) {
+            av_frame_free(&frame);
+            return -1;
+        }
+        live->rendered = shot->time;
+    }
+
+    av_frame_free(&live->frame);
+    live->frame = frame;
+    live->current++;
+    live->next_closed = 0;
+    return 1;
+}
+
+/*
+ * write_span extends the current screenshot over
+ * [start, end) of the timeline
+ */
+static void write_span(Live *live, long start, long end) {
+    VideoOutput *vo = live->vo;
+    int64_t      frames;
+
+    if (vo->vfr) {
+        write_frame(vo, live->frame, start, end - start);
+        return;
+    }
+
+    /* whole frames up to end, as write_frame counts them */
+    frames = interval_to_frames(end - vo->base, vo->fps) - vo->pts;
+    if (frames > 0) {
+        write_frame(vo, live->frame, start,
+                    lround(frames * 1000.0 / vo->fps));
+    }
+}
+
+/*
+ * advance renders the timeline up to target, moving on to
+ * each screenshot once the timeline reaches its time
+ *
+ * returns 0, or -1 if the output can not be written
+ */
+static int advance(Live *live, long target) {
+    Screenshot *next;
+    long        end;
+    int         n_pictures, ret;
+
+    /* once the session is done, the last timestamp is the end */
+    n_pictures = live->done ? live->n_shots - 1 : live->n_shots;
+
+    for (;;) {
+        if (live->current + 1 < n_pictures) {
+            next = &live->shots[live->current + 1];
+            if (!live->frame || live->rendered >= next->time) {
+                ret = decode_next(live);
+                if (ret < 0) return -1;
+                if (ret == 0) return 0;
+                continue;
+            }
+        }
+        if (!live->frame) {
+            return 0;
+        }
+
+        end = target;
+        if (live->current + 1 < live->n_shots &&
+            live->shots[live->current + 1].time < end) {
+            end = live->shots[live->current + 1].time;
+        }
+        if (end <= live->rendered) {
+            return 0;
+        }
+
+        write_span(live, live->rendered, end);
+        live->rendered = end;
+        if (live->vo->error) {
+            return -1;
+        }
+
+        /* late touch events take effect after what is rendered */
+        live->touch_data->horizon = end + 1000 / live->opts->fps;
+    }
+}
+
+/*
+ * flush_fragment writes what was encoded so far as a new
+ * fragment, HLS cuts its segments itself
+ */
+static void flush_fragment(Live *live) {
+    if (!live->oc) {
+        return;
+    }
+    if (!live->hls) {
+        av_write_frame(live->oc, NULL);
+        avio_flush(live->oc->pb);
+    }
+}
+
+/*
+ * read_events drains the inotify events. The logs are read
+ * anyway, only the end of the session and the close of the
+ * next screenshot after writing need attention.
+ */
+static void read_events(Live *live, int fd) {
+    char                        buf[EVENT_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    const char                 *next = NULL;
+    ssize_t                     n;
+    char                       *p;
+
+    if (live->current + 1 < live->n_shots) {
+        next = strrchr(live->shots[live->current + 1].filepath, '/') + 1;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->len == 0) {
+                continue;
+            }
+            if (strcmp(event->name, VIDEO_DATA_FILE) == 0) {
+                live->done = 1;
+            }
+            if (next && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+                strcmp(event->name, next) == 0) {
+                live->next_closed = 1;
+            }
+        }
+    }
+}
+
+static void live_free(Live *live) {
+    if (live->vo) video_output_free(live->vo);
+    if (live->ta) TouchActualizer_destroy(live->ta);
+    if (live->sc) sws_freeContext(live->sc);
+    if (live->st) avcodec_close(live->st->codec);
+    if (live->oc) close_output(live->oc);
+    if (live->dec) image_decoder_free(live->dec);
+    av_frame_free(&live->frame);
+    TouchData_destroy(live->touch_data);
+    free_screenshots(live->shots, live->n_shots);
+    free(live->screen_log.filename);
+    free(live->screen_log.line);
+    free(live->touch_log.filename);
+    free(live->touch_log.line);
+    free(live->video_json_filename);
+    free(live->video_folder);
+}
+
+/*
+ * live_run renders the session in opts->basedir into
+ * opts->dst_filename while it is recorded. Every tick, a
+ * quarter of the latency, the logs are read and the timeline
+ * is rendered up to another quarter behind the session clock,
+ * which leaves room for touch events logged late, then cut
+ * into a fragment.
+ *
+ * returns 0 on success, 1 on failure
+ */
+int live_run(const Options *opts) {
+    struct sigaction  action;
+    struct pollfd     pfd;
+    Live              live;
+    char             *touch_folder;
+    int               fd, tick, ret = 0;
+
+    memset(&live, 0, sizeof(Live));
+    live.opts = opts;
+    live.current = -1;
+    live.rendered = LONG_MIN;
+    rawfb_format_init(&live.raw);
+    live.video_folder = get_video_folder(opts->basedir);
+    live.video_json_filename = get_video_json_filename(live.video_folder);
+    touch_folder = get_touch_folder(opts->basedir);
+    live.screen_log.filename = join_path(live.video_folder, SCREEN_LOG_FILE);
+    live.touch_log.filename = join_path(touch_folder, TOUCH_LOG_FILE);
+    live.touch_data = TouchData_new_live();
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 ||
+        inotify_add_watch(fd, live.video_folder, IN_CLOSE_WRITE |
+                          IN_MOVED_TO | IN_MODIFY) < 0 ||
+        inotify_add_watch(fd, touch_folder, IN_MODIFY | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error: could not watch %s and %s\n",
+                live.video_folder, touch_folder);
+        if (fd >= 0) close(fd);
+        free(touch_folder);
+        live_free(&live);
+        return 1;
+    }
+    free(touch_folder);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    tick = opts->latency / 4;
+    if (tick < 1) tick = 1;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!stop_requested && !live.done && ret == 0) {
+        /* a finished session may already be there */
+        live.done = access(live.video_json_filename, F_OK) == 0;
+
+        log_read(&live.touch_log, &live, add_touch);
+        log_read(&live.screen_log, &live, add_shot);
+
+        if (!live.done && live.n_shots > 0) {
+            ret = advance(&live, session_now(&live) - tick);
+            flush_fragment(&live);
+        }
+
+        if (!live.done && poll(&pfd, 1, tick) > 0) {
+            read_events(&live, fd);
+        }
+    }
+    close(fd);
+
+    /* the rest of the session, up to its end marker, or up to now */
+    log_read(&live.touch_log, &live, add_touch);
+    log_read(&live.screen_log, &live, add_shot);
+    if (ret == 0 && live.n_shots > 0) {
+        ret = advance(&live, live.done ?
+                      live.shots[live.n_shots - 1].time : session_now(&live));
+    }
+
+    if (live.vo) {
+        if (ret == 0) {
+            flush_video(live.vo);
+        }
+        if (ret != 0 || live.vo->error || av_write_trailer(live.oc) < 0) {
+            fprintf(stderr, "Error: could not finish %s\n", opts->dst_filename);
+            ret = -1;
+        }
+    } else if (ret == 0) {
+        fprintf(stderr, "Error: no screenshot was rendered\n");
+        ret = -1;
+    }
+
+    live_free(&live);
+
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#include "options.h"
+
+/*
+ * Live mode renders a session while it is being recorded.
+ * The recorder appends one line per screenshot to
+ * Screen/videodata.log, each the json object the timestamps
+ * array of videodata.json would hold, after the picture is
+ * written, and one line per touch event to Touch/touch.log.
+ * The folders are watched with inotify, and the video is
+ * written as fragmented MP4, or as HLS for a .m3u8 output,
+ * a bounded time after the screenshots arrive.
+ *
+ * The session ends when Screen/videodata.json appears, whose
+ * last timestamp, also the last line of the log, marks the
+ * end, or on SIGINT or SIGTERM.
+ */
+
+int live_run(const Options *opts);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include "options.h"
+#include "profile.h"
+
+#define DEFAULT_FPS 25
+#define DEFAULT_PROFILE "default"
+#define DEFAULT_LATENCY 2000
+
+/* decoded screenshots kept in flight per decode thread */
+#define QUEUE_DEPTH_PER_THREAD 2
+#define DEFAULT_FRAME_CACHE_SIZE 4096
+
+/*
+ * parse_int reads a non-negative integer option value,
+ * exits on anything else
+ */
+static int parse_int(const char *name, const char *value) {
+    char *end;
+    long  n;
+
+    n = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n < 0 || n > 4096) {
+        fprintf(stderr, "Fatal: invalid value '%s' for --%s\n", value, name);
+        exit(1);
+    }
+
+    return (int)n;
+}
+
+/*
+ * parse_megabytes reads a positive size option value in MB,
+ * exits on anything else
+ */
+static int parse_megabytes(const char *name, const char *value) {
+    char *end;
+    long  n;
+
+    n = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n <= 0 || n > INT_MAX) {
+        fprintf(stderr, "Fatal: invalid value '%s' for --%s\n", value, name);
+        exit(1);
+    }
+
+    return (int)n;
+}
+
+/*
+ * options_init fills in the defaults, which
+ * reproduce the original single threaded behaviour
+ */
+void options_init(Options *opts) {
+    opts->command = COMMAND_RENDER;
+
+    opts->basedir = NULL;
+    opts->dst_filename = NULL;
+    opts->jobs = NULL;
+
+    opts->use_index = 1;
+
+    opts->fps = DEFAULT_FPS;
+    opts->vfr = 0;
+
+    opts->decode_threads = 0;
+    opts->queue_depth = 0;
+
+    opts->convert_threads = 1;
+
+    opts->dedup = 0;
+    opts->n_dedup_ignore = 0;
+
+    opts->frame_cache = NULL;
+    opts->frame_cache_size = DEFAULT_FRAME_CACHE_SIZE;
+    opts->frame_cache_lz4 = 0;
+
+    opts->append = 0;
+
+    opts->segments = 0;
+
+    opts->latency = DEFAULT_LATENCY;
+
+    opts->workers = 0;
+
+    opts->quiet = 0;
+
+    opts->stats = NULL;
+    opts->trace = NULL;
+
+    profile_load(&opts->profile, DEFAULT_PROFILE);
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options] <input folder> <output file>\n"
+           "       %s index <input folder>\n"
+           "       %s batch [options] <job file | - | spool folder>\n"
+           "       %s live [options] <input folder> <output file>\n"
+           "\n"
+           "The index command compiles the session into a binary index in\n"
+           "the input folder, which renders use while it is up to date.\n"
+           "The batch command renders a list of jobs, one json object per\n"
+           "line, or the job files dropped into a spool folder, and reports\n"
+           "one json result per job on stdout. Options apply to every job.\n"
+           "The live command renders a session while it is recorded, from\n"
+           "the logs the recorder appends to, into fragmented MP4 or, for a\n"
+           ".m3u8 output, HLS.\n"
+           "\n"
+           "Options:\n"
+           "  -r, --fps N             output frame rate (default %d)\n"
+           "      --vfr               variable frame rate: write one frame per\n"
+           "                          screenshot or touch change, at most fps\n"
+           "                          frames per second\n"
+           "      --cfr               constant frame rate (default)\n"
+           "  -j, --decode-threads N  decode screenshots on N worker threads\n"
+           "                          ahead of the encoder (default 0, decode\n"
+           "                          on the encoder thread)\n"
+           "  -q, --queue-depth N     max decoded screenshots waiting for the\n"
+           "                          encoder (default %d per decode thread)\n"
+           "      --convert-threads N convert each frame in N bands at once,\n"
+           "                          if it does not scale (default 1)\n"
+           "  -s, --segments N        split the session into N segments that\n"
+           "                          are encoded in parallel, then joined\n"
+           "      --no-index          ignore the session index\n"
+           "      --dedup             decode identical consecutive screenshots\n"
+           "                          once, and skip the color conversion of\n"
+           "                          screenshots with unchanged pixels\n"
+           "      --dedup-ignore X,Y,W,H\n"
+           "                          leave a region, such as a clock, out of\n"
+           "                          the pixel comparison, may be repeated up\n"
+           "                          to %d times, implies --dedup\n"
+           "      --frame-cache DIR   keep converted screenshots in DIR and\n"
+           "                          reuse them in later renders\n"
+           "      --frame-cache-size MB\n"
+           "                          max size of the frame cache, least\n"
+           "                          recently used entries are removed\n"
+           "                          (default %d)\n"
+           "      --frame-cache-lz4   LZ4 compress new frame cache entries\n"
+           "      --append            write a fragmented MP4 and on later\n"
+           "                          runs only append the new screenshots\n"
+           "  -w, --workers N         batch: render N jobs at once (default\n"
+           "                          one per core)\n"
+           "      --quiet             no progress output\n"
+           "      --stats FILE        write the time spent in each stage, the\n"
+           "                          frame rate and peak memory as json to\n"
+           "                          FILE at exit, - for stdout (not in batch)\n"
+           "      --trace FILE        write a timeline of the decode, overlay,\n"
+           "                          conversion, encode and write calls on\n"
+           "                          each thread, for chrome://tracing or\n"
+           "                          Perfetto\n"
+           "      --latency MS        live: max delay from screenshot to\n"
+           "                          output (default %d)\n"
+           "  -h, --help              show this message\n"
+           "\n"
+           "Encoder options:\n"
+           "  -p, --profile NAME      encoder profile, built-in or a json file\n"
+           "                          of the fields below (default '%s')\n"
+           "      --list-profiles     show the built-in profiles\n"
+           "      --codec NAME        encoder or codec name\n"
+           "      --preset NAME       encoder preset, 'none' for the default\n"
+           "      --tune NAME         encoder tuning, 'none' for the default\n"
+           "      --crf N             constant quality, -1 to use the bitrate\n"
+           "      --bitrate N         bits per second, if crf is not used\n"
+           "      --gop N             max frames between keyframes\n"
+           "      --thread-type TYPE  frame, slice or auto\n"
+           "      --encoder-threads N encoder threads, 0 for one per core\n"
+           "      --lookahead N       rate control lookahead in frames\n"
+           "      --pix-fmt NAME      output pixel format\n"
+           "      --scaler NAME       fast_bilinear, bilinear, bicubic, point\n"
+           "                          or area\n",
+           prog, prog, prog, prog, DEFAULT_FPS, QUEUE_DEPTH_PER_THREAD,
+           DEDUP_MAX_REGIONS, DEFAULT_FRAME_CACHE_SIZE, DEFAULT_LATENCY, DEFAULT_PROFILE);
+}
+
+/*
+ * parse_options fills opts from the command line
+ *
+ * returns 0 on success, exits on invalid input
+ */
+int parse_options(Options *opts, int argc, char *argv[]) {
+    enum {
+        OPT_VFR = 256,
+        OPT_CFR,
+        OPT_NO_INDEX,
+        OPT_QUIET,
+        OPT_APPEND,
+        OPT_LATENCY,
+        OPT_DEDUP,
+        OPT_DEDUP_IGNORE,
+        OPT_FRAME_CACHE,
+        OPT_FRAME_CACHE_SIZE,
+        OPT_FRAME_CACHE_LZ4,
+        OPT_STATS,
+        OPT_TRACE,
+        OPT_CONVERT_THREADS,
+        OPT_LIST_PROFILES,
+        OPT_PROFILE_FIELD
+    };
+    static const struct option long_opts[] = {
+        { "fps",            required_argument, NULL, 'r' },
+        { "vfr",            no_argument,       NULL, OPT_VFR },
+        { "cfr",            no_argument,       NULL, OPT_CFR },
+        { "decode-threads", required_argument, NULL, 'j' },
+        { "queue-depth",    required_argument, NULL, 'q' },
+        { "convert-threads", required_argument, NULL, OPT_CONVERT_THREADS },
+        { "segments",       required_argument, NULL, 's' },
+        { "no-index",       no_argument,       NULL, OPT_NO_INDEX },
+        { "workers",        required_argument, NULL, 'w' },
+        { "quiet",          no_argument,       NULL, OPT_QUIET },
+        { "stats",          required_argument, NULL, OPT_STATS },
+        { "trace",          required_argument, NULL, OPT_TRACE },
+        { "append",         no_argument,       NULL, OPT_APPEND },
+        { "latency",        required_argument, NULL, OPT_LATENCY },
+        { "dedup",          no_argument,       NULL, OPT_DEDUP },
+        { "dedup-ignore",   required_argument, NULL, OPT_DEDUP_IGNORE },
+        { "frame-cache",    required_argument, NULL, OPT_FRAME_CACHE },
+        { "frame-cache-size", required_argument, NULL, OPT_FRAME_CACHE_SIZE },
+        { "frame-cache-lz4", no_argument,      NULL, OPT_FRAME_CACHE_LZ4 },
+        { "help",           no_argument,       NULL, 'h' },
+        { "profile",        required_argument, NULL, 'p' },
+        { "list-profiles",  no_argument,       NULL, OPT_LIST_PROFILES },
+        /* named after the profile fields they override */
+        { "codec",          required_argument, NULL, OPT_PROFILE_FIELD },
+        { "preset",         required_argument, NULL, OPT_PROFILE_FIELD },
+        { "tune",           required_argument, NULL, OPT_PROFILE_FIELD },
+        { "crf",            required_argument, NULL, OPT_PROFILE_FIELD },
+        { "bitrate",        required_argument, NULL, OPT_PROFILE_FIELD },
+        { "gop",            required_argument, NULL, OPT_PROFILE_FIELD },
+        { "thread-type",    required_argument, NULL, OPT_PROFILE_FIELD },
+        { "encoder-threads", required_argument, NULL, OPT_PROFILE_FIELD },
+        { "lookahead",      required_argument, NULL, OPT_PROFILE_FIELD },
+        { "pix-fmt",        required_argument, NULL, OPT_PROFILE_FIELD },
+        { "scaler",         required_argument, NULL, OPT_PROFILE_FIELD },
+        { NULL, 0, NULL, 0 }
+    };
+    EncoderProfile  overrides;
+    const char     *profile_name = DEFAULT_PROFILE;
+    int             c, index;
+
+    /* overrides apply to the profile whatever the option order */
+    profile_clear(&overrides);
+
+    while ((c = getopt_long(argc, argv, "r:j:q:s:w:p:h", long_opts,
+                            &index)) != -1) {
+        switch (c) {
+        case 'r':
+            opts->fps = parse_int("fps", optarg);
+            if (opts->fps == 0) {
+                fprintf(stderr, "Fatal: --fps must be positive\n");
+                exit(1);
+            }
+            break;
+        case OPT_VFR:
+            opts->vfr = 1;
+            break;
+        case OPT_CFR:
+            opts->vfr = 0;
+            break;
+        case 'j':
+            opts->decode_threads = parse_int("decode-threads", optarg);
+            break;
+        case 'q':
+            opts->queue_depth = parse_int("queue-depth", optarg);
+            break;
+        case OPT_CONVERT_THREADS:
+            opts->convert_threads = parse_int("convert-threads", optarg);
+            break;
+        case 's':
+            opts->segments = parse_int("segments", optarg);
+            break;
+        case OPT_NO_INDEX:
+            opts->use_index = 0;
+            break;
+        case 'w':
+            opts->workers = parse_int("workers", optarg);
+            break;
+        case OPT_QUIET:
+            opts->quiet = 1;
+            break;
+        case OPT_STATS:
+            opts->stats = optarg;
+            break;
+        case OPT_TRACE:
+            opts->trace = optarg;
+            break;
+        case OPT_APPEND:
+            opts->append = 1;
+            break;
+        case OPT_LATENCY:
+            opts->latency = parse_int("latency", optarg);
+            if (opts->latency == 0) {
+                fprintf(stderr, "Fatal: --latency must be positive\n");
+                exit(1);
+            }
+            break;
+        case OPT_DEDUP:
+            opts->dedup = 1;
+            break;
+        case OPT_DEDUP_IGNORE:
+            if (opts->n_dedup_ignore == DEDUP_MAX_REGIONS) {
+                fprintf(stderr, "Fatal: at most %d --dedup-ignore regions\n",
+                        DEDUP_MAX_REGIONS);
+                exit(1);
+            }
+            if (dedup_parse_region(optarg,
+                                   &opts->dedup_ignore[opts->n_dedup_ignore])
+                != 0) {
+                fprintf(stderr, "Fatal: invalid --dedup-ignore region '%s', "
+                        "expected X,Y,W,H\n", optarg);
+                exit(1);
+            }
+            opts->n_dedup_ignore++;
+            opts->dedup = 1;
+            break;
+        case OPT_FRAME_CACHE:
+            opts->frame_cache = optarg;
+            break;
+        case OPT_FRAME_CACHE_SIZE:
+            opts->frame_cache_size = parse_megabytes("frame-cache-size",
+                                                     optarg);
+            break;
+        case OPT_FRAME_CACHE_LZ4:
+            opts->frame_cache_lz4 = 1;
+            break;
+        case 'p':
+            profile_name = optarg;
+            break;
+        case OPT_LIST_PROFILES:
+            profile_list();
+            exit(0);
+        case OPT_PROFILE_FIELD:
+            if (profile_parse_field(&overrides, long_opts[index].name,
+                                    optarg) != 0) {
+                exit(1);
+            }
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    profile_load(&opts->profile, profile_name);
+    profile_merge(&opts->profile, &overrides);
+
+    if (opts->queue_depth == 0) {
+        opts->queue_depth = QUEUE_DEPTH_PER_THREAD * opts->decode_threads;
+    }
+    /* a window smaller than the worker count leaves workers idle */
+    if (opts->decode_threads > 0 && opts->queue_depth < opts->decode_threads) {
+        opts->queue_depth = opts->decode_threads;
+    }
+
+    if (argc - optind >= 1 && strcmp(argv[optind], "index") == 0) {
+        if (argc - optind < 2) {
+            printf("Please provide an input folder\n");
+            exit(1);
+        }
+        opts->command = COMMAND_INDEX;
+        opts->basedir = argv[optind + 1];
+        return 0;
+    }
+
+    if (argc - optind >= 1 && strcmp(argv[optind], "batch") == 0) {
+        if (argc - optind < 2) {
+            printf("Please provide a job file, - or a spool folder\n");
+            exit(1);
+        }
+        /* stdout is for the job results */
+        if (opts->stats && strcmp(opts->stats, "-") == 0) {
+            fprintf(stderr, "Fatal: the batch command can not write "
+                    "--stats to stdout, give a file\n");
+            exit(1);
+        }
+        opts->command = COMMAND_BATCH;
+        opts->jobs = argv[optind + 1];
+        /* the job list is the parallelism, results go to stdout */
+        opts->segments = 0;
+        opts->quiet = 1;
+        return 0;
+    }
+
+    if (argc - optind >= 1 && strcmp(argv[optind], "live") == 0) {
+        optind++;
+        opts->command = COMMAND_LIVE;
+    }
+
+    if (argc - optind < 2) {
+        printf("Please provide an input folder and output file\n");
+        exit(1);
+    }
+    opts->basedir = argv[optind];
+    opts->dst_filename = argv[optind + 1];
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "dedup.h"
+#include "profile.h"
+
+enum Command {
+    COMMAND_RENDER, /* render a session into a video file */
+    COMMAND_INDEX,  /* compile the session index */
+    COMMAND_BATCH,  /* render a list of jobs on a worker pool */
+    COMMAND_LIVE    /* render a session while it is recorded */
+};
+
+typedef struct Options {
+    enum Command command;
+
+    /* positional arguments */
+    char *basedir;
+    char *dst_filename;   /* NULL for the index and batch commands */
+    char *jobs;           /* batch: job file, "-" or spool directory */
+
+    /* session */
+    int   use_index;      /* read the session index when up to date */
+
+    /* output timing */
+    int   fps;            /* frame rate, or max frame rate if vfr */
+    int   vfr;            /* one frame per visual state */
+
+    /* decode pipeline */
+    int   decode_threads; /* 0 decodes on the encoder thread */
+    int   queue_depth;    /* 0 picks a depth from decode_threads */
+
+    /* color conversion */
+    int   convert_threads; /* convert each frame in bands on this many
+                              threads, 0 or 1 converts on one */
+
+    /* deduplication */
+    int   dedup;          /* merge identical consecutive screenshots */
+    DedupRegion dedup_ignore[DEDUP_MAX_REGIONS];
+    int   n_dedup_ignore; /* regions left out of the pixel comparison */
+
+    /* converted screenshots kept between renders */
+    char *frame_cache;    /* cache folder, NULL for no cache */
+    int   frame_cache_size; /* max size of the folder in MB */
+    int   frame_cache_lz4; /* compress new entries */
+
+    /* output */
+    int   append;         /* render new screenshots as fragments at the
+                             end of the output */
+
+    /* parallel encoding */
+    int   segments;       /* encode this many segments at once, 0 or 1
+                             encodes the session in one piece */
+
+    /* live */
+    int   latency;        /* max millisecs from screenshot to output */
+
+    /* batch */
+    int   workers;        /* jobs rendered at once, 0 for one per core */
+
+    /* no progress output on stdout */
+    int   quiet;
+
+    /* json file for the run statistics, "-" for stdout, NULL for none */
+    char *stats;
+
+    /* trace event file of every timed call, NULL for none */
+    char *trace;
+
+    /* encoder settings, the selected profile with overrides applied */
+    EncoderProfile profile;
+} Options;
+
+void options_init(Options *opts);
+
+int parse_options(Options *opts, int argc, char *argv[]);
+
+void print_usage(const char *prog);
+
+#endif
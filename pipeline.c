@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "decoder.h"
+#include "pipeline.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * decode_worker claims screenshots in order and decodes them with
+ * its own decoder, never running more than depth screenshots
+ * ahead of the encoder
+ */
+static void * decode_worker(void *arg) {
+    DecodePipeline *pl = arg;
+    PipelineSlot   *slot;
+    ImageDecoder   *dec;
+    AVFrame        *frame;
+    int             i;
+
+    trace_thread_name("decode worker", 0);
+
+    /* the workers already run in parallel, one thread each */
+    dec = image_decoder_clone(pl->dec, 1);
+    if (!dec) {
+        fprintf(stderr, "Fatal: could not open decoder\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        while (!pl->stop && pl->next_claim < pl->n_shots &&
+               pl->next_claim >= pl->next_consume + pl->depth) {
+            pthread_cond_wait(&pl->slot_free, &pl->lock);
+        }
+        if (pl->stop || pl->next_claim >= pl->n_shots) {
+            break;
+        }
+        i = pl->next_claim++;
+        pthread_mutex_unlock(&pl->lock);
+
+        trace_set_screenshot(pl->indices[i], pl->shots[i].filepath);
+        frame = image_decoder_decode(dec, pl->shots[i].filepath);
+
+        pthread_mutex_lock(&pl->lock);
+        slot = &pl->slots[i % pl->depth];
+        slot->frame = frame;
+        slot->index = i;
+        pthread_cond_broadcast(&pl->slot_ready);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    image_decoder_free(dec);
+    return NULL;
+}
+
+/*
+ * pipeline_new starts n_workers decode threads over the
+ * screenshot list, each with a clone of dec. With no workers
+ * every screenshot is decoded on demand in pipeline_next
+ * with dec itself, which stays owned by the caller. indices
+ * are the screenshot indices the decodes are traced with,
+ * and must outlive the pipeline.
+ *
+ * side effects: allocates a DecodePipeline which
+ * must be freed with pipeline_free
+ */
+DecodePipeline * pipeline_new(Screenshot *shots, const int *indices,
+                              int n_shots, ImageDecoder *dec,
+                              int n_workers, int depth) {
+    DecodePipeline *pl;
+    int             i;
+
+    pl = malloc(sizeof(DecodePipeline));
+    if (!pl) {
+        fprintf(stderr, "Fatal: could not allocate decode pipeline\n");
+        exit(1);
+    }
+
+    pl->shots = shots;
+    pl->indices = indices;
+    pl->n_shots = n_shots;
+    pl->dec = dec;
+    pl->n_workers = n_workers;
+    pl->depth = depth < 1 ? 1 : depth;
+    pl->next_claim = 0;
+    pl->next_consume = 0;
+    pl->stop = 0;
+    pl->workers = NULL;
+    pl->slots = NULL;
+
+    if (n_workers == 0) {
+        return pl;
+    }
+
+    register_lock_manager();
+
+    pl->slots = malloc(pl->depth * sizeof(PipelineSlot));
+    pl->workers = malloc(n_workers * sizeof(pthread_t));
+    if (!pl->slots || !pl->workers) {
+        fprintf(stderr, "Fatal: could not allocate decode pipeline\n");
+        exit(1);
+    }
+    for (i = 0; i < pl->depth; i++) {
+        pl->slots[i].index = -1;
+        pl->slots[i].frame = NULL;
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->slot_free, NULL);
+    pthread_cond_init(&pl->slot_ready, NULL);
+
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&pl->workers[i], NULL, decode_worker, pl) != 0) {
+            fprintf(stderr, "Fatal: could not start decode thread\n");
+            exit(1);
+        }
+    }
+
+    return pl;
+}
+
+/*
+ * pipeline_next returns the next screenshot in timestamp
+ * order, blocking until a worker has decoded it
+ *
+ * returns NULL if the screenshot could not be decoded,
+ * or once every screenshot has been handed out
+ *
+ * side effects: the caller owns the returned AVFrame
+ * and must free it with av_frame_free
+ */
+AVFrame * pipeline_next(DecodePipeline *pl) {
+    PipelineSlot *slot;
+    AVFrame      *frame;
+
+    if (pl->next_consume >= pl->n_shots) {
+        return NULL;
+    }
+
+    if (pl->n_workers == 0) {
+        return image_decoder_decode(pl->dec,
+                                    pl->shots[pl->next_consume++].filepath);
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    slot = &pl->slots[pl->next_consume % pl->depth];
+    while (slot->index != pl->next_consume) {
+        pthread_cond_wait(&pl->slot_ready, &pl->lock);
+    }
+    frame = slot->frame;
+    slot->frame = NULL;
+    slot->index = -1;
+    pl->next_consume++;
+    /* the window moved, a worker may claim the next screenshot */
+    pthread_cond_broadcast(&pl->slot_free);
+    pthread_mutex_unlock(&pl->lock);
+
+    return frame;
+}
+
+/*
+ * pipeline_free stops the workers and frees any
+ * screenshots that were decoded but never consumed
+ */
+void pipeline_free(DecodePipeline *pl) {
+    int i;
+
+    if (pl->n_workers > 0) {
+        pthread_mutex_lock(&pl->lock);
+        pl->stop = 1;
+        pthread_cond_broadcast(&pl->slot_free);
+        pthread_mutex_unlock(&pl->lock);
+
+        for (i = 0; i < pl->n_workers; i++) {
+            pthread_join(pl->workers[i], NULL);
+        }
+
+        for (i = 0; i < pl->depth; i++) {
+            av_frame_free(&pl->slots[i].frame);
+        }
+
+        pthread_cond_destroy(&pl->slot_ready);
+        pthread_cond_destroy(&pl->slot_free);
+        pthread_mutex_destroy(&pl->lock);
+    }
+
+    free(pl->slots);
+    free(pl->workers);
+    free(pl);
+}
@@ -0,0 +1,55 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <pthread.h>
+
+#include <libavutil/frame.h>
+
+#include "decoder.h"
+#include "utils.h"
+
+/*
+ * A DecodePipeline decodes screenshots on a pool of worker
+ * threads ahead of the encoder. Decoded pictures pass through
+ * a bounded reorder buffer, so the encoder receives them in
+ * timestamp order no matter which worker finishes first.
+ */
+
+typedef struct PipelineSlot {
+    int      index; /* screenshot held in this slot, -1 if empty */
+    AVFrame *frame;
+} PipelineSlot;
+
+typedef struct DecodePipeline {
+    Screenshot      *shots;
+    const int       *indices;      /* screenshot index of each, traced */
+    int              n_shots;
+
+    /* decoder of the encoder thread, used when there are no workers */
+    ImageDecoder    *dec;
+
+    int              n_workers;
+    pthread_t       *workers;
+
+    /* reorder buffer, screenshot i lives in slots[i % depth] */
+    PipelineSlot    *slots;
+    int              depth;
+
+    int              next_claim;   /* next screenshot to decode */
+    int              next_consume; /* next screenshot to encode */
+    int              stop;
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   slot_free;
+    pthread_cond_t   slot_ready;
+} DecodePipeline;
+
+DecodePipeline * pipeline_new(Screenshot *shots, const int *indices,
+                              int n_shots, ImageDecoder *dec,
+                              int n_workers, int depth);
+
+AVFrame * pipeline_next(DecodePipeline *pl);
+
+void pipeline_free(DecodePipeline *pl);
+
+#endif
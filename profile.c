@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include <jansson.h>
+
+#include "json.h"
+#include "profile.h"
+
+#define THREAD_AUTO (FF_THREAD_FRAME | FF_THREAD_SLICE)
+
+/*
+ * The built-in profiles. "default" keeps the settings the
+ * renderer always had, "fast" trades size for encoding speed
+ * on every core, and "small" spends encoder time on size.
+ * Screenshot videos are mostly static, so the long GOPs of
+ * the other two cost little and keyframes are a large part
+ * of the size.
+ */
+static const EncoderProfile builtin_profiles[] = {
+    {
+        "default",
+        "h264", "ultrafast", "animation", 23, 400000, 20,
+        THREAD_AUTO, 1, -1,
+        AV_PIX_FMT_YUV420P, SWS_BILINEAR
+    },
+    {
+        "fast",
+        "h264", "ultrafast", "animation", 23, 400000, 250,
+        FF_THREAD_FRAME, 0, 0,
+        AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR
+    },
+    {
+        "small",
+        "h264", "slower", "animation", 28, 400000, 600,
+        FF_THREAD_FRAME, 0, 60,
+        AV_PIX_FMT_YUV420P, SWS_BILINEAR
+    }
+};
+
+#define N_BUILTIN_PROFILES \
+    ((int)(sizeof(builtin_profiles) / sizeof(builtin_profiles[0])))
+
+typedef struct NamedValue {
+    const char *name;
+    int         value;
+} NamedValue;
+
+static const NamedValue thread_types[] = {
+    { "auto",  THREAD_AUTO },
+    { "frame", FF_THREAD_FRAME },
+    { "slice", FF_THREAD_SLICE },
+    { NULL, 0 }
+};
+
+static const NamedValue scalers[] = {
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear",      SWS_BILINEAR },
+    { "bicubic",       SWS_BICUBIC },
+    { "point",         SWS_POINT },
+    { "area",          SWS_AREA },
+    { NULL, 0 }
+};
+
+static int find_value(const NamedValue *values, const char *name) {
+    int i;
+
+    for (i = 0; values[i].name; i++) {
+        if (strcmp(values[i].name, name) == 0) {
+            return values[i].value;
+        }
+    }
+    return PROFILE_UNSET;
+}
+
+static const char * find_name(const NamedValue *values, int value) {
+    int i;
+
+    for (i = 0; values[i].name; i++) {
+        if (values[i].value == value) {
+            return values[i].name;
+        }
+    }
+    return "?";
+}
+
+static int invalid_value(const char *key, const char *value) {
+    fprintf(stderr, "Error: invalid value '%s' for %s\n", value, key);
+    return -1;
+}
+
+/*
+ * parse_range reads an integer value in [min, max]
+ *
+ * returns -1 on anything else
+ */
+static int parse_range(int *field, const char *key, const char *value,
+                       int min, int max) {
+    char *end;
+    long  n;
+
+    n = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n < min || n > max) {
+        return invalid_value(key, value);
+    }
+
+    *field = (int)n;
+    return 0;
+}
+
+static int set_string(char *field, const char *key, const char *value) {
+    if (*value == '\0' || strlen(value) >= PROFILE_NAME_SIZE) {
+        return invalid_value(key, value);
+    }
+    strcpy(field, value);
+    return 0;
+}
+
+static int set_named(int *field, const NamedValue *values, const char *key,
+                     const char *value) {
+    *field = find_value(values, value);
+    if (*field == PROFILE_UNSET) {
+        return invalid_value(key, value);
+    }
+    return 0;
+}
+
+/*
+ * profile_clear unsets every field, for a profile that
+ * only holds overrides
+ */
+void profile_clear(EncoderProfile *p) {
+    memset(p, 0, sizeof(EncoderProfile));
+    p->crf = PROFILE_UNSET;
+    p->bit_rate = PROFILE_UNSET;
+    p->gop_size = PROFILE_UNSET;
+    p->thread_type = PROFILE_UNSET;
+    p->threads = PROFILE_UNSET;
+    p->lookahead = PROFILE_UNSET;
+    p->pix_fmt = PROFILE_UNSET;
+    p->scale_method = PROFILE_UNSET;
+}
+
+/*
+ * profile_find returns the built-in profile of that
+ * name, or NULL if there is none
+ */
+const EncoderProfile * profile_find(const char *name) {
+    int i;
+
+    for (i = 0; i < N_BUILTIN_PROFILES; i++) {
+        if (strcmp(builtin_profiles[i].name, name) == 0) {
+            return &builtin_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * profile_parse_json_field sets one field from a json
+ * string or integer value
+ *
+ * returns 0 on success, non zero as profile_parse_field
+ */
+int profile_parse_json_field(EncoderProfile *p, const char *key,
+                             json_t *value) {
+    char number[32];
+
+    if (json_is_integer(value)) {
+        snprintf(number, sizeof(number), "%" JSON_INTEGER_FORMAT,
+                 json_integer_value(value));
+        return profile_parse_field(p, key, number);
+    }
+    if (json_is_string(value)) {
+        return profile_parse_field(p, key, json_string_value(value));
+    }
+
+    fprintf(stderr, "Error: %s must be a string or an integer\n", key);
+    return -1;
+}
+
+/*
+ * load_file reads a profile from a json object of field
+ * names and values. The fields override the built-in
+ * profile named by "base", or "default".
+ */
+static void load_file(EncoderProfile *p, const char *filename) {
+    const EncoderProfile *base;
+    EncoderProfile        overrides;
+    json_t               *root, *value;
+    const char           *key;
+
+    root = read_json((char *)filename);
+    if (!json_is_object(root)) {
+        fprintf(stderr, "Fatal: %s is not a json object\n", filename);
+        exit(1);
+    }
+
+    value = json_object_get(root, "base");
+    base = profile_find(value ? json_string_value(value) : "default");
+    if (!base) {
+        fprintf(stderr, "Fatal: %s: unknown base profile\n", filename);
+        exit(1);
+    }
+    *p = *base;
+
+    profile_clear(&overrides);
+    json_object_foreach(root, key, value) {
+        if (strcmp(key, "base") == 0) {
+            continue;
+        }
+        if (profile_parse_json_field(&overrides, key, value) != 0) {
+            fprintf(stderr, "Fatal: %s: invalid field %s\n", filename, key);
+            exit(1);
+        }
+    }
+    profile_merge(p, &overrides);
+
+    snprintf(p->name, PROFILE_NAME_SIZE, "%s", filename);
+    json_decref(root);
+}
+
+/*
+ * profile_load sets p to the built-in profile of that name,
+ * or else reads it from the json file of that name
+ *
+ * exits if there is neither
+ */
+void profile_load(EncoderProfile *p, const char *name) {
+    const EncoderProfile *builtin;
+
+    builtin = profile_find(name);
+    if (builtin) {
+        *p = *builtin;
+        return;
+    }
+
+    if (access(name, R_OK) != 0) {
+        fprintf(stderr, "Fatal: unknown encoder profile '%s'\n", name);
+        exit(1);
+    }
+    load_file(p, name);
+}
+
+/*
+ * profile_merge copies every field that is set in overrides,
+ * a string override of "none" clears the field
+ */
+void profile_merge(EncoderProfile *p, const EncoderProfile *overrides) {
+    const char *strings[3] = { overrides->codec, overrides->preset,
+                               overrides->tune };
+    char       *fields[3] = { p->codec, p->preset, p->tune };
+    int         i;
+
+    for (i = 0; i < 3; i++) {
+        if (strcmp(strings[i], "none") == 0) {
+            fields[i][0] = '\0';
+        } else if (strings[i][0] != '\0') {
+            strcpy(fields[i], strings[i]);
+        }
+    }
+
+    if (overrides->crf != PROFILE_UNSET) p->crf = overrides->crf;
+    if (overrides->bit_rate != PROFILE_UNSET) p->bit_rate = overrides->bit_rate;
+    if (overrides->gop_size != PROFILE_UNSET) p->gop_size = overrides->gop_size;
+    if (overrides->thread_type != PROFILE_UNSET) {
+        p->thread_type = overrides->thread_type;
+    }
+    if (overrides->threads != PROFILE_UNSET) p->threads = overrides->threads;
+    if (overrides->lookahead != PROFILE_UNSET) {
+        p->lookahead = overrides->lookahead;
+    }
+    if (overrides->pix_fmt != PROFILE_UNSET) p->pix_fmt = overrides->pix_fmt;
+    if (overrides->scale_method != PROFILE_UNSET) {
+        p->scale_method = overrides->scale_method;
+    }
+}
+
+/*
+ * profile_parse_field sets one field from its name, as
+ * used for command line options, profile files and jobs
+ *
+ * returns 0 on success, -1 for an invalid value
+ * and -2 for an unknown field
+ */
+int profile_parse_field(EncoderProfile *p, const char *key, const char *value) {
+    if (strcmp(key, "codec") == 0) {
+        if (strcmp(value, "none") == 0) return invalid_value(key, value);
+        return set_string(p->codec, key, value);
+    } else if (strcmp(key, "preset") == 0) {
+        return set_string(p->preset, key, value);
+    } else if (strcmp(key, "tune") == 0) {
+        return set_string(p->tune, key, value);
+    } else if (strcmp(key, "crf") == 0) {
+        return parse_range(&p->crf, key, value, -1, 63);
+    } else if (strcmp(key, "bitrate") == 0) {
+        return parse_range(&p->bit_rate, key, value, 0, INT_MAX);
+    } else if (strcmp(key, "gop") == 0) {
+        return parse_range(&p->gop_size, key, value, -1, 100000);
+    } else if (strcmp(key, "thread-type") == 0) {
+        return set_named(&p->thread_type, thread_types, key, value);
+    } else if (strcmp(key, "encoder-threads") == 0) {
+        return parse_range(&p->threads, key, value, 0, 256);
+    } else if (strcmp(key, "lookahead") == 0) {
+        return parse_range(&p->lookahead, key, value, -1, 250);
+    } else if (strcmp(key, "pix-fmt") == 0) {
+        p->pix_fmt = av_get_pix_fmt(value);
+        if (p->pix_fmt == AV_PIX_FMT_NONE) return invalid_value(key, value);
+        return 0;
+    } else if (strcmp(key, "scaler") == 0) {
+        return set_named(&p->scale_method, scalers, key, value);
+    }
+
+    return -2;
+}
+
+void profile_print(const EncoderProfile *p) {
+    printf("%s:\n"
+           "  codec %s, preset %s, tune %s\n"
+           "  crf %d, bitrate %d, gop %d\n"
+           "  thread-type %s, encoder-threads %d, lookahead %d\n"
+           "  pix-fmt %s, scaler %s\n",
+           p->name,
+           p->codec, p->preset[0] ? p->preset : "none",
+           p->tune[0] ? p->tune : "none",
+           p->crf, p->bit_rate, p->gop_size,
+           find_name(thread_types, p->thread_type), p->threads, p->lookahead,
+           av_get_pix_fmt_name(p->pix_fmt),
+           find_name(scalers, p->scale_method));
+}
+
+void profile_list(void) {
+    int i;
+
+    for (i = 0; i < N_BUILTIN_PROFILES; i++) {
+        profile_print(&builtin_profiles[i]);
+    }
+}
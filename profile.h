@@ -0,0 +1,59 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <limits.h>
+#include <jansson.h>
+
+/* marks a field that an override leaves alone */
+#define PROFILE_UNSET INT_MIN
+
+#define PROFILE_NAME_SIZE 64
+
+/*
+ * An EncoderProfile holds every encoder and conversion setting
+ * of a render. Profiles are picked by name from the built-in
+ * list or loaded from a json file, and single fields can be
+ * overridden on the command line.
+ *
+ * String fields left empty and int fields set to -1 keep the
+ * codec default.
+ */
+typedef struct EncoderProfile {
+    char name[PROFILE_NAME_SIZE];
+
+    /* encoder, by encoder name (libx264) or codec name (h264) */
+    char codec[PROFILE_NAME_SIZE];
+    char preset[PROFILE_NAME_SIZE];
+    char tune[PROFILE_NAME_SIZE];
+    int  crf;          /* -1 uses bit_rate instead */
+    int  bit_rate;
+    int  gop_size;
+
+    /* encoder threading */
+    int  thread_type;  /* FF_THREAD_FRAME and/or FF_THREAD_SLICE */
+    int  threads;      /* 0 picks one per core */
+    int  lookahead;    /* frames, -1 codec default */
+
+    /* conversion of the screenshots */
+    int  pix_fmt;
+    int  scale_method;
+} EncoderProfile;
+
+void profile_clear(EncoderProfile *p);
+
+const EncoderProfile * profile_find(const char *name);
+
+void profile_load(EncoderProfile *p, const char *name);
+
+void profile_merge(EncoderProfile *p, const EncoderProfile *overrides);
+
+int profile_parse_field(EncoderProfile *p, const char *key, const char *value);
+
+int profile_parse_json_field(EncoderProfile *p, const char *key,
+                             json_t *value);
+
+void profile_print(const EncoderProfile *p);
+
+void profile_list(void);
+
+#endif
@@ -0,0 +1,273 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
+
+#include "rawfb.h"
+
+/* the PixelFormat constants of Android that screencap writes */
+typedef struct RawPixelFormat {
+    const char *name;
+    uint32_t    code;
+    int         pix_fmt;
+    int         size; /* bytes per pixel */
+} RawPixelFormat;
+
+static const RawPixelFormat raw_formats[] = {
+    { "RGBA_8888", 1, AV_PIX_FMT_RGBA,     4 },
+    { "RGBX_8888", 2, AV_PIX_FMT_RGB0,     4 },
+    { "RGB_888",   3, AV_PIX_FMT_RGB24,    3 },
+    { "RGB_565",   4, AV_PIX_FMT_RGB565LE, 2 },
+    { "BGRA_8888", 5, AV_PIX_FMT_BGRA,     4 },
+};
+
+#define N_RAW_FORMATS ((int)(sizeof(raw_formats) / sizeof(raw_formats[0])))
+
+/* screencap headers, with and without the colorspace */
+#define HEADER_SIZE     12
+#define HEADER_SIZE_CS  16
+
+static const RawPixelFormat * format_by_name(const char *name) {
+    int i;
+
+    for (i = 0; name && i < N_RAW_FORMATS; i++) {
+        if (strcmp(name, raw_formats[i].name) == 0) {
+            return &raw_formats[i];
+        }
+    }
+    return NULL;
+}
+
+static const RawPixelFormat * format_by_code(uint32_t code) {
+    int i;
+
+    for (i = 0; i < N_RAW_FORMATS; i++) {
+        if (code == raw_formats[i].code) {
+            return &raw_formats[i];
+        }
+    }
+    return NULL;
+}
+
+static const RawPixelFormat * format_by_pix_fmt(int pix_fmt) {
+    int i;
+
+    for (i = 0; i < N_RAW_FORMATS; i++) {
+        if (pix_fmt == raw_formats[i].pix_fmt) {
+            return &raw_formats[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * rawfb_format_init sets fmt to files that start with their
+ * own screencap header
+ */
+void rawfb_format_init(RawFormat *fmt) {
+    fmt->width = 0;
+    fmt->height = 0;
+    fmt->pix_fmt = AV_PIX_FMT_NONE;
+    fmt->header = RAWFB_OWN_HEADER;
+    fmt->stride = 0;
+}
+
+/*
+ * rawfb_is_raw tells if the screenshot file is a raw
+ * framebuffer, by its extension
+ */
+int rawfb_is_raw(const char *filepath) {
+    size_t len = strlen(filepath), ext = strlen(RAWFB_EXTENSION);
+
+    return len > ext && strcmp(filepath + len - ext, RAWFB_EXTENSION) == 0;
+}
+
+/*
+ * rawfb_parse_json reads the "framebuffer" member of
+ * videodata.json into fmt
+ *
+ * returns 0 on success, -1 if it is not a valid format
+ */
+int rawfb_parse_json(json_t *value, RawFormat *fmt) {
+    const RawPixelFormat *f;
+    json_int_t            width, height, header, stride;
+
+    f = format_by_name(json_string_value(json_object_get(value, "format")));
+    width = json_integer_value(json_object_get(value, "width"));
+    height = json_integer_value(json_object_get(value, "height"));
+    header = json_integer_value(json_object_get(value, "header"));
+    stride = json_integer_value(json_object_get(value, "stride"));
+
+    if (!json_is_object(value) || !f || width <= 0 || height <= 0 ||
+        width > INT_MAX / 4 || height > INT_MAX || header < 0 ||
+        header > INT_MAX || stride > INT_MAX ||
+        (stride != 0 && stride < width * f->size)) {
+        fprintf(stderr, "Error: invalid framebuffer format, expected "
+                "width, height and one of RGBA_8888, RGBX_8888, RGB_888, "
+                "RGB_565 or BGRA_8888\n");
+        return -1;
+    }
+
+    fmt->width = (int)width;
+    fmt->height = (int)height;
+    fmt->pix_fmt = f->pix_fmt;
+    fmt->header = (int)header;
+    fmt->stride = (int)stride;
+    return 0;
+}
+
+/*
+ * read_header reads the screencap header at the start of a
+ * mapped file of size bytes into fmt. Which of the two
+ * header sizes it is, and the stride, follow from the file
+ * size, as the rows fill the rest of the file.
+ *
+ * returns 0 if the file does not start with a valid header
+ */
+static int read_header(const uint8_t *data, size_t size, RawFormat *fmt) {
+    const RawPixelFormat *f;
+    uint64_t              width, height, row, stride;
+    int                   header;
+
+    if (size < HEADER_SIZE) {
+        return 0;
+    }
+    width = read_le32(data);
+    height = read_le32(data + 4);
+    f = format_by_code(read_le32(data + 8));
+    if (!f || width == 0 || height == 0 ||
+        width > INT_MAX / 4 || height > INT_MAX) {
+        return 0;
+    }
+    row = width * f->size;
+
+    for (header = HEADER_SIZE_CS; header >= HEADER_SIZE; header -= 4) {
+        if (size < (size_t)header || (size - header) % height != 0) {
+            continue;
+        }
+        stride = (size - header) / height;
+        if (stride >= row && stride <= INT_MAX) {
+            fmt->width = (int)width;
+            fmt->height = (int)height;
+            fmt->pix_fmt = f->pix_fmt;
+            fmt->header = header;
+            fmt->stride = (int)stride;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void unmap_buffer(void *opaque, uint8_t *data) {
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+/*
+ * rawfb_map maps a raw framebuffer file into a frame of the
+ * format fmt, or of the format in its own header
+ *
+ * The mapping is private and writable, so touches drawn into
+ * the frame only copy the pages they cover and never reach
+ * the file, and it is followed by at least a page of zeros,
+ * so reading past the last row does not fault. It is
+ * unmapped when the frame is freed.
+ *
+ * returns NULL if the file can not be read or is too small
+ * for its format
+ *
+ * side effects: allocates an AVFrame which
+ * must be freed with av_frame_free
+ */
+AVFrame * rawfb_map(const char *filepath, const RawFormat *fmt) {
+    const RawPixelFormat *f;
+    RawFormat             own;
+    AVFrame              *frame;
+    uint8_t              *data;
+    struct stat           st;
+    size_t                size, length;
+    long                  page;
+    int64_t               row, stride;
+    int                   fd;
+
+    fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not read %s\n", filepath);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > INT_MAX) {
+        fprintf(stderr, "Error: could not read %s\n", filepath);
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+
+    /* the file is mapped over zeroed memory with a spare page
+     * after it, as swscale's SIMD readers may read a little
+     * past the end of the last row */
+    page = sysconf(_SC_PAGESIZE);
+    length = (size + page - 1) / page * page + page;
+    data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data != MAP_FAILED &&
+        mmap(data, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(data, length);
+        data = MAP_FAILED;
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map %s\n", filepath);
+        return NULL;
+    }
+
+    if (fmt->header == RAWFB_OWN_HEADER) {
+        if (!read_header(data, size, &own)) {
+            fprintf(stderr, "Error: %s has no valid framebuffer header\n",
+                    filepath);
+            munmap(data, length);
+            return NULL;
+        }
+        fmt = &own;
+    }
+
+    f = format_by_pix_fmt(fmt->pix_fmt);
+    row = f ? (int64_t)fmt->width * f->size : 0;
+    stride = fmt->stride ? fmt->stride : row;
+    if (!f || fmt->header + stride * (fmt->height - 1) + row >
+        (int64_t)size) {
+        fprintf(stderr, "Error: %s is too small for a %dx%d framebuffer\n",
+                filepath, fmt->width, fmt->height);
+        munmap(data, length);
+        return NULL;
+    }
+
+    frame = av_frame_alloc();
+    if (frame) {
+        frame->buf[0] = av_buffer_create(data, (int)size, unmap_buffer,
+                                         (void *)(uintptr_t)length, 0);
+    }
+    if (!frame || !frame->buf[0]) {
+        fprintf(stderr, "Fatal: could not allocate frame\n");
+        exit(1);
+    }
+
+    frame->data[0] = data + fmt->header;
+    frame->linesize[0] = (int)stride;
+    frame->width = fmt->width;
+    frame->height = fmt->height;
+    frame->format = fmt->pix_fmt;
+
+    return frame;
+}
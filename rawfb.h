@@ -0,0 +1,52 @@
+#ifndef _RAWFB_H_
+#define _RAWFB_H_
+
+#include <jansson.h>
+
+#include <libavutil/frame.h>
+
+/*
+ * Raw framebuffer screenshots are the screen pixels as
+ * Android's screencap writes them without -p: a header of
+ * little endian uint32 width, height and pixel format, with
+ * a colorspace after them on newer devices, then the rows,
+ * which may be padded to the stride of the framebuffer.
+ * The file is mapped and the mapping is the frame data, so
+ * there is nothing to decode and nothing is copied.
+ *
+ * Dumps without that header, or with another one, are
+ * described by a "framebuffer" member of videodata.json
+ * which applies to every screenshot of the session:
+ *
+ *   "framebuffer": {"width": 1080, "height": 1920,
+ *                   "format": "RGBA_8888", "header": 0,
+ *                   "stride": 4352}
+ *
+ * header is the bytes before the first row, and stride the
+ * bytes from one row to the next, the width times the pixel
+ * size if left out. The formats are RGBA_8888, RGBX_8888,
+ * RGB_888, RGB_565 and BGRA_8888.
+ */
+
+#define RAWFB_JSON_KEY   "framebuffer"
+#define RAWFB_EXTENSION  ".raw"
+#define RAWFB_OWN_HEADER -1 /* every file starts with a screencap header */
+
+/* the layout of raw framebuffers, only header is used with
+   RAWFB_OWN_HEADER */
+typedef struct RawFormat {
+    int width, height;
+    int pix_fmt;
+    int header;  /* bytes before the pixels, or RAWFB_OWN_HEADER */
+    int stride;  /* bytes per row, 0 for rows without padding */
+} RawFormat;
+
+void rawfb_format_init(RawFormat *fmt);
+
+int rawfb_is_raw(const char *filepath);
+
+int rawfb_parse_json(json_t *value, RawFormat *fmt);
+
+AVFrame * rawfb_map(const char *filepath, const RawFormat *fmt);
+
+#endif
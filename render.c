@@ -0,0 +1,1101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include "actualizer.h"
+#include "append.h"
+#include "decoder.h"
+#include "dedup.h"
+#include "fmp4.h"
+#include "framecache.h"
+#include "options.h"
+#include "pipeline.h"
+#include "render.h"
+#include "session.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include "video.h"
+
+/*
+ * Segment is one contiguous run of screenshots encoded on its
+ * own thread, with its own decoder, scaler and encoder, into
+ * a packet spool
+ */
+typedef struct Segment {
+    /* shared by all segments, read only */
+    Session        *session;
+    const Options  *opts;
+    AVCodec        *codec;
+    int             global_header;
+    int             out_width, out_height;
+    AVRational      time_base;
+    int             threads;       /* encoder threads of this segment */
+
+    int             first, end;    /* screenshots [first, end) */
+
+    /* filled in by the segment thread */
+    AVCodecContext *enc;
+    FILE           *spool;
+    int             conversions_skipped;
+    int             error;         /* the segment could not be encoded */
+    pthread_t       thread;
+} Segment;
+
+/*
+ * output_time_base is the encoder time base, constant frame
+ * rate output counts frames, variable frame rate output
+ * counts millisecs
+ */
+static AVRational output_time_base(const Options *opts) {
+    AVRational time_base;
+
+    time_base.num = 1;
+    time_base.den = opts->vfr ? VFR_TIME_BASE_DEN : opts->fps;
+    return time_base;
+}
+
+/*
+ * render_cache_init empties the cache, which then
+ * fills up with the first render using it
+ */
+void render_cache_init(RenderCache *cache) {
+    cache->dec = NULL;
+    cache->dec_threads = 0;
+    cache->sc = NULL;
+}
+
+void render_cache_free(RenderCache *cache) {
+    if (cache->dec) {
+        image_decoder_free(cache->dec);
+    }
+    sws_freeContext(cache->sc);
+    render_cache_init(cache);
+}
+
+/*
+ * cached_decoder returns the decoder of the cache if it
+ * decodes the same format with as many threads, or else
+ * replaces it with a new one, raw being the layout of raw
+ * framebuffers
+ *
+ * returns NULL if there is no usable decoder
+ */
+static ImageDecoder * cached_decoder(RenderCache *cache,
+                                     enum AVCodecID codec_id,
+                                     const RawFormat *raw, int threads) {
+    if (cache->dec && (cache->dec->codec_id != codec_id ||
+                       cache->dec_threads != threads ||
+                       (codec_id == AV_CODEC_ID_RAWVIDEO &&
+                        memcmp(&cache->dec->raw, raw, sizeof(RawFormat))))) {
+        image_decoder_free(cache->dec);
+        cache->dec = NULL;
+    }
+
+    if (!cache->dec) {
+        cache->dec = image_decoder_new_codec(codec_id, raw, threads);
+        cache->dec_threads = threads;
+    }
+
+    return cache->dec;
+}
+
+/*
+ * cached_scaler returns the scaler of the cache, set up
+ * again only if the formats or the method changed
+ *
+ * returns NULL if the conversion is not supported
+ */
+static struct SwsContext * cached_scaler(RenderCache *cache,
+                                         int in_w, int in_h, int in_f,
+                                         int out_w, int out_h, int out_f,
+                                         int filter) {
+    cache->sc = sws_getCachedContext(cache->sc, in_w, in_h, in_f,
+                                     out_w, out_h, out_f,
+                                     filter, NULL, NULL, NULL);
+    if (!cache->sc) {
+        fprintf(stderr, "Error: could not allocate scaling context\n");
+    }
+
+    return cache->sc;
+}
+
+/*
+ * begin_append sets up the output to continue where the append
+ * state stopped, with the touch overlay restored from its
+ * cursor, or replayed up to there if the cursor does not fit
+ * the touch data
+ *
+ * returns 0 if the encoder does not produce the stream header
+ * the earlier fragments were written with
+ */
+static int begin_append(VideoOutput *vo, TouchActualizer *ta,
+                        const AppendState *state) {
+    AVCodecContext *c = vo->enc;
+    TouchData      *td = ta->touch_data;
+
+    if (c->extradata_size != state->extradata_size ||
+        memcmp(c->extradata, state->extradata, c->extradata_size) != 0) {
+        fprintf(stderr, "Error: the encoder settings changed since the "
+                "last append\n");
+        return 0;
+    }
+
+    vo->pts = state->pts;
+
+    if (!restore_touches(ta, state->next_event, state->pointers,
+                         state->n_pointers) ||
+        (state->next_event > 0 &&
+         td->timestamps[state->next_event - 1] != state->event_time)) {
+        seek_touches(ta, state->end_time);
+    }
+    return 1;
+}
+
+/*
+ * end_append records in the append state where the output
+ * and the touch overlay stopped
+ */
+static void end_append(VideoOutput *vo, TouchActualizer *ta,
+                       Session *session, AppendState *state) {
+    AVCodecContext *c = vo->enc;
+    Screenshot     *last = &session->shots[session->n_shots - 1];
+    int             n;
+
+    free(state->extradata);
+    state->extradata = malloc(c->extradata_size + 1);
+    if (!state->extradata) {
+        fprintf(stderr, "Fatal: could not allocate append state\n");
+        exit(1);
+    }
+    memcpy(state->extradata, c->extradata, c->extradata_size);
+    state->extradata_size = c->extradata_size;
+
+    state->n_shots = session->n_shots;
+    state->end_time = last->time + (last->interval > 0 ? last->interval : 0);
+    state->pts = vo->pts;
+
+    /* pointers past the last active one are implied */
+    n = ta->n_slots;
+    while (n > 0 && !ta->active_events[n - 1].active) n--;
+    free(state->pointers);
+    state->pointers = malloc((n + 1) * sizeof(Event));
+    if (!state->pointers) {
+        fprintf(stderr, "Fatal: could not allocate append state\n");
+        exit(1);
+    }
+    memcpy(state->pointers, ta->active_events, n * sizeof(Event));
+    state->n_pointers = n;
+    state->next_event = ta->next_event;
+    state->event_time = ta->next_event > 0 ?
+                        ta->touch_data->timestamps[ta->next_event - 1] : 0;
+}
+
+/*
+ * CachePlan holds the frame cache lookups of one render. The
+ * keys are derived before decoding starts, so only the
+ * screenshots missing from the cache go to the pipeline.
+ */
+typedef struct CachePlan {
+    FrameCache  *cache;    /* NULL without a frame cache */
+    uint8_t    (*keys)[FRAME_CACHE_KEY_SIZE];
+    char        *have_key; /* the file of screenshot i could be read */
+    char        *hit;      /* screenshot i is in the cache */
+    Screenshot  *misses;   /* the screenshots to decode, in order */
+    int         *miss_index; /* the screenshot index of each miss */
+    int          n_misses;
+    int          touch_decodes; /* hits decoded to draw touches */
+} CachePlan;
+
+/*
+ * cache_plan_init looks up the screenshots in the frame cache
+ * of opts, if any, as converted by vo. Without a usable cache
+ * every screenshot is a miss. The screenshots are numbered
+ * from first.
+ */
+static void cache_plan_init(CachePlan *plan, const Options *opts,
+                            Session *session, VideoOutput *vo,
+                            Screenshot *shots, int n_shots, int first) {
+    FrameCacheFormat format;
+    int              i;
+
+    memset(plan, 0, sizeof(CachePlan));
+    plan->misses = shots;
+    plan->n_misses = n_shots;
+
+    plan->miss_index = malloc((n_shots > 0 ? n_shots : 1) * sizeof(int));
+    if (!plan->miss_index) {
+        fprintf(stderr, "Fatal: could not allocate frame cache plan\n");
+        exit(1);
+    }
+    for (i = 0; i < n_shots; i++) {
+        plan->miss_index[i] = first + i;
+    }
+
+    if (!opts->frame_cache || n_shots == 0) {
+        return;
+    }
+    plan->cache = frame_cache_open(opts->frame_cache,
+                                   (int64_t)opts->frame_cache_size << 20,
+                                   opts->frame_cache_lz4);
+    if (!plan->cache) {
+        fprintf(stderr, "Warning: rendering without the frame cache\n");
+        return;
+    }
+
+    format.in_width = session->width;
+    format.in_height = session->height;
+    format.in_pix_fmt = session->pix_fmt;
+    format.out_width = vo->enc->width;
+    format.out_height = vo->enc->height;
+    format.out_pix_fmt = opts->profile.pix_fmt;
+    format.scale_method = opts->profile.scale_method;
+    format.converter = vo->conv != NULL;
+
+    plan->keys = malloc(n_shots * FRAME_CACHE_KEY_SIZE);
+    plan->have_key = calloc(n_shots, 1);
+    plan->hit = calloc(n_shots, 1);
+    plan->misses = malloc(n_shots * sizeof(Screenshot));
+    if (!plan->keys || !plan->have_key || !plan->hit || !plan->misses) {
+        fprintf(stderr, "Fatal: could not allocate frame cache plan\n");
+        exit(1);
+    }
+
+    plan->n_misses = 0;
+    for (i = 0; i < n_shots; i++) {
+        plan->have_key[i] = frame_cache_key(shots[i].filepath, &format,
+                                            plan->keys[i]) == 0;
+        plan->hit[i] = plan->have_key[i] &&
+                       frame_cache_contains(plan->cache, plan->keys[i]);
+        if (!plan->hit[i]) {
+            plan->miss_index[plan->n_misses] = first + i;
+            plan->misses[plan->n_misses++] = shots[i];
+        }
+    }
+}
+
+static void cache_plan_free(CachePlan *plan) {
+    free(plan->miss_index);
+    if (!plan->cache) {
+        return;
+    }
+    frame_cache_close(plan->cache);
+    free(plan->keys);
+    free(plan->have_key);
+    free(plan->hit);
+    free(plan->misses);
+}
+
+/*
+ * write_cached writes screenshot i from the frame cache. If
+ * the entry went away, or touches are drawn during its
+ * interval and only can be before conversion, it is decoded
+ * after all, with the decoder of the encoder thread.
+ *
+ * returns 0 on success, -1 if it could not be decoded
+ */
+static int write_cached(VideoOutput *vo, TouchActualizer *ta,
+                        CachePlan *plan, ImageDecoder *dec,
+                        Screenshot *shot, int i) {
+    AVFrame *frame;
+    long     end;
+
+    end = write_frame_end(vo, shot->time, shot->interval);
+    if (vo->yuv_overlay || !touches_visible(ta, end)) {
+        frame = av_frame_alloc();
+        if (!frame) {
+            fprintf(stderr, "Fatal: could not allocate frame\n");
+            exit(1);
+        }
+        frame_pool_get(vo->pool, frame);
+
+        if (frame_cache_get(plan->cache, plan->keys[i], frame) == 0) {
+            write_converted_frame(vo, frame, shot->time, shot->interval);
+            av_frame_free(&frame);
+            return 0;
+        }
+        av_frame_free(&frame);
+    } else {
+        plan->touch_decodes++;
+    }
+
+    frame = image_decoder_decode(dec, shot->filepath);
+    if (!frame) {
+        return -1;
+    }
+    handle_screenshot(vo, shot, frame);
+    return 0;
+}
+
+/*
+ * write_decoded writes screenshot i, decoded because it was
+ * not in the frame cache, and stores its conversion there
+ */
+static void write_decoded(VideoOutput *vo, TouchActualizer *ta,
+                          CachePlan *plan, Screenshot *shot, int i,
+                          AVFrame *in_frame) {
+    AVFrame *frame;
+    long     end;
+
+    if (!plan->cache || !plan->have_key[i]) {
+        handle_screenshot(vo, shot, in_frame);
+        return;
+    }
+
+    frame = convert_frame(vo, in_frame);
+    frame_cache_put(plan->cache, plan->keys[i], frame);
+
+    /* the clean conversion is the output unless touches are drawn
+     * before conversion */
+    end = write_frame_end(vo, shot->time, shot->interval);
+    if (!vo->yuv_overlay && touches_visible(ta, end)) {
+        handle_screenshot(vo, shot, in_frame);
+    } else {
+        write_converted_frame(vo, frame, shot->time, shot->interval);
+        av_frame_free(&in_frame);
+    }
+    av_frame_free(&frame);
+}
+
+/*
+ * render_serial encodes the whole session with one encoder,
+ * decoding ahead on the pipeline workers if enabled
+ *
+ * With an append state it only encodes the screenshots after
+ * the ones the state says were rendered, into a fragmented
+ * MP4 whose timestamps continue from there, and updates the
+ * state. Fragments then start on keyframes and there are no
+ * B-frames, so the fragments of later runs can follow them.
+ *
+ * returns 0 on success, -1 on failure, in which case the
+ * partial output file is removed
+ */
+static int render_serial(Session *session, const Options *opts,
+                         const char *dst_filename,
+                         int out_width, int out_height,
+                         RenderCache *cache, AppendState *append) {
+    AVFormatContext   *oc;
+    AVStream          *video_st;
+    AVCodec           *video_codec;
+    AVDictionary      *mux_opts = NULL;
+    struct SwsContext *sc;
+    VideoOutput       *vo;
+    FramePoolStats     pool_stats;
+    TouchActualizer   *ta;
+    ImageDecoder      *dec;
+    DecodePipeline    *pipeline;
+    AVFrame           *in_frame;
+    Screenshot        *shots;
+    CachePlan          plan;
+    int                ret, i, first, n_shots;
+
+    first = append ? append->n_shots : 0;
+
+    /* the decoder stays open for all screenshots, slice
+     * threads are only worth it without decode workers */
+    dec = cached_decoder(cache, session->codec_id, &session->raw,
+                         opts->decode_threads > 0 ? 1 : 0);
+    if (!dec) {
+        return -1;
+    }
+
+    /* Set up context for converting between
+     * the picture and video format */
+    sc = cached_scaler(cache, session->width, session->height,
+                       session->pix_fmt, out_width, out_height,
+                       opts->profile.pix_fmt, opts->profile.scale_method);
+    if (!sc) {
+        return -1;
+    }
+
+    oc = open_output(dst_filename, append ? "mp4" : NULL);
+    if (!oc) {
+        return -1;
+    }
+
+    /* Fill codec and associate it with the output context */
+    video_st = add_video_stream(oc, &video_codec, &opts->profile,
+                                out_width, out_height,
+                                output_time_base(opts));
+    if (!video_st) {
+        close_output(oc);
+        unlink(dst_filename);
+        return -1;
+    }
+
+    if (append) {
+        video_st->codec->max_b_frames = 0;
+    }
+
+    ret = avcodec_open2(video_st->codec, video_codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
+        close_output(oc);
+        unlink(dst_filename);
+        return -1;
+    }
+
+    #ifdef DEBUG_FMT
+    av_dump_format(oc, 0, dst_filename, 1);
+    #endif
+
+    if (append) {
+        av_dict_set(&mux_opts, "movflags", "frag_keyframe+empty_moov+"
+                    "default_base_moof+frag_discont", 0);
+        av_dict_set(&mux_opts, "use_editlist", "0", 0);
+        av_dict_set_int(&mux_opts, "fragment_index",
+                        append->n_fragments + 1, 0);
+    }
+    ret = write_header(oc, &mux_opts);
+    av_dict_free(&mux_opts);
+    if (ret != 0) {
+        avcodec_close(video_st->codec);
+        close_output(oc);
+        unlink(dst_filename);
+        return -1;
+    }
+
+    /* allocate touch drawing context */
+    ta = TouchActualizer_new_shared(session->touch_data,
+                                    session->width, session->height);
+
+    vo = video_output_new(oc, video_st, sc, ta, opts->fps, opts->vfr,
+                          session->base_time);
+    video_output_set_convert_threads(vo, opts->convert_threads);
+
+    /* identical consecutive screenshots are decoded once */
+    n_shots = session->n_shots - first;
+    if (opts->dedup) {
+        shots = dedup_screenshots(session->shots + first, n_shots, &n_shots);
+        video_output_set_dedup(vo, opts->dedup_ignore, opts->n_dedup_ignore);
+    } else {
+        shots = session->shots + first;
+    }
+
+    ret = 0;
+    if (first > 0 && !begin_append(vo, ta, append)) {
+        ret = -1;
+    }
+
+    /* screenshots in the frame cache are not decoded */
+    cache_plan_init(&plan, opts, session, vo, shots, n_shots, first);
+
+    /* Read and write each screenshot to the video file,
+     * decoding ahead on the worker threads if enabled */
+    pipeline = pipeline_new(plan.misses, plan.miss_index, plan.n_misses,
+                            dec, opts->decode_threads, opts->queue_depth);
+
+    for (i = 0; i < n_shots && ret == 0 && !vo->error; i++) {
+        trace_set_screenshot(first + i, shots[i].filepath);
+
+        if (plan.cache && plan.hit[i]) {
+            if (write_cached(vo, ta, &plan, dec, &shots[i], i) != 0) {
+                fprintf(stderr, "Error: could not decode %s\n",
+                        shots[i].filepath);
+                ret = -1;
+            }
+            continue;
+        }
+
+        in_frame = pipeline_next(pipeline);
+        if (!in_frame) {
+            fprintf(stderr, "Error: could not decode %s\n", shots[i].filepath);
+            ret = -1;
+            break;
+        }
+
+        /* handle each screenshot, the output keeps the frame count */
+        write_decoded(vo, ta, &plan, &shots[i], i, in_frame);
+    }
+    pipeline_free(pipeline);
+
+    if (ret == 0) {
+        /* Depending on the video codec, the actual
+         * writing of frames can be delayed for optimization.
+         * This forces all the delayed frames to be
+         * written */
+        flush_video(vo);
+    }
+    if (vo->error) {
+        ret = -1;
+    }
+
+    /* Write file trailer, if any */
+    if (ret == 0 && av_write_trailer(oc) < 0) {
+        fprintf(stderr, "Error: could not write the trailer of '%s'\n",
+                dst_filename);
+        ret = -1;
+    }
+
+    if (ret == 0 && append) {
+        end_append(vo, ta, session, append);
+    }
+
+    if (plan.cache) {
+        stats_add_frame_cache(plan.cache->stats.hits,
+                              plan.n_misses + plan.cache->stats.misses);
+    }
+    if (!opts->quiet) {
+        frame_pool_get_stats(vo->pool, &pool_stats);
+        printf("Frame pool: %ld frames, %ld reused, peak %ld buffers\n",
+               pool_stats.gets, pool_stats.hits, pool_stats.peak_outstanding);
+        if (opts->dedup) {
+            printf("Dedup: %d decodes and %d conversions skipped\n",
+                   session->n_shots - first - n_shots,
+                   vo->conversions_skipped);
+        }
+        if (plan.cache) {
+            printf("Frame cache: %ld hits, %ld misses, %d decoded for "
+                   "touches, %ld stored, %ld evicted\n",
+                   plan.cache->stats.hits,
+                   plan.n_misses + plan.cache->stats.misses,
+                   plan.touch_decodes, plan.cache->stats.stores,
+                   plan.cache->stats.evictions);
+        }
+    }
+    cache_plan_free(&plan);
+    if (opts->dedup) {
+        free(shots);
+    }
+
+    /* free objects, the decoder and scaler stay in the cache */
+    video_output_free(vo);
+    TouchActualizer_destroy(ta);
+
+    avcodec_close(video_st->codec);
+
+    close_output(oc);
+    if (ret != 0) {
+        unlink(dst_filename);
+    }
+
+    return ret;
+}
+
+/*
+ * encode_shots encodes the screenshots of a segment with its
+ * open encoder into its spool. The output is first moved
+ * past the earlier screenshots, so the timestamps continue
+ * where the previous segment ends.
+ *
+ * returns 0 on success, -1 if a screenshot could not be
+ * decoded or encoded
+ */
+static int encode_shots(Segment *seg, ImageDecoder *dec,
+                        struct SwsContext *sc, TouchActualizer *ta) {
+    Session       *session = seg->session;
+    const Options *opts = seg->opts;
+    VideoOutput   *vo;
+    AVFrame       *in_frame;
+    int            ret = 0, i;
+
+    vo = video_output_new_spool(seg->enc, seg->spool, sc, ta, opts->fps,
+                                opts->vfr, session->base_time);
+    video_output_set_convert_threads(vo, opts->convert_threads);
+    if (opts->dedup) {
+        video_output_set_dedup(vo, opts->dedup_ignore, opts->n_dedup_ignore);
+    }
+
+    for (i = 0; i < seg->first; i++) {
+        skip_frame(vo, session->shots[i].time, session->shots[i].interval);
+    }
+
+    for (i = seg->first; i < seg->end && !vo->error; i++) {
+        trace_set_screenshot(i, session->shots[i].filepath);
+        in_frame = image_decoder_decode(dec, session->shots[i].filepath);
+        if (in_frame == NULL) {
+            fprintf(stderr, "Error: could not decode %s\n",
+                    session->shots[i].filepath);
+            ret = -1;
+            break;
+        }
+        handle_screenshot(vo, &session->shots[i], in_frame);
+    }
+    if (ret == 0) {
+        flush_video(vo);
+    }
+    if (vo->error) {
+        fprintf(stderr, "Error: could not encode segment from %d\n",
+                seg->first);
+        ret = -1;
+    }
+    seg->conversions_skipped = vo->conversions_skipped;
+
+    video_output_free(vo);
+
+    return ret;
+}
+
+/*
+ * encode_segment renders the screenshots of one segment into
+ * its spool, with the touch overlay replayed up to the first
+ * frame from the shared touch data. Failures are left in
+ * seg->error for the thread that joins it.
+ */
+static void * encode_segment(void *arg) {
+    Segment           *seg = arg;
+    Session           *session = seg->session;
+    const Options     *opts = seg->opts;
+    ImageDecoder      *dec;
+    TouchActualizer   *ta;
+    struct SwsContext *sc;
+
+    trace_thread_name("segment from %d", seg->first);
+
+    /* segments already run in parallel, one decode thread each */
+    dec = image_decoder_new_codec(session->codec_id, &session->raw, 1);
+    if (!dec) {
+        seg->error = 1;
+        return NULL;
+    }
+    ta = TouchActualizer_new_shared(session->touch_data,
+                                    session->width, session->height);
+    sc = get_scale_ctx(session->width, session->height, session->pix_fmt,
+                       seg->out_width, seg->out_height, opts->profile.pix_fmt,
+                       opts->profile.scale_method);
+
+    /* a new encoder, so the segment starts on an IDR frame */
+    seg->enc = avcodec_alloc_context3(seg->codec);
+    if (!seg->enc) {
+        fprintf(stderr, "Fatal: could not allocate encoder\n");
+        exit(1);
+    }
+    set_encoder_params(seg->enc, &opts->profile, seg->out_width,
+                       seg->out_height, seg->time_base);
+    seg->enc->thread_count = seg->threads;
+    /* each encoder restarts its reorder delay at the boundary,
+     * which the decode timestamps of the joined stream can
+     * not make room for */
+    seg->enc->max_b_frames = 0;
+    if (seg->global_header) {
+        seg->enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(seg->enc, seg->codec, NULL) < 0) {
+        fprintf(stderr, "Error: could not open video codec\n");
+        seg->error = 1;
+    }
+
+    if (!seg->error) {
+        seg->spool = tmpfile();
+        if (!seg->spool) {
+            fprintf(stderr, "Error: could not create segment spool\n");
+            seg->error = 1;
+        }
+    }
+
+    if (!seg->error && encode_shots(seg, dec, sc, ta) != 0) {
+        seg->error = 1;
+    }
+
+    sws_freeContext(sc);
+    TouchActualizer_destroy(ta);
+    image_decoder_free(dec);
+
+    return NULL;
+}
+
+/*
+ * split_segments divides the screenshots into n runs of
+ * about the same duration, each at least one screenshot
+ */
+static void split_segments(Session *session, Segment *segs, int n) {
+    long total, done, target;
+    int  k, end;
+
+    total = 0;
+    for (end = 0; end < session->n_shots; end++) {
+        if (session->shots[end].interval > 0) {
+            total += session->shots[end].interval;
+        }
+    }
+
+    done = 0;
+    end = 0;
+    for (k = 0; k < n; k++) {
+        segs[k].first = end;
+        target = total / n * (k + 1) + total % n * (k + 1) / n;
+
+        do {
+            if (session->shots[end].interval > 0) {
+                done += session->shots[end].interval;
+            }
+            end++;
+        } while (end < session->n_shots - (n - 1 - k) && done < target);
+
+        if (k == n - 1) end = session->n_shots;
+        segs[k].end = end;
+    }
+}
+
+/*
+ * concat_segment copies the packets of a finished segment into
+ * the output. The segments share one timeline, so timestamps
+ * are only rescaled, and the decode timestamps are kept
+ * increasing across the boundary, where each encoder restarts.
+ *
+ * returns 0 on success, -1 if a packet could not be written
+ */
+static int concat_segment(AVFormatContext *oc, AVStream *st, Segment *seg,
+                          int64_t *last_dts) {
+    AVPacket pkt;
+    int      ret = 0;
+
+    rewind(seg->spool);
+
+    av_init_packet(&pkt);
+    while (ret == 0 && spool_read(seg->spool, &pkt)) {
+        if (pkt.dts != AV_NOPTS_VALUE && *last_dts != AV_NOPTS_VALUE &&
+            pkt.dts <= *last_dts) {
+            pkt.dts = *last_dts + 1;
+        }
+        if (pkt.pts != AV_NOPTS_VALUE && pkt.dts != AV_NOPTS_VALUE &&
+            pkt.dts > pkt.pts) {
+            fprintf(stderr, "Error: segment boundary leaves no room for "
+                    "the decode delay\n");
+            ret = -1;
+        } else {
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                *last_dts = pkt.dts;
+            }
+            if (write_packet(oc, &seg->enc->time_base, st, &pkt) < 0) {
+                fprintf(stderr, "Error: could not write segment from %d\n",
+                        seg->first);
+                ret = -1;
+            }
+        }
+        av_free_packet(&pkt);
+    }
+
+    return ret;
+}
+
+static int same_extradata(AVCodecContext *a, AVCodecContext *b) {
+    return a->extradata_size == b->extradata_size &&
+           (a->extradata_size == 0 ||
+            memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+/*
+ * render_segments splits the session into segments that are
+ * encoded in parallel, then muxes their packets into the
+ * output in order without re-encoding. Each segment is
+ * copied out as soon as it and the ones before it are done.
+ *
+ * returns 0 on success, -1 if a segment failed, in which case
+ * the output file is removed once every segment has stopped
+ */
+static int render_segments(Session *session, const Options *opts,
+                           const char *dst_filename,
+                           int out_width, int out_height) {
+    AVFormatContext *oc;
+    AVStream        *st = NULL;
+    AVCodec         *codec;
+    Segment         *segs;
+    Session          merged;
+    int64_t          last_dts = AV_NOPTS_VALUE;
+    long             cores;
+    int              n, k, threads, n_shots, conversions_skipped = 0;
+    int              ret = 0;
+
+    if (opts->frame_cache) {
+        fprintf(stderr, "Warning: segmented renders do not use the frame "
+                "cache\n");
+    }
+
+    codec = get_encoder(&opts->profile);
+    if (!codec) {
+        return -1;
+    }
+
+    oc = open_output(dst_filename, NULL);
+    if (!oc) {
+        return -1;
+    }
+
+    /* the segments are split over the merged screenshots */
+    n_shots = session->n_shots;
+    if (opts->dedup) {
+        merged = *session;
+        merged.shots = dedup_screenshots(session->shots, session->n_shots,
+                                         &merged.n_shots);
+        session = &merged;
+    }
+
+    n = opts->segments;
+    if (n > session->n_shots) n = session->n_shots;
+
+    /* the touch data is shared by all segments, read only */
+    register_lock_manager();
+
+    /* split the cores between the segment encoders */
+    threads = opts->profile.threads;
+    if (threads == 0) {
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > n ? (int)(cores / n) : 1;
+    }
+
+    segs = calloc(n, sizeof(Segment));
+    if (!segs) {
+        fprintf(stderr, "Fatal: could not allocate segments\n");
+        exit(1);
+    }
+    split_segments(session, segs, n);
+
+    for (k = 0; k < n; k++) {
+        segs[k].session = session;
+        segs[k].opts = opts;
+        segs[k].codec = codec;
+        segs[k].global_header = oc->oformat->flags & AVFMT_GLOBALHEADER;
+        segs[k].out_width = out_width;
+        segs[k].out_height = out_height;
+        segs[k].time_base = output_time_base(opts);
+        segs[k].threads = threads;
+
+        if (pthread_create(&segs[k].thread, NULL, encode_segment,
+                           &segs[k]) != 0) {
+            fprintf(stderr, "Fatal: could not start segment thread\n");
+            exit(1);
+        }
+    }
+
+    /* every segment is joined, even after a failure, before
+     * anything is freed */
+    for (k = 0; k < n; k++) {
+        pthread_join(segs[k].thread, NULL);
+        if (ret != 0 || segs[k].error) {
+            ret = -1;
+            continue;
+        }
+
+        if (k == 0) {
+            /* the stream takes the parameters of the first encoder */
+            st = avformat_new_stream(oc, NULL);
+            if (!st || avcodec_copy_context(st->codec, segs[0].enc) < 0) {
+                fprintf(stderr, "Fatal: could not allocate stream\n");
+                exit(1);
+            }
+            st->codec->codec_tag = 0;
+            st->time_base = segs[0].enc->time_base;
+            if (write_header(oc, NULL) != 0) {
+                ret = -1;
+                continue;
+            }
+        } else if (!same_extradata(segs[0].enc, segs[k].enc)) {
+            fprintf(stderr, "Error: segment encoders produced different "
+                    "stream headers\n");
+            ret = -1;
+            continue;
+        }
+
+        if (concat_segment(oc, st, &segs[k], &last_dts) != 0) {
+            ret = -1;
+            continue;
+        }
+
+        conversions_skipped += segs[k].conversions_skipped;
+        if (!opts->quiet) {
+            printf("Segment %d: screenshots %d to %d\n", k, segs[k].first,
+                   segs[k].end - 1);
+        }
+    }
+
+    if (ret == 0 && av_write_trailer(oc) < 0) {
+        fprintf(stderr, "Error: could not write the trailer of '%s'\n",
+                dst_filename);
+        ret = -1;
+    }
+
+    if (opts->dedup) {
+        if (ret == 0 && !opts->quiet) {
+            printf("Dedup: %d decodes and %d conversions skipped\n",
+                   n_shots - merged.n_shots, conversions_skipped);
+        }
+        free(merged.shots);
+    }
+
+    if (st) {
+        avcodec_close(st->codec);
+    }
+    for (k = 0; k < n; k++) {
+        if (segs[k].spool) {
+            fclose(segs[k].spool);
+        }
+        if (segs[k].enc) {
+            avcodec_close(segs[k].enc);
+            av_free(segs[k].enc);
+        }
+    }
+    free(segs);
+
+    close_output(oc);
+    if (ret != 0) {
+        unlink(dst_filename);
+    }
+
+    return ret;
+}
+
+/*
+ * append_matches checks that the append state is of this
+ * session, rendered with the same output settings, and
+ * that its screenshots are still the first ones
+ */
+static int append_matches(const AppendState *state, Session *session,
+                          const Options *opts, int out_width, int out_height) {
+    return state->base_time == session->base_time &&
+           state->fps == opts->fps && state->vfr == opts->vfr &&
+           state->width == out_width && state->height == out_height &&
+           state->n_shots > 0 && state->n_shots <= session->n_shots &&
+           (state->n_shots == session->n_shots ||
+            session->shots[state->n_shots].time == state->end_time);
+}
+
+/*
+ * render_append renders the screenshots added to the session
+ * since the last append to dst_filename, as new fragments at
+ * the end of the file. Without an append state that fits the
+ * session and the file, the whole session is rendered into
+ * a new fragmented MP4 file, as it is when the file was
+ * replaced or cut short since.
+ *
+ * The new fragments are rendered into a part file next to the
+ * output and then copied over, and the state is written last,
+ * so an interrupted append is redone by the next one.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int render_append(Session *session, const Options *opts,
+                         const char *dst_filename,
+                         int out_width, int out_height, RenderCache *cache) {
+    AppendState  state;
+    Fmp4Layout   layout;
+    char        *state_filename, *part_filename;
+    int          appending, first, ret;
+
+    state_filename = append_state_filename(dst_filename);
+    if (asprintf(&part_filename, "%s.part", dst_filename) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    appending = append_state_read(state_filename, &state) == 0;
+    if (appending && (access(dst_filename, F_OK) != 0 ||
+                      !append_matches(&state, session, opts,
+                                      out_width, out_height) ||
+                      !fmp4_matches(dst_filename, state.media_end,
+                                    state.n_fragments))) {
+        fprintf(stderr, "Warning: %s does not match the session, "
+                "rendering all of it\n", state_filename);
+        append_state_free(&state);
+        appending = 0;
+    }
+    if (!appending) {
+        memset(&state, 0, sizeof(AppendState));
+        state.base_time = session->base_time;
+        state.fps = opts->fps;
+        state.vfr = opts->vfr;
+        state.width = out_width;
+        state.height = out_height;
+    }
+
+    first = state.n_shots;
+    if (first == session->n_shots) {
+        if (!opts->quiet) {
+            printf("%s is up to date\n", dst_filename);
+        }
+        append_state_free(&state);
+        free(part_filename);
+        free(state_filename);
+        return 0;
+    }
+
+    ret = render_serial(session, opts, part_filename, out_width, out_height,
+                        cache, &state);
+
+    if (ret == 0) {
+        ret = fmp4_scan(part_filename, &layout);
+    }
+    if (ret == 0 && appending) {
+        ret = fmp4_append(dst_filename, state.media_end, part_filename,
+                          &layout);
+        state.media_end += layout.media_end - layout.first_fragment;
+        unlink(part_filename);
+    } else if (ret == 0) {
+        ret = fmp4_truncate(part_filename, layout.media_end);
+        if (ret == 0 && rename(part_filename, dst_filename) != 0) {
+            fprintf(stderr, "Error: could not rename %s\n", part_filename);
+            ret = -1;
+        }
+        state.media_end = layout.media_end;
+    }
+
+    if (ret == 0) {
+        state.n_fragments += layout.n_fragments;
+        ret = append_state_write(state_filename, &state);
+    } else {
+        unlink(part_filename);
+    }
+
+    if (ret == 0 && !opts->quiet) {
+        printf("Appended screenshots %d to %d in %d fragments\n", first,
+               session->n_shots - 1, layout.n_fragments);
+    }
+
+    append_state_free(&state);
+    free(part_filename);
+    free(state_filename);
+
+    return ret;
+}
+
+/*
+ * render_session renders the session into dst_filename
+ * with the options, in segments or appending to it if
+ * requested. A render
+ * cache keeps the decoder and scaler for the next call,
+ * with a NULL cache they are freed before returning.
+ *
+ * returns 0 on success, -1 if the render failed
+ */
+int render_session(Session *session, const Options *opts,
+                   const char *dst_filename, RenderCache *cache) {
+    RenderCache local;
+    int         out_width, out_height, ret;
+
+    /* FFMPEG requires dimensions to be
+     * multiple of 2 */
+    out_width = session->width;
+    if (out_width % 2 != 0) out_width += 1;
+    out_height = session->height;
+    if (out_height % 2 != 0) out_height += 1;
+
+    if (opts->segments > 1 && session->n_shots > 1 && !opts->append) {
+        return render_segments(session, opts, dst_filename,
+                               out_width, out_height);
+    }
+
+    if (!cache) {
+        render_cache_init(&local);
+    }
+    if (opts->append) {
+        ret = render_append(session, opts, dst_filename,
+                            out_width, out_height, cache ? cache : &local);
+    } else {
+        ret = render_serial(session, opts, dst_filename,
+                            out_width, out_height, cache ? cache : &local,
+                            NULL);
+    }
+    if (!cache) {
+        render_cache_free(&local);
+    }
+
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <libswscale/swscale.h>
+
+#include "decoder.h"
+#include "options.h"
+#include "session.h"
+
+/*
+ * A RenderCache keeps the picture decoder and the scaler
+ * between renders, which are reused as long as the next
+ * session has the same picture format
+ */
+typedef struct RenderCache {
+    ImageDecoder      *dec;
+    int                dec_threads;
+    struct SwsContext *sc;
+} RenderCache;
+
+void render_cache_init(RenderCache *cache);
+
+void render_cache_free(RenderCache *cache);
+
+int render_session(Session *session, const Options *opts,
+                   const char *dst_filename, RenderCache *cache);
+
+#endif
@@ -0,0 +1,559 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+
+#include "actualizer.h"
+#include "decoder.h"
+#include "session.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * The session index is one file in the native byte order,
+ * laid out so that it can be mapped and used in place:
+ *
+ *   IndexHeader
+ *   IndexShot   shots[n_shots]
+ *   int64_t     timestamps[n_events]  \
+ *   int32_t     xs[n_events]           |
+ *   int32_t     ys[n_events]           | the packed TouchData arrays
+ *   int32_t     indices[n_events]      |
+ *   uint8_t     actions[n_events]     /
+ *   char        folder[]               the video folder, NUL terminated
+ *   char        strings[strings_size]  screenshot paths, NUL terminated
+ *
+ * Every section starts INDEX_ALIGN aligned. The index is
+ * stale, and ignored, when any of its sources changed or the
+ * libraries the codec and pixel format numbers come from did.
+ */
+#define INDEX_MAGIC   "CRUNCHIX"
+#define INDEX_VERSION 3
+#define INDEX_ENDIAN  0x01020304u
+#define INDEX_ALIGN   8
+
+enum {
+    SOURCE_VIDEO_JSON,
+    SOURCE_TOUCH_JSON,
+    N_SOURCES
+};
+
+typedef struct IndexSource {
+    int64_t mtime;
+    int64_t size;
+} IndexSource;
+
+typedef struct IndexShot {
+    int64_t     time;
+    int64_t     interval;
+    int64_t     path;     /* offset in the string table */
+    IndexSource file;     /* the screenshot when it was indexed */
+} IndexShot;
+
+typedef struct IndexHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    endian;
+    uint32_t    avcodec_version;
+    uint32_t    avutil_version;
+    int64_t     file_size;
+    IndexSource sources[N_SOURCES];
+
+    int32_t     codec_id;
+    int32_t     width, height, pix_fmt;
+    int32_t     raw_header, raw_stride; /* raw framebuffers only */
+    int64_t     base_time;
+
+    int32_t     n_shots;
+    int32_t     n_events;
+    int32_t     n_pointers;
+    uint8_t     color[4];
+
+    /* section offsets from the start of the file */
+    int64_t     shots;
+    int64_t     timestamps, xs, ys, indices, actions;
+    int64_t     folder;
+    int64_t     strings, strings_size;
+} IndexHeader;
+
+/*
+ * stat_source records the modification time and size
+ * of a file the index was compiled from
+ *
+ * returns 0 if the file could not be read
+ */
+static int stat_source(const char *filename, IndexSource *source) {
+    struct stat st;
+
+    if (stat(filename, &st) != 0) {
+        return 0;
+    }
+
+    source->mtime = st.st_mtime;
+    source->size = st.st_size;
+    return 1;
+}
+
+static int stat_sources(Session *s, IndexSource *sources) {
+    return stat_source(s->video_json_filename, &sources[SOURCE_VIDEO_JSON]) &&
+           stat_source(s->touch_json_filename, &sources[SOURCE_TOUCH_JSON]);
+}
+
+/*
+ * in_bounds checks that count elements of size bytes at
+ * offset are aligned and lie inside the mapping
+ */
+static int in_bounds(const IndexHeader *h, int64_t offset, int64_t count,
+                     size_t size) {
+    return offset >= (int64_t)sizeof(IndexHeader) &&
+           offset % INDEX_ALIGN == 0 && count >= 0 &&
+           offset <= h->file_size &&
+           count <= (h->file_size - offset) / (int64_t)(size ? size : 1);
+}
+
+/*
+ * check_header validates the index against this build and
+ * the current source files
+ *
+ * returns 0 if the index can not be used
+ */
+static int check_header(Session *s, const char *data, size_t size) {
+    const IndexHeader *h = (const IndexHeader *)data;
+    const IndexShot   *shots;
+    IndexSource        sources[N_SOURCES], file;
+    const char        *folder;
+    int                i;
+
+    if (size < sizeof(IndexHeader) ||
+        memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != INDEX_VERSION || h->endian != INDEX_ENDIAN ||
+        h->avcodec_version != avcodec_version() ||
+        h->avutil_version != avutil_version() ||
+        h->file_size != (int64_t)size) {
+        return 0;
+    }
+
+    /* the shot table has a spare entry after the screenshots */
+    if (h->n_shots < 1 || h->n_shots == INT32_MAX || h->n_events < 0 ||
+        h->n_pointers < 0 ||
+        h->n_pointers > MAX_POINTERS ||
+        !in_bounds(h, h->shots, h->n_shots + 1, sizeof(IndexShot)) ||
+        !in_bounds(h, h->timestamps, h->n_events, sizeof(int64_t)) ||
+        !in_bounds(h, h->xs, h->n_events, sizeof(int32_t)) ||
+        !in_bounds(h, h->ys, h->n_events, sizeof(int32_t)) ||
+        !in_bounds(h, h->indices, h->n_events, sizeof(int32_t)) ||
+        !in_bounds(h, h->actions, h->n_events, sizeof(uint8_t)) ||
+        !in_bounds(h, h->folder, 1, 1) ||
+        !in_bounds(h, h->strings, h->strings_size, 1) ||
+        h->strings_size < 1 || data[h->strings + h->strings_size - 1] != '\0') {
+        return 0;
+    }
+
+    /* the paths were resolved against this folder */
+    folder = data + h->folder;
+    if (memchr(folder, '\0', size - h->folder) == NULL ||
+        strcmp(folder, s->video_folder) != 0) {
+        return 0;
+    }
+
+    shots = (const IndexShot *)(data + h->shots);
+    for (i = 0; i < h->n_shots + 1; i++) {
+        if (shots[i].path < 0 || shots[i].path >= h->strings_size) {
+            return 0;
+        }
+    }
+
+    if (!stat_sources(s, sources) ||
+        memcmp(sources, h->sources, sizeof(sources)) != 0) {
+        return 0;
+    }
+
+    /* a screenshot can be rewritten without touching the json */
+    for (i = 0; i < h->n_shots; i++) {
+        if (!stat_source(data + h->strings + shots[i].path, &file) ||
+            memcmp(&file, &shots[i].file, sizeof(file)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * map_index maps the session index and points the session
+ * at it, the screenshot paths and touch events are used
+ * in place
+ *
+ * returns 0 if there is no usable index
+ */
+static int map_index(Session *s) {
+    const IndexHeader *h;
+    const IndexShot   *shots;
+    const char        *data;
+    struct stat        st;
+    RGBA_color         color;
+    int                fd, i;
+
+    /* the touch timestamps are mapped as longs */
+    if (sizeof(long) != sizeof(int64_t) || sizeof(int) != sizeof(int32_t)) {
+        return 0;
+    }
+
+    fd = open(s->index_filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    if (!check_header(s, data, st.st_size)) {
+        fprintf(stderr, "Warning: %s is out of date, reading the json "
+                "files instead. Run 'index' to update it.\n",
+                s->index_filename);
+        munmap((void *)data, st.st_size);
+        return 0;
+    }
+
+    h = (const IndexHeader *)data;
+    shots = (const IndexShot *)(data + h->shots);
+
+    s->map = (void *)data;
+    s->map_size = st.st_size;
+
+    s->n_shots = h->n_shots;
+    s->shots = malloc(s->n_shots * sizeof(Screenshot));
+    if (!s->shots) {
+        fprintf(stderr, "Fatal: could not allocate screenshot list\n");
+        exit(1);
+    }
+    for (i = 0; i < s->n_shots; i++) {
+        s->shots[i].filepath = (char *)data + h->strings + shots[i].path;
+        s->shots[i].time = shots[i].time;
+        s->shots[i].interval = shots[i].interval;
+    }
+    s->base_time = h->base_time;
+
+    s->codec_id = h->codec_id;
+    s->width = h->width;
+    s->height = h->height;
+    s->pix_fmt = h->pix_fmt;
+    rawfb_format_init(&s->raw);
+    if (s->codec_id == AV_CODEC_ID_RAWVIDEO) {
+        s->raw.width = h->width;
+        s->raw.height = h->height;
+        s->raw.pix_fmt = h->pix_fmt;
+        s->raw.header = h->raw_header;
+        s->raw.stride = h->raw_stride;
+    }
+
+    color.r = h->color[0];
+    color.g = h->color[1];
+    color.b = h->color[2];
+    color.a = h->color[3];
+    s->touch_data = TouchData_new_packed(h->n_events,
+                                         (uint8_t *)data + h->actions,
+                                         (int *)(data + h->indices),
+                                         (int *)(data + h->xs),
+                                         (int *)(data + h->ys),
+                                         (long *)(data + h->timestamps),
+                                         h->n_pointers, color);
+
+    return 1;
+}
+
+/*
+ * probe_format decodes the first picture to learn the
+ * format of the session, all other pictures are assumed
+ * to follow it. Raw framebuffers in the format of the video
+ * json are mapped with it instead.
+ *
+ * returns 0 if the picture can not be decoded
+ */
+static int probe_format(Session *s) {
+    ImageDecoder *dec;
+    AVFrame      *frame;
+    StatsSpan     span;
+
+    /* the decode of the picture counts on its own */
+    stats_begin(&span);
+    if (s->raw.header != RAWFB_OWN_HEADER) {
+        dec = image_decoder_new_raw(&s->raw);
+    } else {
+        dec = image_decoder_new(s->shots[0].filepath, 0);
+    }
+    stats_end(&span, STATS_DECODE);
+    if (dec == NULL) {
+        return 0;
+    }
+    frame = image_decoder_decode(dec, s->shots[0].filepath);
+    if (frame == NULL) {
+        image_decoder_free(dec);
+        return 0;
+    }
+
+    s->codec_id = dec->codec_id;
+    s->width = frame->width;
+    s->height = frame->height;
+    s->pix_fmt = frame->format;
+    s->raw = dec->raw;
+
+    av_frame_free(&frame);
+    image_decoder_free(dec);
+    return 1;
+}
+
+/*
+ * session_open reads the session in basedir, from its index
+ * if use_index is set and the index is up to date
+ *
+ * returns NULL if the session files can not be read
+ *
+ * side effects: allocates a Session which must be
+ * freed with session_free
+ */
+Session * session_open(char *basedir, int use_index) {
+    Session   *s;
+    char      *touch_folder;
+    StatsSpan  span;
+
+    s = calloc(1, sizeof(Session));
+    if (!s) {
+        fprintf(stderr, "Fatal: could not allocate session\n");
+        exit(1);
+    }
+
+    s->video_folder = get_video_folder(basedir);
+    s->video_json_filename = get_video_json_filename(s->video_folder);
+    touch_folder = get_touch_folder(basedir);
+    s->touch_json_filename = get_touch_json_file(touch_folder);
+    free(touch_folder);
+    s->index_filename = get_index_filename(basedir);
+
+    stats_begin(&span);
+    if (use_index && map_index(s)) {
+        stats_end(&span, STATS_JSON);
+        return s;
+    }
+
+    /* the screenshot list and the touch events are streamed
+     * in up front, the events sorted by timestamp */
+    rawfb_format_init(&s->raw);
+    s->shots = load_screenshots(s->video_json_filename, s->video_folder,
+                                &s->n_shots, &s->base_time, &s->raw);
+    stats_end(&span, STATS_JSON);
+    if (s->shots == NULL || !probe_format(s)) {
+        session_free(s);
+        return NULL;
+    }
+    stats_begin(&span);
+    s->touch_data = TouchData_new(s->touch_json_filename);
+    stats_end(&span, STATS_JSON);
+    if (s->touch_data == NULL) {
+        session_free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/*
+ * put_section writes size bytes at the next aligned
+ * position of the file
+ *
+ * returns the offset the data was written at
+ */
+static int64_t put_section(FILE *file, int64_t *pos, const void *data,
+                           size_t size) {
+    static const char zeros[INDEX_ALIGN];
+    int64_t           start;
+
+    start = (*pos + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+    if (fwrite(zeros, 1, start - *pos, file) != (size_t)(start - *pos) ||
+        fwrite(data, 1, size, file) != size) {
+        fprintf(stderr, "Fatal: could not write session index\n");
+        exit(1);
+    }
+
+    *pos = start + size;
+    return start;
+}
+
+/*
+ * session_write_index compiles the session in basedir into
+ * its index, which later renders map instead of reading the
+ * json files and probing the pictures
+ *
+ * The index is written next to the final file and renamed
+ * into place, so a render never maps a partial index.
+ *
+ * returns 0 on success, 1 if the session can not be read,
+ * exits if the index can not be written
+ */
+int session_write_index(char *basedir) {
+    Session     *s;
+    TouchData   *td;
+    IndexHeader  h;
+    IndexShot   *shots;
+    int64_t     *timestamps;
+    int64_t      pos, path;
+    char        *tmp_filename;
+    FILE        *file;
+    int          i;
+
+    s = session_open(basedir, 0);
+    if (s == NULL) {
+        return 1;
+    }
+    td = s->touch_data;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = INDEX_VERSION;
+    h.endian = INDEX_ENDIAN;
+    h.avcodec_version = avcodec_version();
+    h.avutil_version = avutil_version();
+    if (!stat_sources(s, h.sources)) {
+        fprintf(stderr, "Fatal: could not read the session files\n");
+        exit(1);
+    }
+
+    h.codec_id = s->codec_id;
+    h.width = s->width;
+    h.height = s->height;
+    h.pix_fmt = s->pix_fmt;
+    h.raw_header = s->raw.header;
+    h.raw_stride = s->raw.stride;
+    h.base_time = s->base_time;
+
+    h.n_shots = s->n_shots;
+    h.n_events = td->n_events;
+    h.n_pointers = td->n_pointers;
+    h.color[0] = td->touch_color->r;
+    h.color[1] = td->touch_color->g;
+    h.color[2] = td->touch_color->b;
+    h.color[3] = td->touch_color->a;
+
+    /* one spare entry keeps the table non-empty */
+    shots = calloc(s->n_shots + 1, sizeof(IndexShot));
+    timestamps = malloc((td->n_events + 1) * sizeof(int64_t));
+    if (!shots || !timestamps) {
+        fprintf(stderr, "Fatal: could not allocate session index\n");
+        exit(1);
+    }
+
+    path = 0;
+    for (i = 0; i < s->n_shots; i++) {
+        shots[i].time = s->shots[i].time;
+        shots[i].interval = s->shots[i].interval;
+        shots[i].path = path;
+        path += strlen(s->shots[i].filepath) + 1;
+        if (!stat_source(s->shots[i].filepath, &shots[i].file)) {
+            fprintf(stderr, "Fatal: could not read %s\n",
+                    s->shots[i].filepath);
+            exit(1);
+        }
+    }
+    shots[s->n_shots].path = 0;
+    h.strings_size = path;
+
+    for (i = 0; i < td->n_events; i++) {
+        timestamps[i] = td->timestamps[i];
+    }
+
+    if (asprintf(&tmp_filename, "%s.tmp", s->index_filename) < 0) {
+        fprintf(stderr, "Fatal: asprintf failure\n");
+        exit(1);
+    }
+
+    file = fopen(tmp_filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Fatal: could not open %s\n", tmp_filename);
+        exit(1);
+    }
+
+    /* the header is written last, once the offsets are known */
+    pos = 0;
+    put_section(file, &pos, &h, sizeof(h));
+    h.shots = put_section(file, &pos, shots,
+                          (s->n_shots + 1) * sizeof(IndexShot));
+    h.timestamps = put_section(file, &pos, timestamps,
+                               td->n_events * sizeof(int64_t));
+    h.xs = put_section(file, &pos, td->xs, td->n_events * sizeof(int32_t));
+    h.ys = put_section(file, &pos, td->ys, td->n_events * sizeof(int32_t));
+    h.indices = put_section(file, &pos, td->indices,
+                            td->n_events * sizeof(int32_t));
+    h.actions = put_section(file, &pos, td->actions, td->n_events);
+    h.folder = put_section(file, &pos, s->video_folder,
+                           strlen(s->video_folder) + 1);
+    h.strings = put_section(file, &pos, s->shots[0].filepath,
+                            strlen(s->shots[0].filepath) + 1);
+    for (i = 1; i < s->n_shots; i++) {
+        if (fwrite(s->shots[i].filepath, 1, strlen(s->shots[i].filepath) + 1,
+                   file) != strlen(s->shots[i].filepath) + 1) {
+            fprintf(stderr, "Fatal: could not write session index\n");
+            exit(1);
+        }
+    }
+    h.file_size = h.strings + h.strings_size;
+
+    if (fseek(file, 0, SEEK_SET) != 0 ||
+        fwrite(&h, sizeof(h), 1, file) != 1 || fclose(file) != 0) {
+        fprintf(stderr, "Fatal: could not write session index\n");
+        exit(1);
+    }
+
+    if (rename(tmp_filename, s->index_filename) != 0) {
+        fprintf(stderr, "Fatal: could not rename %s\n", tmp_filename);
+        exit(1);
+    }
+
+    printf("Wrote %s: %d screenshots, %d touch events\n",
+           s->index_filename, s->n_shots, td->n_events);
+
+    free(tmp_filename);
+    free(timestamps);
+    free(shots);
+    session_free(s);
+
+    return 0;
+}
+
+void session_free(Session *s) {
+    if (s == NULL) return;
+
+    if (s->map) {
+        /* the paths live in the mapping */
+        free(s->shots);
+    } else {
+        free_screenshots(s->shots, s->n_shots);
+    }
+
+    /* mapped touch data points into the index,
+     * so it goes before the mapping */
+    TouchData_destroy(s->touch_data);
+    if (s->map) {
+        munmap(s->map, s->map_size);
+    }
+
+    free(s->video_folder);
+    free(s->video_json_filename);
+    free(s->touch_json_filename);
+    free(s->index_filename);
+    free(s);
+}
@@ -0,0 +1,52 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stddef.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "actualizer.h"
+#include "rawfb.h"
+#include "utils.h"
+
+/*
+ * A Session is everything a render needs to know about a
+ * recorded testing session before the first screenshot is
+ * decoded: the screenshot list, the touch events and the
+ * format of the pictures.
+ *
+ * It is read from the compiled session index when there is
+ * an up to date one, which is mapped and used in place, and
+ * otherwise from the json files and a probe of the first
+ * picture.
+ */
+typedef struct Session {
+    char           *video_folder;
+    char           *video_json_filename;
+    char           *touch_json_filename;
+    char           *index_filename;
+
+    Screenshot     *shots;
+    int             n_shots;
+    long            base_time;
+
+    /* source picture format */
+    enum AVCodecID  codec_id;
+    int             width, height, pix_fmt;
+    RawFormat       raw; /* layout of raw framebuffers, if codec_id is
+                            AV_CODEC_ID_RAWVIDEO */
+
+    TouchData      *touch_data; /* NULL once handed to a TouchActualizer */
+
+    /* index mapping, NULL when the session was read from json */
+    void           *map;
+    size_t          map_size;
+} Session;
+
+Session * session_open(char *basedir, int use_index);
+
+int session_write_index(char *basedir);
+
+void session_free(Session *s);
+
+#endif
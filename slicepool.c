@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "slicepool.h"
+#include "trace.h"
+
+/*
+ * run_slices claims and runs slices of the current job until
+ * none are left, with the lock held on entry and on return
+ */
+static void run_slices(SlicePool *pool) {
+    int slice;
+
+    while (pool->next_slice < pool->n_slices) {
+        slice = pool->next_slice++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->func(pool->arg, slice, pool->n_slices);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+}
+
+static void * slice_worker(void *arg) {
+    SlicePool *pool = arg;
+
+    trace_thread_name("slice worker", 0);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->next_slice >= pool->n_slices) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        run_slices(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * slice_pool_new starts n_threads threads that wait for
+ * jobs from slice_pool_run
+ *
+ * side effects: allocates a SlicePool which must be
+ * freed with slice_pool_free
+ */
+SlicePool * slice_pool_new(int n_threads) {
+    SlicePool *pool;
+    int        i;
+
+    pool = malloc(sizeof(SlicePool));
+    if (pool) {
+        pool->threads = malloc(n_threads * sizeof(pthread_t));
+    }
+    if (!pool || !pool->threads) {
+        fprintf(stderr, "Fatal: could not allocate slice pool\n");
+        exit(1);
+    }
+
+    pool->n_threads = n_threads;
+    pool->func = NULL;
+    pool->arg = NULL;
+    pool->n_slices = 0;
+    pool->next_slice = 0;
+    pool->pending = 0;
+    pool->stop = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, slice_worker, pool) != 0) {
+            fprintf(stderr, "Fatal: could not start slice thread\n");
+            exit(1);
+        }
+    }
+
+    return pool;
+}
+
+/*
+ * slice_pool_run calls func(arg, i, n_slices) for every
+ * slice i on the pool threads and the calling thread, and
+ * returns once all of them returned
+ */
+void slice_pool_run(SlicePool *pool, SliceFunc func, void *arg, int n_slices) {
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->n_slices = n_slices;
+    pool->next_slice = 0;
+    pool->pending = n_slices;
+    pthread_cond_broadcast(&pool->work);
+
+    run_slices(pool);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * slice_pool_free stops and joins the pool threads
+ */
+void slice_pool_free(SlicePool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
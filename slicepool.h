@@ -0,0 +1,39 @@
+#ifndef _SLICEPOOL_H_
+#define _SLICEPOOL_H_
+
+#include <pthread.h>
+
+/*
+ * A SlicePool runs a job split into slices, such as the
+ * bands of rows of a frame, on a set of threads that live
+ * as long as the pool. The calling thread takes slices too
+ * and returns once every slice is done, so a pool of n
+ * threads runs a job on n + 1 cores.
+ */
+
+typedef void (*SliceFunc)(void *arg, int slice, int n_slices);
+
+typedef struct SlicePool {
+    int              n_threads;
+    pthread_t       *threads;
+
+    /* the job being run, slices [next_slice, n_slices) are unclaimed */
+    SliceFunc        func;
+    void            *arg;
+    int              n_slices;
+    int              next_slice;
+    int              pending; /* slices not finished yet */
+    int              stop;
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    pthread_cond_t   done;
+} SlicePool;
+
+SlicePool * slice_pool_new(int n_threads);
+
+void slice_pool_run(SlicePool *pool, SliceFunc func, void *arg, int n_slices);
+
+void slice_pool_free(SlicePool *pool);
+
+#endif
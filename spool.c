@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "spool.h"
+
+typedef struct SpoolRecord {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int32_t flags;
+    int32_t size;
+} SpoolRecord;
+
+/*
+ * spool_write appends the packet to the spool,
+ * exits if it can not be written
+ */
+void spool_write(FILE *spool, const AVPacket *pkt) {
+    SpoolRecord rec;
+
+    rec.pts = pkt->pts;
+    rec.dts = pkt->dts;
+    rec.duration = pkt->duration;
+    rec.flags = pkt->flags;
+    rec.size = pkt->size;
+
+    if (fwrite(&rec, sizeof(rec), 1, spool) != 1 ||
+        fwrite(pkt->data, 1, pkt->size, spool) != (size_t)pkt->size) {
+        fprintf(stderr, "Fatal: could not write packet spool\n");
+        exit(1);
+    }
+}
+
+/*
+ * spool_read reads the next packet of the spool
+ *
+ * returns 0 at the end of the spool
+ *
+ * side effects: allocates the packet data, which
+ * must be freed with av_free_packet
+ */
+int spool_read(FILE *spool, AVPacket *pkt) {
+    SpoolRecord rec;
+
+    if (fread(&rec, sizeof(rec), 1, spool) != 1) {
+        return 0;
+    }
+
+    if (rec.size < 0 || av_new_packet(pkt, rec.size) < 0 ||
+        fread(pkt->data, 1, rec.size, spool) != (size_t)rec.size) {
+        fprintf(stderr, "Fatal: could not read packet spool\n");
+        exit(1);
+    }
+
+    pkt->pts = rec.pts;
+    pkt->dts = rec.dts;
+    pkt->duration = rec.duration;
+    pkt->flags = rec.flags;
+
+    return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stdio.h>
+
+#include <libavcodec/avcodec.h>
+
+/*
+ * A spool is a temporary file of encoded packets, stored
+ * with their exact timestamps and flags so they can be
+ * muxed later without going through a container.
+ */
+
+void spool_write(FILE *spool, const AVPacket *pkt);
+
+int spool_read(FILE *spool, AVPacket *pkt);
+
+#endif
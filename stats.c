@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <jansson.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define NS_PER_SEC 1000000000LL
+
+typedef struct StageTotals {
+    int64_t count;
+    int64_t wall_ns;
+    int64_t cpu_ns;
+} StageTotals;
+
+static const char *stage_names[STATS_N_STAGES] = {
+    "json_load",
+    "decode",
+    "touch_update",
+    "overlay",
+    "scale",
+    "encode",
+    "write"
+};
+
+int stats_enabled = 0;
+
+static const char  *stats_filename;
+static int64_t      start_ns;
+static StageTotals  totals[STATS_N_STAGES];
+static int64_t      total_frames;
+static int64_t      total_bytes;
+static int          cache_used;
+static int64_t      cache_hits;
+static int64_t      cache_misses;
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static double seconds(int64_t ns) {
+    return (double)ns / NS_PER_SEC;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * write_stats writes the json summary, at exit
+ */
+static void write_stats(void) {
+    struct rusage usage;
+    json_t       *root, *stages, *stage, *cache;
+    double        wall;
+    int64_t       frames;
+    int           i, ret;
+
+    wall = seconds(clock_ns(CLOCK_MONOTONIC) - start_ns);
+    frames = __atomic_load_n(&total_frames, __ATOMIC_RELAXED);
+    getrusage(RUSAGE_SELF, &usage);
+
+    stages = json_object();
+    for (i = 0; i < STATS_N_STAGES; i++) {
+        stage = json_object();
+        json_object_set_new(stage, "count", json_integer(totals[i].count));
+        json_object_set_new(stage, "wall_seconds",
+                            json_real(seconds(totals[i].wall_ns)));
+        json_object_set_new(stage, "cpu_seconds",
+                            json_real(seconds(totals[i].cpu_ns)));
+        json_object_set_new(stages, stage_names[i], stage);
+    }
+
+    root = json_object();
+    json_object_set_new(root, "wall_seconds", json_real(wall));
+    json_object_set_new(root, "cpu_seconds",
+                        json_real(timeval_seconds(&usage.ru_utime) +
+                                  timeval_seconds(&usage.ru_stime)));
+    json_object_set_new(root, "frames", json_integer(frames));
+    json_object_set_new(root, "frames_per_second",
+                        json_real(wall > 0 ? frames / wall : 0.0));
+    json_object_set_new(root, "bytes_written", json_integer(total_bytes));
+    /* kilobytes on Linux */
+    json_object_set_new(root, "peak_rss_kb", json_integer(usage.ru_maxrss));
+    json_object_set_new(root, "stages", stages);
+    if (cache_used) {
+        cache = json_object();
+        json_object_set_new(cache, "hits", json_integer(cache_hits));
+        json_object_set_new(cache, "misses", json_integer(cache_misses));
+        json_object_set_new(root, "frame_cache", cache);
+    }
+
+    if (strcmp(stats_filename, "-") == 0) {
+        ret = json_dumpf(root, stdout, JSON_INDENT(2));
+        printf("\n");
+    } else {
+        ret = json_dump_file(root, stats_filename, JSON_INDENT(2));
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Warning: could not write the stats to '%s'\n",
+                stats_filename);
+    }
+    json_decref(root);
+}
+
+/*
+ * stats_enable starts collecting statistics, which are
+ * written to filename, or stdout for "-", at exit
+ */
+void stats_enable(const char *filename) {
+    stats_filename = filename;
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+    stats_enabled = 1;
+    atexit(write_stats);
+}
+
+void stats_begin(StatsSpan *span) {
+    if (!stats_enabled && !trace_enabled) {
+        return;
+    }
+    span->wall = clock_ns(CLOCK_MONOTONIC);
+    span->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/*
+ * stats_end adds the call that started at span, on
+ * this thread, to the stage, and to the trace
+ */
+void stats_end(StatsSpan *span, enum StatsStage stage) {
+    StageTotals *t = &totals[stage];
+    int64_t      wall;
+
+    if (!stats_enabled && !trace_enabled) {
+        return;
+    }
+    wall = clock_ns(CLOCK_MONOTONIC);
+
+    if (trace_enabled) {
+        trace_event(stage_names[stage], span->wall, wall);
+    }
+    if (!stats_enabled) {
+        return;
+    }
+    __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->wall_ns, wall - span->wall, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->cpu_ns,
+                       clock_ns(CLOCK_THREAD_CPUTIME_ID) - span->cpu,
+                       __ATOMIC_RELAXED);
+}
+
+void stats_add_frames(int64_t frames) {
+    if (stats_enabled) {
+        __atomic_fetch_add(&total_frames, frames, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_add_bytes(int64_t bytes) {
+    if (stats_enabled) {
+        __atomic_fetch_add(&total_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * stats_add_frame_cache adds the frame cache hits and misses
+ * of one render, the summary only has them once one did
+ */
+void stats_add_frame_cache(int64_t hits, int64_t misses) {
+    if (stats_enabled) {
+        __atomic_store_n(&cache_used, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache_hits, hits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache_misses, misses, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Run statistics count the calls into each stage of the
+ * render and accumulate their wall clock and thread CPU
+ * time, from every thread. They are off unless enabled with
+ * --stats, and when the program exits a json summary with
+ * the totals, frames per second, bytes written, peak
+ * memory and frame cache hits is written to the file given
+ * there. With --trace
+ * every timed call also goes to the trace, see trace.h.
+ */
+
+enum StatsStage {
+    STATS_JSON,    /* session json files and index */
+    STATS_DECODE,  /* screenshot probe and decode */
+    STATS_TOUCHES, /* touch updates, streaming the touch json */
+    STATS_OVERLAY, /* drawing and reverting touches */
+    STATS_SCALE,   /* color conversion */
+    STATS_ENCODE,
+    STATS_WRITE,   /* muxing and spooling packets */
+    STATS_N_STAGES
+};
+
+/* the start of one timed call */
+typedef struct StatsSpan {
+    int64_t wall;
+    int64_t cpu;
+} StatsSpan;
+
+extern int stats_enabled;
+
+void stats_enable(const char *filename);
+
+void stats_begin(StatsSpan *span);
+
+void stats_end(StatsSpan *span, enum StatsStage stage);
+
+void stats_add_frames(int64_t frames);
+
+void stats_add_bytes(int64_t bytes);
+
+void stats_add_frame_cache(int64_t hits, int64_t misses);
+
+#endif
@@ -0,0 +1,171 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <libavutil/avutil.h>
+
+#include "trace.h"
+
+#define NS_PER_US 1000
+
+int trace_enabled = 0;
+
+static FILE            *trace_file;
+static pthread_mutex_t  trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t          trace_start;
+static long             n_events;
+
+/* what this thread is working on */
+static __thread int         current_shot = -1;
+static __thread const char *current_file;
+static __thread int64_t     current_pts = AV_NOPTS_VALUE;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long thread_id(void) {
+    return syscall(SYS_gettid);
+}
+
+/*
+ * put_string writes s as a json string, the trace lock held
+ */
+static void put_string(const char *s) {
+    fputc('"', trace_file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', trace_file);
+            fputc(*s, trace_file);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(trace_file, "\\u%04x", *s);
+        } else {
+            fputc(*s, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
+
+/*
+ * begin_event starts the next element of the event array,
+ * the trace lock held
+ */
+static void begin_event(void) {
+    fputs(n_events++ > 0 ? ",\n" : "\n", trace_file);
+}
+
+static void close_trace(void) {
+    pthread_mutex_lock(&trace_lock);
+    fputs("\n]}\n", trace_file);
+    if (fclose(trace_file) != 0) {
+        fprintf(stderr, "Warning: could not write the trace\n");
+    }
+    trace_enabled = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_open starts writing the trace to filename, it is
+ * completed at exit
+ *
+ * returns 0 on success, -1 if the file can not be created
+ */
+int trace_open(const char *filename) {
+    trace_file = fopen(filename, "w");
+    if (!trace_file) {
+        fprintf(stderr, "Error: could not create trace '%s'\n", filename);
+        return -1;
+    }
+
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", trace_file);
+    trace_start = now_ns();
+    trace_enabled = 1;
+    atexit(close_trace);
+
+    trace_thread_name("main", 0);
+    return 0;
+}
+
+/*
+ * trace_thread_name names the calling thread in the trace,
+ * format may hold one %d for n
+ */
+void trace_thread_name(const char *format, int n) {
+    char name[64];
+
+    if (!trace_enabled) {
+        return;
+    }
+    snprintf(name, sizeof(name), format, n);
+
+    pthread_mutex_lock(&trace_lock);
+    begin_event();
+    fprintf(trace_file, "{\"name\": \"thread_name\", \"ph\": \"M\", "
+            "\"pid\": %ld, \"tid\": %ld, \"args\": {\"name\": ",
+            (long)getpid(), thread_id());
+    put_string(name);
+    fputs("}}", trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_set_screenshot tags the following events of this
+ * thread with the screenshot, index is -1 if not known
+ */
+void trace_set_screenshot(int index, const char *filepath) {
+    current_shot = index;
+    current_file = filepath;
+}
+
+/*
+ * trace_set_pts tags the following events of this thread
+ * with the pts, in the encoder time base
+ */
+void trace_set_pts(int64_t pts) {
+    current_pts = pts;
+}
+
+/*
+ * trace_event adds a call of this thread that ran from
+ * start_ns to end_ns on the monotonic clock
+ */
+void trace_event(const char *name, int64_t start_ns, int64_t end_ns) {
+    const char *sep = "";
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_enabled) {
+        /* the trace was closed while this thread ran */
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    begin_event();
+    fprintf(trace_file, "{\"name\": \"%s\", \"cat\": \"render\", "
+            "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+            "\"pid\": %ld, \"tid\": %ld, \"args\": {",
+            name, (double)(start_ns - trace_start) / NS_PER_US,
+            (double)(end_ns - start_ns) / NS_PER_US,
+            (long)getpid(), thread_id());
+    if (current_shot >= 0) {
+        fprintf(trace_file, "%s\"shot\": %d", sep, current_shot);
+        sep = ", ";
+    }
+    if (current_file) {
+        fprintf(trace_file, "%s\"file\": ", sep);
+        put_string(current_file);
+        sep = ", ";
+    }
+    if (current_pts != AV_NOPTS_VALUE) {
+        fprintf(trace_file, "%s\"pts\": %"PRId64, sep, current_pts);
+    }
+    fputs("}}", trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
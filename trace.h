@@ -0,0 +1,28 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * A trace records every timed call of the run statistics,
+ * see stats.h, as one complete event in the Chrome trace
+ * event format, which chrome://tracing and Perfetto load.
+ * Events carry the thread they ran on and the screenshot
+ * and pts the thread was working on, set with
+ * trace_set_screenshot and trace_set_pts. Without --trace
+ * none of this runs.
+ */
+
+extern int trace_enabled;
+
+int trace_open(const char *filename);
+
+void trace_thread_name(const char *format, int n);
+
+void trace_set_screenshot(int index, const char *filepath);
+
+void trace_set_pts(int64_t pts);
+
+void trace_event(const char *name, int64_t start_ns, int64_t end_ns);
+
+#endif
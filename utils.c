@@ -1,5 +1,8 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <libavutil/frame.h>
 #include <libswscale/swscale.h>
@@ -14,6 +17,7 @@
 #define TOUCH_DATA_FILE "touch.json"
 #define VIDEO_FOLDER "Screen"
 #define TOUCH_FOLDER "Touch"
+#define INDEX_FILE "cruncher.idx"
 
 /*
  * get_video_json_filename returns the filename
@@ -72,126 +76,215 @@ char * get_touch_json_file(char *base) {
 }
 
 /*
- * picture_to_frame reads and decodes
- * the picture file
- *
- * side effects: allocates an AVFrame which
- * must be freed with av_free_frame
+ * get_index_filename returns the filename of the
+ * compiled session index, kept in the session folder
  */
-FFMPEG_tmp * picture_to_frame(char *filepath) {
-
-    AVFormatContext *fctx = NULL;
-    int              stream_no;
-    AVCodecContext  *cctx = NULL;
-    AVCodec         *c = NULL;
-    AVFrame         *frame = NULL;
-
-    FFMPEG_tmp      *tmp = malloc(sizeof(FFMPEG_tmp));
+char * get_index_filename(char *base) {
+    char *filename;
 
-    fctx = get_fcontext(filepath);
-    if (fctx == NULL) {
-        fprintf(stderr, "Fatal: could not open %s\n", filepath);
-        avformat_close_input(&fctx);
+    asprintf(&filename, "%s/%s", base, INDEX_FILE);
+    if (!filename) {
+        fprintf(stderr, "Fatal: error in asprintf\n");
         exit(1);
     }
 
-    stream_no = get_video_stream(fctx);
-    if (stream_no == -1) {
-        fprintf(stderr, "Fatal: could not find video stream\n");
-        avformat_close_input(&fctx);
-        exit(1);
+    return filename;
+}
+
+/* the other members of the video json that are read */
+typedef struct VideoMembers {
+    RawFormat *raw;
+    int        error;
+} VideoMembers;
+
+static void video_member(const char *key, json_t *value, void *opaque) {
+    VideoMembers *members = opaque;
+
+    if (strcmp(key, RAWFB_JSON_KEY) == 0 && members->raw &&
+        rawfb_parse_json(value, members->raw) != 0) {
+        members->error = 1;
     }
+}
 
-    cctx = get_ccontext(fctx, stream_no);
-    if (cctx == NULL) {
-        fprintf(stderr, "Fatal: no codec context initialized\n");
-        avcodec_close(cctx);
-        avformat_close_input(&fctx);
-        exit(1);
+/*
+ * load_screenshots streams the timestamps array of the
+ * video json file into the list of screenshots to write,
+ * each with its full path and the interval until the
+ * next screenshot, without keeping the json in memory
+ *
+ * the last timestamp only marks the end of the session,
+ * so count is one less than the array size. base_time is
+ * set to the time of the first timestamp. If the file
+ * describes raw framebuffer screenshots, raw is set to
+ * their format, and otherwise left alone.
+ *
+ * returns NULL if the file is missing, malformed or
+ * has less than two timestamps
+ *
+ * side effects: allocates a Screenshot array which
+ * must be freed with free_screenshots
+ */
+Screenshot * load_screenshots(char *video_json_filename, char *video_folder,
+                              int *count, long *base_time, RawFormat *raw) {
+    JsonStream   *js;
+    Screenshot   *shots, *shot;
+    VideoMembers  members;
+    json_t       *data;
+    int           n, size;
+    long          time;
+
+    members.raw = raw;
+    members.error = 0;
+    js = json_stream_open(video_json_filename, "timestamps", video_member,
+                          &members);
+    if (!js) {
+        return NULL;
+    }
+    if (!js->found) {
+        fprintf(stderr, "error: timestamps is not an array\n");
+        json_stream_close(js);
+        return NULL;
     }
 
-    c = get_codec(cctx);
-    if (c == NULL) {
-        fprintf(stderr, "Fatal: could not open codec\n");
-        avcodec_close(cctx);
-        avformat_close_input(&fctx);
+    n = 0;
+    size = 256;
+    shots = malloc(size * sizeof(Screenshot));
+    if (!shots) {
+        fprintf(stderr, "Fatal: could not allocate screenshot list\n");
         exit(1);
     }
 
-    frame = decode_picture(fctx, stream_no, cctx);
-    if (frame == NULL) {
-        avcodec_close(cctx);
-        avformat_close_input(&fctx);
-        fprintf(stderr, "Fatal: could not decode image\n");
-        exit(1);
+    while ((data = json_stream_next(js)) != NULL) {
+        time = json_integer_value(json_object_get(data, "time"));
+
+        /* interval is timestamp difference */
+        if (n > 0) {
+            shots[n-1].interval = time - shots[n-1].time;
+        }
+
+        if (n == size) {
+            size *= 2;
+            shots = realloc(shots, size * sizeof(Screenshot));
+            if (!shots) {
+                fprintf(stderr, "Fatal: could not allocate screenshot list\n");
+                exit(1);
+            }
+        }
+
+        shot = &shots[n++];
+        shot->time = time;
+        shot->interval = 0;
+        if (asprintf(&shot->filepath, "%s/%s", video_folder,
+                     json_string_value(json_object_get(data, "name"))) < 0) {
+            fprintf(stderr, "Fatal: asprintf failure\n");
+            exit(1);
+        }
+
+        json_decref(data);
+    }
+    if (js->error || members.error || n < 2) {
+        if (!js->error && !members.error) {
+            fprintf(stderr, "Error: %s needs at least two timestamps\n",
+                    video_json_filename);
+        }
+        json_stream_close(js);
+        free_screenshots(shots, n);
+        return NULL;
     }
+    json_stream_close(js);
 
-    /* clean up successful run */
-    tmp->frame = frame;
-    tmp->fctx = fctx;
-    tmp->cctx = cctx;
-    tmp->c = c;
+    *base_time = shots[0].time;
 
-    return tmp;
+    /* the end marker is not a screenshot */
+    free(shots[n-1].filepath);
+    *count = n - 1;
+    return shots;
 }
 
-void tmp_free(FFMPEG_tmp *tmp) {
-    /*av_freep(&tmp->frame->data[0]);*/
-    /* TODO: for some reason av_freep
-     * screws up av_codec_close */
-    avcodec_close(tmp->cctx);
-    av_frame_free(&tmp->frame);
-    avformat_close_input(&tmp->fctx);
-    free(tmp);
-}
+void free_screenshots(Screenshot *shots, int count) {
+    int i;
 
-const char * get_first_picture(json_t *timestamps) {
-    json_t *data;
-    json_t *name;
+    for (i = 0; i < count; i++) {
+        free(shots[i].filepath);
+    }
+    free(shots);
+}
 
-    data = json_array_get(timestamps, 0);
-    name = json_object_get(data, "name");
+/*
+ * lock_manager lets libavcodec serialize codec
+ * opening and closing, which the decode workers
+ * and segment encoders do concurrently
+ */
+static int lock_manager(void **mutex, enum AVLockOp op) {
+    pthread_mutex_t *m = *mutex;
+
+    switch (op) {
+    case AV_LOCK_CREATE:
+        m = malloc(sizeof(pthread_mutex_t));
+        if (!m || pthread_mutex_init(m, NULL) != 0) {
+            free(m);
+            return 1;
+        }
+        *mutex = m;
+        return 0;
+    case AV_LOCK_OBTAIN:
+        return pthread_mutex_lock(m) != 0;
+    case AV_LOCK_RELEASE:
+        return pthread_mutex_unlock(m) != 0;
+    case AV_LOCK_DESTROY:
+        pthread_mutex_destroy(m);
+        free(m);
+        *mutex = NULL;
+        return 0;
+    }
 
-    return json_string_value(name);
+    return 1;
 }
 
-long get_base_time(json_t *timestamps) {
-    json_t *base_data;
-    json_t *base;
+static pthread_once_t lock_manager_once = PTHREAD_ONCE_INIT;
 
-    base_data = json_array_get(timestamps, 0);
-    base = json_object_get(base_data, "time");
-    return json_integer_value(base);
+static void install_lock_manager(void) {
+    if (av_lockmgr_register(lock_manager) < 0) {
+        fprintf(stderr, "Fatal: could not register codec lock manager\n");
+        exit(1);
+    }
 }
 
-/* handle_screenshots appends the screenshot to the video buffer */
-int handle_screenshot(AVFormatContext *oc, AVStream *st,
-                      struct SwsContext *s_ctx, int frame_count,
-                      long time_interval, char* filepath, TouchActualizer *ta,
-                      int fps, long base_time) {
+/*
+ * register_lock_manager installs the codec lock manager,
+ * must be called before codecs are opened on several threads
+ */
+void register_lock_manager(void) {
+    pthread_once(&lock_manager_once, install_lock_manager);
+}
 
-    FFMPEG_tmp *tmp;
-    AVFrame *in_frame;
+/*
+ * handle_screenshot appends the decoded screenshot to the video buffer
+ *
+ * returns the number of frames written
+ *
+ * side effects: frees in_frame
+ */
+int handle_screenshot(VideoOutput *vo, Screenshot *shot, AVFrame *in_frame) {
 
-    tmp = picture_to_frame(filepath);
-    in_frame = tmp->frame;
+    int      frames;
 
     #ifdef DEBUG_FRAME
-    printf("Begin writing picture\nCurrent frame: %d\n", frame_count);
+    printf("Begin writing picture\nCurrent frame: %"PRId64"\n", vo->pts);
     #endif
 
-    frame_count = write_frame(oc, st, s_ctx, in_frame, ta,
-            fps, frame_count, time_interval, base_time);
-    tmp_free(tmp);
+    frames = write_frame(vo, in_frame, shot->time, shot->interval);
+    av_frame_free(&in_frame);
 
     #ifdef DEBUG_FRAME
-    printf("End writing picture\nCurrent frame: %d\n", frame_count);
+    printf("End writing picture\nCurrent frame: %"PRId64"\n", vo->pts);
     #endif
 
     #ifdef DEBUG_FRAME
-    printf("Read file %s and wrote interval %ld\n", filepath, time_interval);
-    printf("Written %d frames\n", interval_to_frames(time_interval, 25));
+    printf("Read file %s and wrote interval %ld\n", shot->filepath,
+           shot->interval);
+    printf("Written %d frames\n", frames);
     #endif
 
-    return frame_count;
+    return frames;
 }
@@ -2,34 +2,33 @@
 #define _UTILS_H_
 
 #include <libavutil/frame.h>
+#include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <jansson.h>
 
-typedef struct FFMPEG_tmp {
-    AVFrame *frame;
-    AVFormatContext *fctx;
-    AVCodecContext  *cctx;
-    AVCodec         *c;
-} FFMPEG_tmp;
+#include "actualizer.h"
+#include "rawfb.h"
+#include "video.h"
+
+typedef struct Screenshot {
+    char *filepath;
+    long  time;
+    long  interval; /* time until the next screenshot */
+} Screenshot;
 
 char * get_video_json_filename(char *base);
 char * get_video_folder(char *base);
 char * get_touch_folder(char *base);
 char * get_touch_json_file(char *base);
+char * get_index_filename(char *base);
 
-FFMPEG_tmp * picture_to_frame(char *filepath);
-
-AVFrame * copy_frame(AVFrame *frame);
-
-void tmp_free(FFMPEG_tmp *tmp);
+Screenshot * load_screenshots(char *video_json_filename, char *video_folder,
+                              int *count, long *base_time, RawFormat *raw);
 
-const char * get_first_picture(json_t *timestamps);
+void free_screenshots(Screenshot *shots, int count);
 
-long get_base_time(json_t *timestamps);
+void register_lock_manager(void);
 
-int handle_screenshot(AVFormatContext *oc, AVStream *st,
-                      struct SwsContext *s_ctx, int frame_count,
-                      long time_interval, char* filepath, TouchActualizer *ta,
-                      int fps, long base_time);
+int handle_screenshot(VideoOutput *vo, Screenshot *shot, AVFrame *in_frame);
 
 #endif
@@ -1,15 +1,25 @@
 #include "video.h"
 #include "actualizer.h"
+#include "profile.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/opt.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/timestamp.h>
 #include <libswscale/swscale.h>
 
-#define CRF "23" /* real quality setting for H264 */
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRIP_QUANT  64 /* strip heights are rounded up to this */
 
 /*
  * interval_to_frames returns the number of
@@ -61,6 +71,8 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
  */
 int write_packet(AVFormatContext *fmt_ctx, const AVRational *time_base,
                 AVStream *st, AVPacket *pkt) {
+    StatsSpan span;
+    int       ret;
 
     /* rescale output packet timestamp values from codec to stream timebase */
     pkt->pts = av_rescale_q_rnd(pkt->pts, *time_base, st->time_base,
@@ -75,7 +87,13 @@ int write_packet(AVFormatContext *fmt_ctx, const AVRational *time_base,
     #endif
 
     /* Write the compressed frame to the media file */
-    return av_interleaved_write_frame(fmt_ctx, pkt);
+    trace_set_pts(pkt->pts);
+    stats_begin(&span);
+    stats_add_bytes(pkt->size);
+    ret = av_interleaved_write_frame(fmt_ctx, pkt);
+    stats_end(&span, STATS_WRITE);
+
+    return ret;
 }
 
 /*
@@ -140,106 +158,57 @@ AVCodecContext * get_ccontext(AVFormatContext *fctx, int stream_no) {
 }
 
 /*
- * get_codec finds and opens the the
- * codec for the codec context
+ * open_output allocates the output context for the file
+ * and opens the file, unless the muxer opens its own files.
+ * The header is not written yet. The format is deduced from
+ * the file name if not given.
  *
- * returns NULL if a codec could not be found
- * or could not be initialized
- * returns a valid pointer otherwise
- *
- * side effects: allocs and AVCodec if successful
- * parameter AVCodecContext a must be
- * freed with avcodec_close(a)
+ * returns NULL if the file can't be opened
  */
-AVCodec * get_codec(AVCodecContext *cctx) {
-    AVCodec *c = NULL;
-    int ret = 0;
-
-    /* find the codec associated with the data stream */
-    c = avcodec_find_decoder(cctx->codec_id);
-    if (c == NULL) {
+AVFormatContext * open_output(const char *dst_filename, const char *format) {
+    AVFormatContext *oc;
+    int              ret;
+
+    avformat_alloc_output_context2(&oc, NULL, format, dst_filename);
+    if (!oc) {
+        fprintf(stderr, "Error: could not deduce output format of '%s'\n",
+                dst_filename);
         return NULL;
     }
 
-    ret = avcodec_open2(cctx, c, NULL);
+    /* muxers such as hls open their own files */
+    if (oc->oformat->flags & AVFMT_NOFILE) {
+        return oc;
+    }
+
+    ret = avio_open(&oc->pb, dst_filename, AVIO_FLAG_WRITE);
     if (ret < 0) {
+        fprintf(stderr, "Error: could not open '%s': %s\n", dst_filename,
+                av_err2str(ret));
+        avformat_free_context(oc);
         return NULL;
     }
 
-    return c;
+    return oc;
 }
 
-/*
- * decode_picture returns a decoded picture in
- * the form of an AVFrame pointer
- * It should work for all common formats
- *
- * returns NULL if the picture could not be decoded
- *
- * side effects: allocs AVFrame a if successful
- * must be freed with av_free
- */
-AVFrame * decode_picture(AVFormatContext * fctx, int stream_no,
-                     AVCodecContext *cctx) {
-
-    int got_frame = 0;
-    int ret1 = 1;
-    int ret2 = 0;
-
-    AVFrame *frame = NULL;
-    AVPacket pkt;
-
-    /* allocate memory for the image frame */
-    frame = av_frame_alloc();
-
-    /* read frames (bits of the file) and try to decode the image */
-    while(ret1 >= 0) {
-        /* read one frame from the input file */
-        ret1 = av_read_frame(fctx, &pkt);
-
-        /* frame must be in desired file stream */
-        if (pkt.stream_index != stream_no) {
-            av_free_packet(&pkt);
-            continue;
-        }
-
-        ret2 = avcodec_decode_video2(cctx, frame, &got_frame, &pkt);
-        if (ret2 < 0) {
-            /* can not decode frame, possible image corruption */
-            return NULL;
-        }
-
-        /* end looping */
-        if (got_frame) {
-            ret1 = -1;
-        }
-
-        av_free_packet(&pkt);
-    }
-
-    if (got_frame) {
-        return frame;
-    }
-
-    /* check for cached frames,
-     * for some reason ffmpeg
-     * sometimes saves frames internally */
-    pkt.data = NULL;
-    pkt.size = 0;
+int write_header(AVFormatContext *oc, AVDictionary **options) {
+    int ret;
 
-    ret2 = avcodec_decode_video2(cctx, frame, &got_frame, &pkt);
-    if (ret2 < 0) {
-        /* can not decode frame, possible image corruption */
-        return NULL;
+    ret = avformat_write_header(oc, options);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n",
+                av_err2str(ret));
+        return -1;
     }
+    return 0;
+}
 
-    if (got_frame) {
-        return frame;
+void close_output(AVFormatContext *oc) {
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+        avio_close(oc->pb);
     }
-
-    /* could not decode whole image */
-    av_frame_free(&frame);
-    return NULL;
+    avformat_free_context(oc);
 }
 
 /*
@@ -269,27 +238,135 @@ struct SwsContext * get_scale_ctx(int in_w, int in_h,
     return sws_ctx;
 }
 
+/*
+ * find_encoder looks the encoder up by encoder name,
+ * then by the name of the codec
+ *
+ * returns NULL if there is no such encoder
+ */
+static AVCodec * find_encoder(const char *name) {
+    const AVCodecDescriptor *desc;
+    AVCodec                 *codec;
+
+    codec = avcodec_find_encoder_by_name(name);
+    if (!codec) {
+        desc = avcodec_descriptor_get_by_name(name);
+        if (desc) {
+            codec = avcodec_find_encoder(desc->id);
+        }
+    }
+
+    return codec;
+}
+
+/*
+ * set_encoder_option sets an option private to the encoder,
+ * the profile may name options that other encoders lack
+ *
+ * returns 0 if the encoder does not have the option
+ */
+static int set_encoder_option(AVCodecContext *c, const char *name,
+                              const char *value) {
+    if (av_opt_set(c->priv_data, name, value, 0) < 0) {
+        fprintf(stderr, "Warning: encoder %s does not support %s=%s\n",
+                c->codec->name, name, value);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * get_encoder returns the encoder of the profile,
+ * NULL if there is none
+ */
+AVCodec * get_encoder(const EncoderProfile *profile) {
+    AVCodec *codec;
+
+    codec = find_encoder(profile->codec);
+    if (!codec) {
+        fprintf(stderr, "Error: could not find encoder for '%s'\n",
+                profile->codec);
+    }
+
+    return codec;
+}
+
+/*
+ * set_encoder_params configures an encoder context that is
+ * not opened yet from the profile
+ */
+void set_encoder_params(AVCodecContext *c, const EncoderProfile *profile,
+                        int width, int height, AVRational time_base) {
+    char value[32];
+
+    /* assumes that the stream is a video stream */
+    c->codec_id = c->codec->id;
+
+    c->bit_rate = profile->bit_rate;
+    /* Resolution must be a multiple of two. */
+    c->width    = width;
+    c->height   = height;
+    /* timebase: This is the fundamental unit of time (in seconds) in terms
+     * of which frame timestamps are represented. For fixed-fps content,
+     * timebase should be 1/framerate and timestamp increments should be
+     * identical to 1. Variable frame rate output uses millisecs. */
+    c->time_base = time_base;
+    /* max frames between intra frames, screenshots rarely
+     * change so long GOPs are cheap */
+    if (profile->gop_size >= 0) {
+        c->gop_size = profile->gop_size;
+    }
+    c->pix_fmt       = profile->pix_fmt;
+
+    /* frame threads encode several frames at once, at the cost
+     * of as many frames of delay, slice threads split frames */
+    c->thread_type  = profile->thread_type;
+    c->thread_count = profile->threads;
+
+    if (profile->preset[0]) {
+        set_encoder_option(c, "preset", profile->preset);
+    }
+    if (profile->tune[0]) {
+        set_encoder_option(c, "tune", profile->tune);
+    }
+    if (c->codec_id == AV_CODEC_ID_H264) {
+        av_opt_set(c->priv_data, "log-level", "none", 0);
+    }
+    if (profile->crf >= 0) {
+        /* set this instead of bit rate where the encoder
+         * supports it, the codec will figure out a good
+         * bitrate itself */
+        snprintf(value, sizeof(value), "%d", profile->crf);
+        if (set_encoder_option(c, "crf", value)) {
+            c->bit_rate = 0;
+        }
+    }
+    if (profile->lookahead >= 0) {
+        snprintf(value, sizeof(value), "%d", profile->lookahead);
+        set_encoder_option(c, "rc-lookahead", value);
+    }
+}
+
 /*
  * add_video_stream allocates and returns a new video stream,
- * associated with the output context and the video codec
+ * associated with the output context and the encoder of the
+ * profile, which also supplies the encoder settings
+ *
+ * returns NULL if the profile has no encoder
  *
  * side effects: "User is required to call avcodec_close() [on *oc]
  * and avformat_free_context() [on *codec] to clean up the allocation by
  * avformat_new_stream()" <-- from FFMPEG documentation
  */
 AVStream * add_video_stream(AVFormatContext *oc, AVCodec **codec,
-                            enum AVCodecID codec_id,
-                            int bit_rate, int width, int height,
-                            int fps, int pix_fmt) {
-    AVCodecContext *c;
+                            const EncoderProfile *profile,
+                            int width, int height, AVRational time_base) {
     AVStream *st;
 
     /* find the encoder */
-    *codec = avcodec_find_encoder(codec_id);
-    if (!(*codec)) {
-        fprintf(stderr, "Could not find encoder for '%s'\n",
-                avcodec_get_name(codec_id));
-        exit(1);
+    *codec = get_encoder(profile);
+    if (!*codec) {
+        return NULL;
     }
 
     st = avformat_new_stream(oc, *codec);
@@ -298,45 +375,12 @@ AVStream * add_video_stream(AVFormatContext *oc, AVCodec **codec,
         exit(1);
     }
     st->id = oc->nb_streams-1;
-    c = st->codec;
 
-    /* assumes that the stream is a video stream */
-
-    /* TODO: explore multithread */
-    c->codec_id = codec_id;
-
-    c->bit_rate = bit_rate;
-    /* Resolution must be a multiple of two. */
-    c->width    = width;
-    c->height   = height;
-    /* timebase: This is the fundamental unit of time (in seconds) in terms
-     * of which frame timestamps are represented. For fixed-fps content,
-     * timebase should be 1/framerate and timestamp increments should be
-     * identical to 1. */
-    c->time_base.den = fps;
-    c->time_base.num = 1;
-    /* emit one intra frame every twelve frames at most
-     * TODO: explore gop_size */
-    c->gop_size      = 20; /* Tune this for every changing screenshot */
-    c->pix_fmt       = pix_fmt;
-
-    /* H264 specific settings
-     * TODO: tune this, can result in a major performance boost*/
-    if (codec_id == AV_CODEC_ID_H264) {
-        /* TODO: correct way to set several options? */
-        av_opt_set(c->priv_data, "preset", "ultrafast", 0);
-        av_opt_set(c->priv_data, "tune", "animation", 0);
-        av_opt_set(c->priv_data, "log-level", "none", 0);
-        /* set this instead of bit rate for H264
-         * the codec will figure out a good bitrate
-         * itself */
-        c->bit_rate = 0;
-        av_opt_set(c->priv_data, "crf", CRF, 0);
-    }
+    set_encoder_params(st->codec, profile, width, height, time_base);
 
     /* Some formats want stream headers to be separate. */
     if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
     return st;
 }
@@ -345,6 +389,9 @@ AVStream * add_video_stream(AVFormatContext *oc, AVCodec **codec,
  * alloc_frame allocates a frame with the specified
  * width, height and pixel format
  *
+ * the image buffer is reference counted, so the
+ * frame can be shared with av_frame_ref
+ *
  * side effects: allocates an AVFrame, must be freed with
  * av_frame_free
  */
@@ -363,8 +410,7 @@ AVFrame * alloc_frame(int width, int height, int pix_fmt) {
     out_frame->format = pix_fmt;
 
     /* allocate the frame with 32 bit alignment */
-    if ((ret = av_image_alloc(out_frame->data, out_frame->linesize,
-                              width, height, pix_fmt, 32)) < 0) {
+    if ((ret = av_frame_get_buffer(out_frame, 32)) < 0) {
         fprintf(stderr, "Could not allocate destination image\n");
         exit(1);
     }
@@ -373,119 +419,1108 @@ AVFrame * alloc_frame(int width, int height, int pix_fmt) {
 }
 
 /*
- * write_frame appends the supplied frame to the destination video
- * file at the specified interval
+ * yuv_format describes the output format in yuv, for drawing
+ * touches after conversion
+ *
+ * returns 1 for 8 bit planar YUV without alpha, 0 for the
+ * formats touches are drawn into before conversion
+ */
+static int yuv_format(int width, int height, int pix_fmt, YUVFrame *yuv) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+
+    /* the size is also used for the touch boxes of other formats */
+    yuv->width = width;
+    yuv->higth = height;
+    yuv->chroma_w_shift = desc->log2_chroma_w;
+    yuv->chroma_h_shift = desc->log2_chroma_h;
+
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV444P:
+        yuv->full_range = 0;
+        break;
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUVJ444P:
+        yuv->full_range = 1;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * init_strips finds out if sc converts without scaling, so
+ * that rows can be converted on their own, and then enables
+ * converting strips of rows on touch changes when touches
+ * are drawn before conversion
  */
-int write_frame(AVFormatContext *oc, AVStream *st,
-                struct SwsContext *sc, AVFrame *in_frame, TouchActualizer *ta,
-                int fps, int pts, long interval, long base) {
+static void init_strips(VideoOutput *vo) {
+    int64_t src_w, src_h, src_format, flags;
+
+    vo->unscaled = 0;
+    vo->strips = 0;
+    vo->strip_sc = NULL;
+    vo->strip_frame = NULL;
+
+    if (!vo->sc ||
+        av_opt_get_int(vo->sc, "srcw", 0, &src_w) < 0 ||
+        av_opt_get_int(vo->sc, "srch", 0, &src_h) < 0 ||
+        av_opt_get_int(vo->sc, "src_format", 0, &src_format) < 0 ||
+        av_opt_get_int(vo->sc, "sws_flags", 0, &flags) < 0) {
+        return;
+    }
+    if (src_w != vo->enc->width || src_h != vo->enc->height) {
+        return;
+    }
 
-    AVCodecContext *c_ctx = st->codec;
+    vo->unscaled = 1;
+    vo->strips = !vo->yuv_overlay;
+    vo->in_pix_fmt = (int)src_format;
+    vo->scale_flags = (int)flags;
+}
 
-    int      i, ret, got_output;
-    int      frames, n_pts;
-    long     time_end;
-    /*long     time_start;*/
-    AVPacket pkt;
-    AVFrame *out_frame;
-    Frame   *frame_data;
+/*
+ * init_converter sets up the SIMD converter in place of sc
+ * when sc converts RGBA or alike to limited range YUV420P of
+ * the same size, with the fast bilinear scaler and the BT.601
+ * or BT.709 matrix, and leaves it NULL otherwise. The bilinear
+ * scaler filters chroma over more rows, so its output is left
+ * to swscale. Until its output and speed have been measured
+ * against swscale it is only used in builds with USE_YUVCONV.
+ */
+static void init_converter(VideoOutput *vo) {
+    int64_t  src_w, src_h, src_format, flags;
+    int     *inv_table, *table;
+    int      src_range, dst_range, brightness, contrast, saturation;
+    int      colorspace;
 
-    frames = interval_to_frames(interval, fps);
-    frame_data = Frame_new(in_frame->data[0], in_frame->linesize[0],
-                in_frame->width, in_frame->height, 0);
+    vo->conv = NULL;
+
+#ifndef USE_YUVCONV
+    return;
+#endif
+    if (!vo->sc ||
+        av_opt_get_int(vo->sc, "srcw", 0, &src_w) < 0 ||
+        av_opt_get_int(vo->sc, "srch", 0, &src_h) < 0 ||
+        av_opt_get_int(vo->sc, "src_format", 0, &src_format) < 0 ||
+        av_opt_get_int(vo->sc, "sws_flags", 0, &flags) < 0 ||
+        sws_getColorspaceDetails(vo->sc, &inv_table, &src_range,
+                                 &table, &dst_range, &brightness,
+                                 &contrast, &saturation) < 0) {
+        return;
+    }
+    if (flags != SWS_FAST_BILINEAR || dst_range || brightness != 0 || contrast != 1 << 16 ||
+        saturation != 1 << 16) {
+        return;
+    }
+
+    if (!memcmp(table, sws_getCoefficients(SWS_CS_ITU709),
+                4 * sizeof(int))) {
+        colorspace = YUV_BT709;
+    } else if (!memcmp(table, sws_getCoefficients(SWS_CS_ITU601),
+                       4 * sizeof(int))) {
+        colorspace = YUV_BT601;
+    } else {
+        return;
+    }
+
+    vo->conv = yuv_converter_new((int)src_w, (int)src_h, (int)src_format,
+                                 vo->enc->width, vo->enc->height,
+                                 vo->enc->pix_fmt, colorspace,
+                                 YUV_KERNEL_AUTO);
+}
+
+/*
+ * output_new allocates a VideoOutput sending frames to the
+ * encoder enc, the packets go to oc or else to spool
+ */
+static VideoOutput * output_new(AVCodecContext *enc,
+                                AVFormatContext *oc, AVStream *st,
+                                FILE *spool, struct SwsContext *sc,
+                                TouchActualizer *ta, int fps, int vfr,
+                                long base) {
+    VideoOutput *vo;
+
+    vo = malloc(sizeof(VideoOutput));
+    if (vo) {
+        vo->hold_frame = av_frame_alloc();
+        vo->send_frame = av_frame_alloc();
+        vo->clean_frame = av_frame_alloc();
+    }
+    if (!vo || !vo->hold_frame || !vo->send_frame || !vo->clean_frame) {
+        fprintf(stderr, "Fatal: Could not allocate video output\n");
+        exit(1);
+    }
+
+    vo->enc = enc;
+    vo->oc = oc;
+    vo->st = st;
+    vo->spool = spool;
+    vo->sc = sc;
+    vo->ta = ta;
+    vo->fps = fps;
+    vo->vfr = vfr;
+    vo->base = base;
+    vo->pts = 0;
+    vo->error = 0;
+    vo->pool = frame_pool_new(enc->width, enc->height, enc->pix_fmt);
+
+    vo->key_interval = 0;
+    vo->next_key_pts = 0;
+
+    vo->pending = NULL;
+    vo->n_pending = 0;
+    vo->pending_size = 0;
+
+    vo->dedup = 0;
+    vo->dedup_ignore = NULL;
+    vo->n_dedup_ignore = 0;
+    vo->have_hash = 0;
+    vo->conversions_skipped = 0;
+
+    vo->yuv_overlay = yuv_format(enc->width, enc->height, enc->pix_fmt,
+                                 &vo->yuv);
+    vo->drawn = NULL;
+    vo->n_drawn = 0;
+    vo->boxes = NULL;
+    vo->boxes_size = 0;
+    init_strips(vo);
+    init_converter(vo);
+    vo->slices = NULL;
+    vo->bands = NULL;
+    vo->n_bands = 0;
+
+    return vo;
+}
+
+/*
+ * video_output_new bundles the output stream with the
+ * scaling and touch drawing contexts used to fill it
+ *
+ * side effects: allocates a VideoOutput which must be
+ * freed with video_output_free, the contexts themselves
+ * are still owned by the caller
+ */
+VideoOutput * video_output_new(AVFormatContext *oc, AVStream *st,
+                               struct SwsContext *sc, TouchActualizer *ta,
+                               int fps, int vfr, long base) {
+    return output_new(st->codec, oc, st, NULL, sc, ta, fps, vfr, base);
+}
+
+/*
+ * video_output_new_spool allocates a VideoOutput that writes
+ * the packets of the opened encoder enc to the spool file
+ * instead of a container, with timestamps in the encoder
+ * time base
+ *
+ * side effects: allocates a VideoOutput which must be
+ * freed with video_output_free, the encoder and the
+ * spool are still owned by the caller
+ */
+VideoOutput * video_output_new_spool(AVCodecContext *enc, FILE *spool,
+                                     struct SwsContext *sc,
+                                     TouchActualizer *ta,
+                                     int fps, int vfr, long base) {
+    return output_new(enc, NULL, NULL, spool, sc, ta, fps, vfr, base);
+}
+
+void video_output_free(VideoOutput *vo) {
+    int i;
+
+    av_frame_free(&vo->hold_frame);
+    av_frame_free(&vo->send_frame);
+    av_frame_free(&vo->clean_frame);
+    frame_pool_free(vo->pool);
+    free(vo->drawn);
+    free(vo->boxes);
+    sws_freeContext(vo->strip_sc);
+    av_frame_free(&vo->strip_frame);
+    yuv_converter_free(vo->conv);
+    if (vo->slices) {
+        slice_pool_free(vo->slices);
+    }
+    for (i = 0; i < vo->n_bands; i++) {
+        sws_freeContext(vo->bands[i].sc);
+        av_frame_free(&vo->bands[i].frame);
+    }
+    free(vo->bands);
+    free(vo->pending);
+    free(vo);
+}
+
+/*
+ * init_bands splits the frame into n bands of whole
+ * macroblock rows, each converted from STRIP_MARGIN more rows
+ * on either side by its own context, see strip_window
+ */
+static void init_bands(VideoOutput *vo, int n) {
+    ScaleBand *band;
+    int        width = vo->enc->width, height = vo->enc->height;
+    int        n_mbs = (height + STRIP_ALIGN - 1) / STRIP_ALIGN;
+    int        i, bottom;
+
+    vo->bands = calloc(n, sizeof(ScaleBand));
+    if (!vo->bands) {
+        fprintf(stderr, "Fatal: Could not allocate scaling bands\n");
+        exit(1);
+    }
+    vo->n_bands = n;
+
+    for (i = 0; i < n; i++) {
+        band = &vo->bands[i];
+        band->first = n_mbs * i / n * STRIP_ALIGN;
+        band->end = n_mbs * (i + 1) / n * STRIP_ALIGN;
+        if (band->end > height) band->end = height;
+        if (band->first >= band->end) {
+            continue;
+        }
+
+        band->top = band->first - STRIP_MARGIN;
+        if (band->top < 0) band->top = 0;
+        bottom = band->end + STRIP_MARGIN;
+        if (bottom > height) bottom = height;
+        band->rows = bottom - band->top;
+
+        band->sc = sws_getContext(width, band->rows, vo->in_pix_fmt,
+                                  width, band->rows, vo->enc->pix_fmt,
+                                  vo->scale_flags, NULL, NULL, NULL);
+        if (!band->sc) {
+            fprintf(stderr, "Fatal: Could not allocate scaling context\n");
+            exit(1);
+        }
+        band->frame = alloc_frame(width, band->rows, vo->enc->pix_fmt);
+    }
+}
+
+/*
+ * video_output_set_convert_threads converts each frame in
+ * n_threads bands of rows at once, on the calling thread and
+ * n_threads - 1 pool threads. The SIMD converter splits its
+ * rows as they are, a swscale conversion that does not scale
+ * gets one context per band, and the frame comes out the same
+ * either way. Conversions that scale stay on the calling
+ * thread.
+ */
+void video_output_set_convert_threads(VideoOutput *vo, int n_threads) {
+    if (vo->slices || n_threads < 2) {
+        return;
+    }
+    if (!vo->conv && !vo->unscaled) {
+        fprintf(stderr, "Warning: the conversion scales the screenshots, "
+                "it is not split into bands\n");
+        return;
+    }
+    if (!vo->conv) {
+        init_bands(vo, n_threads);
+    }
+    vo->slices = slice_pool_new(n_threads - 1);
+}
+
+/*
+ * video_output_set_dedup keeps the converted frame of a
+ * screenshot for the next one if their pixels are the same,
+ * outside of the ignore regions, which must outlive vo
+ */
+void video_output_set_dedup(VideoOutput *vo, const DedupRegion *ignore,
+                            int n_ignore) {
+    vo->dedup = 1;
+    vo->dedup_ignore = ignore;
+    vo->n_dedup_ignore = n_ignore;
+    vo->have_hash = 0;
+}
+
+/*
+ * video_output_set_keyframe_interval forces a keyframe on the
+ * first frame that starts interval millisecs or more after the
+ * last forced one. Variable frame rate output has as many
+ * frames as changes, so a GOP of frames has no bound in time.
+ */
+void video_output_set_keyframe_interval(VideoOutput *vo, long interval) {
+    vo->key_interval = vo->vfr ? interval : interval * vo->fps / 1000;
+    if (vo->key_interval < 1) vo->key_interval = 1;
+    vo->next_key_pts = vo->pts;
+}
+
+/*
+ * same_pixels tells if in_frame shows the same picture as
+ * the screenshot before it, and remembers its hash
+ */
+static int same_pixels(VideoOutput *vo, const AVFrame *in_frame) {
+    uint8_t hash[DEDUP_HASH_SIZE];
+    int     same;
+
+    dedup_hash_pixels(in_frame, vo->dedup_ignore, vo->n_dedup_ignore, hash);
+    same = vo->have_hash && memcmp(hash, vo->last_hash, DEDUP_HASH_SIZE) == 0;
+
+    memcpy(vo->last_hash, hash, DEDUP_HASH_SIZE);
+    vo->have_hash = 1;
+    return same;
+}
+
+/*
+ * push_duration remembers the duration of a frame until
+ * the encoder hands back its packet, which may be several
+ * frames later and out of order
+ */
+static void push_duration(VideoOutput *vo, int64_t pts, int64_t duration) {
+    if (vo->n_pending == vo->pending_size) {
+        vo->pending_size = vo->pending_size ? 2 * vo->pending_size : 16;
+        vo->pending = realloc(vo->pending,
+                              vo->pending_size * sizeof(PendingDuration));
+        if (!vo->pending) {
+            fprintf(stderr, "Fatal: Could not allocate frame durations\n");
+            exit(1);
+        }
+    }
+
+    vo->pending[vo->n_pending].pts = pts;
+    vo->pending[vo->n_pending].duration = duration;
+    vo->n_pending++;
+}
+
+/*
+ * pop_duration returns and forgets the duration of the frame
+ * with the specified pts, 0 if it is not known
+ */
+static int64_t pop_duration(VideoOutput *vo, int64_t pts) {
+    int64_t duration;
+    int     i;
+
+    for (i = 0; i < vo->n_pending; i++) {
+        if (vo->pending[i].pts == pts) {
+            duration = vo->pending[i].duration;
+            memmove(&vo->pending[i], &vo->pending[i+1],
+                    (vo->n_pending - i - 1) * sizeof(PendingDuration));
+            vo->n_pending--;
+            return duration;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * encode_frame encodes the frame, or drains the encoder if
+ * frame is NULL, and writes the packet it produced, if any
+ *
+ * returns 1 if a packet was written, 0 otherwise. A failure
+ * sets vo->error, and every later call does nothing.
+ */
+static int encode_frame(VideoOutput *vo, AVFrame *frame) {
+    AVCodecContext *c_ctx = vo->enc;
+    AVPacket        pkt;
+    StatsSpan       span;
+    int             ret, got_output;
+
+    if (vo->error) {
+        return 0;
+    }
+
+    av_init_packet(&pkt);
+    /* packet data will be allocated by the encoder */
+    pkt.data = NULL;
+    pkt.size = 0;
+    fflush(stdout); /* TODO: why is this needed? */
+
+    stats_begin(&span);
+    ret = avcodec_encode_video2(c_ctx, &pkt, frame, &got_output);
+    stats_end(&span, STATS_ENCODE);
+    if (ret < 0) {
+        if (frame) {
+            fprintf(stderr, "Error encoding frame %"PRId64"\n", frame->pts);
+        } else {
+            fprintf(stderr, "Error encoding frame\n");
+        }
+        vo->error = 1;
+        return 0;
+    }
+
+    if (frame) {
+        stats_add_frames(1);
+    }
+    if (!got_output) {
+        return 0;
+    }
+
+    #ifdef DEBUG_WRITE
+    printf("Write frame %3"PRId64" (size=%5d)\n", pkt.pts, pkt.size);
+    #endif
+
+    if (vo->vfr) {
+        pkt.duration = pop_duration(vo, pkt.pts);
+    }
+
+    if (vo->spool) {
+        trace_set_pts(pkt.pts);
+        stats_begin(&span);
+        spool_write(vo->spool, &pkt);
+        stats_end(&span, STATS_WRITE);
+        av_free_packet(&pkt);
+        return 1;
+    }
+
+    ret = write_packet(vo->oc, &c_ctx->time_base, vo->st, &pkt);
+    av_free_packet(&pkt);
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
+        vo->error = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* the rows [first, end) of one frame to convert in bands */
+typedef struct ConvertJob {
+    const YUVConverter *conv;
+    const AVFrame      *in_frame;
+    AVFrame            *out_frame;
+    int                 first, end;
+} ConvertJob;
+
+/*
+ * convert_band converts band i of n of a ConvertJob, the
+ * bands start on even rows so no chroma row is shared
+ */
+static void convert_band(void *arg, int i, int n) {
+    ConvertJob *job = arg;
+    int         rows = job->end - job->first;
+    int         top = job->first + ((int)((int64_t)rows * i / n) & ~1);
+    int         bottom = i + 1 == n ? job->end :
+                         job->first + ((int)((int64_t)rows * (i + 1) / n) & ~1);
+
+    yuv_converter_convert_rows(job->conv, job->in_frame, job->out_frame,
+                               top, bottom);
+}
+
+/*
+ * convert_rows converts the rows [first, end) of in_frame
+ * into out_frame with the SIMD converter, in bands on the
+ * slice pool if there is one
+ */
+static void convert_rows(VideoOutput *vo, AVFrame *in_frame,
+                         AVFrame *out_frame, int first, int end) {
+    ConvertJob job;
 
-    /* i = current total frame count */
-    for (i = pts; i < (pts+frames); i++) {
-        av_init_packet(&pkt);
-        /* packet data will be allocated by the encoder */
-        pkt.data = NULL;
-        pkt.size = 0;
-        fflush(stdout);
+    if (!vo->slices) {
+        yuv_converter_convert_rows(vo->conv, in_frame, out_frame, first, end);
+        return;
+    }
 
-        /*time_start = pts_to_timestamp(base, i, fps);*/
-        time_end = pts_to_timestamp(base, i+1, fps);
+    job.conv = vo->conv;
+    job.in_frame = in_frame;
+    job.out_frame = out_frame;
+    job.first = first;
+    job.end = end;
+    slice_pool_run(vo->slices, convert_band, &job,
+                   vo->slices->n_threads + 1);
+}
 
-        frame_data->timestamp = time_end;
-        /* draw touch data */
-        actualize(ta, frame_data);
+/*
+ * scale_window converts rows [top, top + rows) of in_frame,
+ * of format in_pix_fmt, into frame with sc, a context for
+ * that many rows, and copies rows [first, end) of the result
+ * into out_frame
+ */
+void scale_window(struct SwsContext *sc, int in_pix_fmt, AVFrame *frame,
+                  const AVFrame *in_frame, AVFrame *out_frame,
+                  int first, int end, int top, int rows) {
+    const AVPixFmtDescriptor *in_desc, *out_desc;
+    const uint8_t            *src[4];
+    int                       p, sh, n_planes;
+
+    /* the planes from row top on, a palette stays as it is */
+    in_desc = av_pix_fmt_desc_get(in_pix_fmt);
+    n_planes = av_pix_fmt_count_planes(in_pix_fmt);
+    for (p = 0; p < 4; p++) {
+        sh = p == 1 || p == 2 ? in_desc->log2_chroma_h : 0;
+        src[p] = in_frame->data[p];
+        if (p < n_planes) {
+            src[p] += (top >> sh) * in_frame->linesize[p];
+        }
+    }
+    sws_scale(sc, src, (const int *)in_frame->linesize, 0, rows,
+              frame->data, frame->linesize);
+
+    out_desc = av_pix_fmt_desc_get(out_frame->format);
+    n_planes = av_pix_fmt_count_planes(out_frame->format);
+    for (p = 0; p < n_planes; p++) {
+        sh = p == 1 || p == 2 ? out_desc->log2_chroma_h : 0;
+        av_image_copy_plane(
+            out_frame->data[p] + (first >> sh) * out_frame->linesize[p],
+            out_frame->linesize[p],
+            frame->data[p] + ((first - top) >> sh) * frame->linesize[p],
+            frame->linesize[p],
+            av_image_get_linesize(out_frame->format, out_frame->width, p),
+            ((end + (1 << sh) - 1) >> sh) - (first >> sh));
+    }
+}
 
-        out_frame = alloc_frame(c_ctx->width, c_ctx->height, c_ctx->pix_fmt);
+/* one frame to convert in the bands of a VideoOutput */
+typedef struct BandJob {
+    VideoOutput   *vo;
+    const AVFrame *in_frame;
+    AVFrame       *out_frame;
+} BandJob;
 
-        /* convert to destination format, ie YUV */
-        sws_scale(sc, (const unsigned char *const *)in_frame->data,
+/*
+ * scale_band converts band i of a BandJob with its own
+ * context, n is the number of bands
+ */
+static void scale_band(void *arg, int i, int n) {
+    BandJob   *job = arg;
+    ScaleBand *band = &job->vo->bands[i];
+
+    (void)n;
+    if (band->first < band->end) {
+        scale_window(band->sc, job->vo->in_pix_fmt, band->frame,
+                     job->in_frame, job->out_frame, band->first, band->end,
+                     band->top, band->rows);
+    }
+}
+
+/*
+ * scale_frame converts in_frame into out_frame, a frame of
+ * the output format and size, with the SIMD converter if
+ * there is one, and in bands if there are any
+ */
+static void scale_frame(VideoOutput *vo, AVFrame *in_frame,
+                        AVFrame *out_frame) {
+    StatsSpan span;
+    BandJob   job;
+
+    stats_begin(&span);
+    if (vo->conv) {
+        convert_rows(vo, in_frame, out_frame, 0, out_frame->height);
+    } else if (vo->bands) {
+        job.vo = vo;
+        job.in_frame = in_frame;
+        job.out_frame = out_frame;
+        slice_pool_run(vo->slices, scale_band, &job, vo->n_bands);
+    } else {
+        sws_scale(vo->sc, (const unsigned char *const *)in_frame->data,
                   (const int *)in_frame->linesize, 0, out_frame->height,
                   out_frame->data, out_frame->linesize);
+    }
+    stats_end(&span, STATS_SCALE);
+}
 
-        out_frame->pts = i;
+/*
+ * copy_box copies the pixels of box, and the chroma samples
+ * covering them, from src to dst
+ */
+static void copy_box(VideoOutput *vo, AVFrame *dst, const AVFrame *src,
+                     const TouchBox *box) {
+    int p, sw, sh, x, y, w, h;
+
+    for (p = 0; p < 3; p++) {
+        sw = p ? vo->yuv.chroma_w_shift : 0;
+        sh = p ? vo->yuv.chroma_h_shift : 0;
+        x = box->x >> sw;
+        y = box->y >> sh;
+        w = ((box->x + box->width + (1 << sw) - 1) >> sw) - x;
+        h = ((box->y + box->higth + (1 << sh) - 1) >> sh) - y;
+
+        av_image_copy_plane(dst->data[p] + y * dst->linesize[p] + x,
+                            dst->linesize[p],
+                            src->data[p] + y * src->linesize[p] + x,
+                            src->linesize[p], w, h);
+    }
+}
 
-        /* encode the image */
-        ret = avcodec_encode_video2(c_ctx, &pkt, out_frame, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame %d\n", i);
+/*
+ * find_boxes writes the boxes of the active touches to
+ * vo->boxes, and returns their number
+ */
+static int find_boxes(VideoOutput *vo) {
+    if (vo->boxes_size < vo->ta->n_slots) {
+        vo->boxes_size = vo->ta->n_slots;
+        vo->boxes = realloc(vo->boxes, vo->boxes_size * sizeof(TouchBox));
+        vo->drawn = realloc(vo->drawn, vo->boxes_size * sizeof(TouchBox));
+        if (!vo->boxes || !vo->drawn) {
+            fprintf(stderr, "Fatal: Could not allocate touch boxes\n");
             exit(1);
         }
+    }
+    return touch_boxes(vo->ta, &vo->yuv, vo->boxes);
+}
 
-        if (got_output) {
+/*
+ * keep_boxes records the n boxes find_boxes found as the ones
+ * drawn into hold_frame
+ */
+static void keep_boxes(VideoOutput *vo, int n) {
+    TouchBox *swap;
 
-            #ifdef DEBUG_WRITE
-            printf("Write frame %3d (size=%5d)\n", i, pkt.size);
-            #endif
+    swap = vo->drawn;
+    vo->drawn = vo->boxes;
+    vo->boxes = swap;
+    vo->n_drawn = n;
+}
 
-            ret = write_packet(oc, &c_ctx->time_base, st, &pkt);
-            if (ret < 0) {
-                fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
-                exit(1);
-            }
-            av_free_packet(&pkt);
+/*
+ * compose_touches makes hold_frame the clean frame with the
+ * active touches drawn over it
+ *
+ * When hold_frame already is a composite of the clean frame
+ * that nobody else references, such as the encoder, only
+ * the boxes of the touches drawn before are copied back from
+ * the clean frame. Otherwise it is a new pool frame with a
+ * copy of the whole clean frame. The clean frame, and the
+ * screenshot it came from, are never written.
+ */
+static void compose_touches(VideoOutput *vo) {
+    AVFrame   *hold = vo->hold_frame;
+    AVFrame   *clean = vo->clean_frame;
+    YUVFrame   yuv = vo->yuv;
+    StatsSpan  span;
+    int        i, n;
+
+    stats_begin(&span);
+
+    n = find_boxes(vo);
+    if (n == 0) {
+        /* nothing drawn, the clean frame is the picture */
+        av_frame_unref(hold);
+        if (av_frame_ref(hold, clean) < 0) {
+            fprintf(stderr, "Fatal: Could not reference output video frame\n");
+            exit(1);
         }
+        vo->n_drawn = 0;
+        stats_end(&span, STATS_OVERLAY);
+        return;
+    }
 
-        /* free allocated image */
-        av_freep(&out_frame->data[0]);
-        /* free temporary yuv frame */
-        av_frame_free(&out_frame);
-        /* revert back to original frame data */
-        revert_actualize(ta, frame_data);
+    if (hold->buf[0] && hold->data[0] != clean->data[0] &&
+        av_frame_is_writable(hold)) {
+        for (i = 0; i < vo->n_drawn; i++) {
+            copy_box(vo, hold, clean, &vo->drawn[i]);
+        }
+    } else {
+        av_frame_unref(hold);
+        frame_pool_get(vo->pool, hold);
+        av_frame_copy(hold, clean);
     }
-    n_pts = i; /* set new frame count */
-    Frame_destroy(frame_data);
-    return n_pts;
+
+    for (i = 0; i < 3; i++) {
+        yuv.planes[i] = hold->data[i];
+        yuv.linesizes[i] = hold->linesize[i];
+    }
+    draw_touches_yuv(vo->ta, &yuv);
+    keep_boxes(vo, n);
+
+    stats_end(&span, STATS_OVERLAY);
 }
 
 /*
- * flush_video writes all the delayed frames to the output video file
+ * dirty_rows finds the rows [*first, *end), aligned to
+ * macroblocks, that hold the touches drawn into hold_frame
+ * and the n touches about to be drawn
+ *
+ * returns 0 if there are no touches then or now
  */
-void flush_video(AVFormatContext *oc, AVStream *st) {
-    AVCodecContext *c_ctx = st->codec;
-    AVPacket pkt;
-    int i, ret, got_output;
+static int dirty_rows(VideoOutput *vo, int n, int *first, int *end) {
+    TouchBox *box;
+    int       i, lo = INT_MAX, hi = INT_MIN;
+
+    for (i = 0; i < vo->n_drawn + n; i++) {
+        box = i < vo->n_drawn ? &vo->drawn[i] : &vo->boxes[i - vo->n_drawn];
+        if (box->y < lo) lo = box->y;
+        if (box->y + box->higth > hi) hi = box->y + box->higth;
+    }
+    if (lo >= hi) {
+        return 0;
+    }
 
-    i = 0;
-    printf("Flush it yeah\n");
-    for (got_output = 1; got_output; i++) {
-        av_init_packet(&pkt);
-        pkt.data = NULL;    /* packet data will be allocated by the encoder */
-        pkt.size = 0;
-        fflush(stdout); /* TODO: why is this needed? */
-
-        ret = avcodec_encode_video2(c_ctx, &pkt, NULL, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
+    *first = lo & ~(STRIP_ALIGN - 1);
+    *end = FFALIGN(hi, STRIP_ALIGN);
+    if (*end > vo->hold_frame->height) *end = vo->hold_frame->height;
+    return 1;
+}
+
+/*
+ * strip_window finds the rows [*top, *top + *rows) to convert
+ * for the dirty rows [first, end)
+ *
+ * The window has STRIP_MARGIN more rows on either side, so
+ * the vertical filters see the same input as for the whole
+ * frame, and it starts on a macroblock, which keeps the
+ * dither pattern. Its height is rounded up to STRIP_QUANT,
+ * so the strip context is only rebuilt when the touches
+ * spread or move far.
+ *
+ * returns 0 if the window is so large that converting the
+ * whole frame is cheaper
+ */
+static int strip_window(VideoOutput *vo, int first, int end,
+                        int *top, int *rows) {
+    int height = vo->hold_frame->height;
+
+    *top = first - STRIP_MARGIN;
+    if (*top < 0) *top = 0;
+    *rows = FFALIGN(end + STRIP_MARGIN - *top, STRIP_QUANT);
+    if (*top + *rows > height) *rows = height - *top;
+
+    return *rows <= height / 2;
+}
+
+/*
+ * convert_strip converts rows [top, top + rows) of in_frame,
+ * and patches rows [first, end) of the result into hold_frame
+ */
+static void convert_strip(VideoOutput *vo, AVFrame *in_frame,
+                          int first, int end, int top, int rows) {
+    AVFrame   *hold = vo->hold_frame;
+    StatsSpan  span;
+
+    stats_begin(&span);
+
+    vo->strip_sc = sws_getCachedContext(vo->strip_sc,
+                                        hold->width, rows, vo->in_pix_fmt,
+                                        hold->width, rows, hold->format,
+                                        vo->scale_flags, NULL, NULL, NULL);
+    if (!vo->strip_sc) {
+        fprintf(stderr, "Fatal: Could not allocate scaling context\n");
+        exit(1);
+    }
+    if (!vo->strip_frame) {
+        vo->strip_frame = alloc_frame(hold->width, hold->height, hold->format);
+    }
+    scale_window(vo->strip_sc, vo->in_pix_fmt, vo->strip_frame, in_frame,
+                 hold, first, end, top, rows);
+
+    stats_end(&span, STATS_SCALE);
+}
+
+/*
+ * overlay_before_conversion makes hold_frame the conversion
+ * of the screenshot with the touches drawn into it, for the
+ * output formats touches are not drawn into after conversion
+ *
+ * If hold_frame already is the conversion of this screenshot,
+ * with earlier touches, and the conversion does not scale,
+ * only the rows of the touches drawn then and now are
+ * converted again. They are patched into hold_frame, or a
+ * copy of it if it is still referenced elsewhere, such as
+ * by the encoder.
+ */
+static void overlay_before_conversion(VideoOutput *vo, AVFrame *in_frame,
+                                      Frame *frame_data) {
+    AVFrame   *hold = vo->hold_frame;
+    AVFrame   *copy;
+    StatsSpan  span;
+    int        n, partial = 0;
+    int        first = 0, end = 0, top = 0, rows = 0;
+
+    n = find_boxes(vo);
+    if (vo->strips && hold->buf[0]) {
+        if (!dirty_rows(vo, n, &first, &end)) {
+            /* no touches before or now, the frame is up to date */
+            return;
+        }
+        partial = strip_window(vo, first, end, &top, &rows);
+    }
+
+    if (partial && !av_frame_is_writable(hold)) {
+        copy = av_frame_alloc();
+        if (!copy) {
+            fprintf(stderr, "Fatal: Could not allocate output video frame\n");
             exit(1);
         }
+        frame_pool_get(vo->pool, copy);
+        av_frame_copy(copy, hold);
+        av_frame_unref(hold);
+        av_frame_move_ref(hold, copy);
+        av_frame_free(&copy);
+    } else if (!partial) {
+        av_frame_unref(hold);
+        frame_pool_get(vo->pool, hold);
+    }
+
+    /* draw touch data */
+    stats_begin(&span);
+    draw_touches(vo->ta, frame_data);
+    stats_end(&span, STATS_OVERLAY);
+
+    /* convert to destination format, ie YUV */
+    if (partial) {
+        convert_strip(vo, in_frame, first, end, top, rows);
+    } else {
+        scale_frame(vo, in_frame, hold);
+    }
 
-        if (got_output) {
+    /* revert back to original frame data */
+    stats_begin(&span);
+    revert_actualize(vo->ta, frame_data);
+    stats_end(&span, STATS_OVERLAY);
 
-            #ifdef DEBUG_WRITE
-            printf("Write frame %3d (size=%5d)\n", i, pkt.size);
-            #endif
+    keep_boxes(vo, n);
+}
 
-            ret = write_packet(oc, &c_ctx->time_base, st, &pkt);
-            if (ret < 0) {
-                fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
-                exit(1);
-            }
-            av_free_packet(&pkt);
+/*
+ * render_frame encodes one frame of the screenshot with the
+ * touches as of frame_data->timestamp, pts and duration are
+ * in the codec time base
+ *
+ * The converted frame is kept, and as long as the touch
+ * overlay does not change the encoder is sent references
+ * to it instead of drawing and converting the same pixels
+ * again. changed is the update_touches result for this frame.
+ *
+ * Converted frames come from the frame pool and the frame
+ * structs are reused, so only the reference headers are
+ * allocated per frame.
+ */
+static void render_frame(VideoOutput *vo, AVFrame *in_frame,
+                         Frame *frame_data, int changed,
+                         int64_t pts, int64_t duration) {
+    AVFrame *out_frame = vo->send_frame;
+
+    trace_set_pts(pts);
+
+    if (vo->yuv_overlay) {
+        /* each screenshot is converted once, the touches are
+         * drawn over the conversion when they change */
+        if (in_frame && !vo->clean_frame->buf[0]) {
+            frame_pool_get(vo->pool, vo->clean_frame);
+            scale_frame(vo, in_frame, vo->clean_frame);
+        }
+        if (changed || !vo->hold_frame->buf[0]) {
+            compose_touches(vo);
         }
+    } else if (in_frame && (changed || !vo->hold_frame->buf[0])) {
+        /* without an input the held frame is already converted
+         * and the caller made sure no touches are drawn over it */
+        overlay_before_conversion(vo, in_frame, frame_data);
+    }
+
+    if (av_frame_ref(out_frame, vo->hold_frame) < 0) {
+        fprintf(stderr, "Fatal: Could not reference output video frame\n");
+        exit(1);
+    }
+
+    out_frame->pts = pts;
+    out_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (vo->key_interval > 0 && pts >= vo->next_key_pts) {
+        out_frame->pict_type = AV_PICTURE_TYPE_I;
+        vo->next_key_pts = pts + vo->key_interval;
+    }
+    if (vo->vfr) {
+        push_duration(vo, pts, duration);
+    }
+
+    /* encode the image */
+    encode_frame(vo, out_frame);
+
+    av_frame_unref(out_frame);
+}
+
+/*
+ * write_frames_cfr repeats the screenshot for every frame
+ * of the interval at the constant frame rate, drawing
+ * the touches as of the end of each frame
+ */
+static int write_frames_cfr(VideoOutput *vo, AVFrame *in_frame,
+                            Frame *frame_data, long interval) {
+    StatsSpan  span;
+    int        i, frames, changed;
+    int64_t    pts = vo->pts;
+
+    frames = interval_to_frames(interval, vo->fps);
+
+    for (i = 0; i < frames; i++) {
+        frame_data->timestamp = pts_to_timestamp(vo->base, pts+i+1, vo->fps);
+        stats_begin(&span);
+        changed = update_touches(vo->ta, frame_data);
+        stats_end(&span, STATS_TOUCHES);
+
+        render_frame(vo, in_frame, frame_data, changed, pts+i, 1);
+    }
+
+    vo->pts = pts + frames; /* set new frame count */
+    return frames;
+}
+
+/*
+ * write_frames_vfr writes one frame for every state of the
+ * touch overlay during the interval, but no more than fps
+ * frames per second. Each frame shows the touches as of its
+ * start and lasts until the next change.
+ */
+static int write_frames_vfr(VideoOutput *vo, AVFrame *in_frame,
+                            Frame *frame_data, long start, long interval) {
+    StatsSpan span;
+    long      time, next, end, min_duration;
+    int       frames = 0;
+    int       changed;
+
+    min_duration = 1000 / vo->fps;
+    if (min_duration < 1) min_duration = 1;
+
+    end = start + interval;
+    /* keep pts increasing even if timestamps overlap */
+    time = start;
+    if (time < vo->base + vo->pts) time = vo->base + vo->pts;
+
+    while (time < end) {
+        frame_data->timestamp = time;
+        stats_begin(&span);
+        changed = update_touches(vo->ta, frame_data);
+        stats_end(&span, STATS_TOUCHES);
+
+        /* hold the frame until the overlay changes */
+        next = next_touch_timestamp(vo->ta);
+        if (next < time + min_duration) next = time + min_duration;
+        if (next > end) next = end;
+
+        render_frame(vo, in_frame, frame_data, changed,
+                     time - vo->base, next - time);
+
+        time = next;
+        frames++;
+    }
+
+    if (time - vo->base > vo->pts) vo->pts = time - vo->base;
+    return frames;
+}
+
+/*
+ * write_frame appends the supplied frame to the destination video
+ * file for the interval starting at the timestamp start
+ *
+ * returns the number of frames written
+ */
+int write_frame(VideoOutput *vo, AVFrame *in_frame,
+                long start, long interval) {
+    Frame *frame_data;
+    int    frames;
+
+    frame_data = Frame_new(in_frame->data[0], in_frame->linesize[0],
+                in_frame->width, in_frame->height, 0);
+
+    /* a new screenshot, the held frame is out of date unless
+     * the pixels did not change */
+    if (!vo->dedup || !same_pixels(vo, in_frame) || !vo->hold_frame->buf[0]) {
+        av_frame_unref(vo->hold_frame);
+        av_frame_unref(vo->clean_frame);
+    } else {
+        vo->conversions_skipped++;
+    }
+
+    if (vo->vfr) {
+        frames = write_frames_vfr(vo, in_frame, frame_data, start, interval);
+    } else {
+        frames = write_frames_cfr(vo, in_frame, frame_data, interval);
+    }
+
+    Frame_destroy(frame_data);
+    return frames;
+}
+
+/*
+ * write_frame_end returns the last timestamp whose touches
+ * write_frame would show for the interval starting at start
+ */
+long write_frame_end(VideoOutput *vo, long start, long interval) {
+    if (vo->vfr) {
+        return start + interval;
+    }
+    return pts_to_timestamp(vo->base,
+                            vo->pts + interval_to_frames(interval, vo->fps),
+                            vo->fps);
+}
+
+/*
+ * convert_frame converts the screenshot to the output format
+ * without any touches, such as for the frame cache
+ *
+ * side effects: allocates an AVFrame from the frame pool,
+ * must be freed with av_frame_free
+ */
+AVFrame * convert_frame(VideoOutput *vo, AVFrame *in_frame) {
+    AVFrame *out_frame;
+
+    out_frame = av_frame_alloc();
+    if (!out_frame) {
+        fprintf(stderr, "Fatal: Could not allocate output video frame\n");
+        exit(1);
+    }
+    frame_pool_get(vo->pool, out_frame);
+    scale_frame(vo, in_frame, out_frame);
+
+    return out_frame;
+}
+
+/*
+ * write_converted_frame appends a screenshot that is already
+ * converted to the output format, like write_frame. Unless
+ * vo->yuv_overlay is set no touches may be drawn during the
+ * interval, see touches_visible.
+ *
+ * returns the number of frames written
+ */
+int write_converted_frame(VideoOutput *vo, AVFrame *out_frame,
+                          long start, long interval) {
+    Frame *frame_data;
+    int    frames;
+
+    frame_data = Frame_new(NULL, 0, out_frame->width, out_frame->height, 0);
+
+    av_frame_unref(vo->hold_frame);
+    av_frame_unref(vo->clean_frame);
+    if (av_frame_ref(vo->yuv_overlay ? vo->clean_frame : vo->hold_frame,
+                     out_frame) < 0) {
+        fprintf(stderr, "Fatal: Could not reference output video frame\n");
+        exit(1);
+    }
+    vo->n_drawn = 0;
+    /* the pixels of the next screenshot can not be compared */
+    vo->have_hash = 0;
+
+    if (vo->vfr) {
+        frames = write_frames_vfr(vo, NULL, frame_data, start, interval);
+    } else {
+        frames = write_frames_cfr(vo, NULL, frame_data, interval);
+    }
+
+    Frame_destroy(frame_data);
+    return frames;
+}
+
+/*
+ * skip_frame moves the output past the interval starting at
+ * the timestamp start without writing anything, pts ends up
+ * where write_frame would have left it
+ */
+void skip_frame(VideoOutput *vo, long start, long interval) {
+    long time, end;
+
+    if (!vo->vfr) {
+        vo->pts += interval_to_frames(interval, vo->fps);
+        return;
+    }
+
+    /* as write_frames_vfr, which runs up to end if it runs */
+    end = start + interval;
+    time = start;
+    if (time < vo->base + vo->pts) time = vo->base + vo->pts;
+    if (time < end) time = end;
+
+    if (time - vo->base > vo->pts) vo->pts = time - vo->base;
+}
+
+/*
+ * flush_video writes all the delayed frames to the output video file
+ */
+void flush_video(VideoOutput *vo) {
+    #ifdef DEBUG_WRITE
+    printf("Flush it yeah\n");
+    #endif
+    while (encode_frame(vo, NULL)) {
+        ;
     }
 }
 
@@ -2,23 +2,135 @@
 #define _VIDEO_H_
 
 #include "actualizer.h"
+#include "dedup.h"
+#include "framepool.h"
+#include "profile.h"
+#include "slicepool.h"
+#include "yuvconv.h"
+
+#include <stdio.h>
 
 #include <libavformat/avformat.h>
 
+/* touch changes are converted in strips and frames in bands of
+ * whole macroblock rows, from STRIP_MARGIN more rows on either
+ * side, so the vertical filters see the same input as for the
+ * whole frame, see scale_window */
+#define STRIP_ALIGN  16
+#define STRIP_MARGIN 16
+
+/* time base of variable frame rate output, in millisecs */
+#define VFR_TIME_BASE_DEN 1000
+
+/* rows [first, end) of a frame converted by their own scaling
+ * context, from the rows [top, top + rows) around them */
+typedef struct ScaleBand {
+    struct SwsContext *sc;
+    AVFrame           *frame;
+    int                first, end;
+    int                top, rows;
+} ScaleBand;
+
+typedef struct PendingDuration {
+    int64_t pts;
+    int64_t duration;
+} PendingDuration;
+
+/*
+ * VideoOutput holds everything needed to append
+ * screenshots to one encoded video stream
+ *
+ * In constant frame rate mode every screenshot is repeated
+ * for as many frames as its interval covers, and pts counts
+ * frames. In variable frame rate mode one frame is written
+ * per visual state (a screenshot, or a change of the touch
+ * overlay) and pts counts millisecs from base.
+ */
+typedef struct VideoOutput {
+    AVCodecContext    *enc;
+    AVFormatContext   *oc;    /* NULL when writing to the spool */
+    AVStream          *st;
+    FILE              *spool;
+    struct SwsContext *sc;
+    YUVConverter      *conv; /* converts in place of sc, if it can */
+    SlicePool         *slices; /* runs conv or bands, or NULL */
+    ScaleBand         *bands;  /* sc split into bands of rows */
+    int                n_bands;
+    TouchActualizer   *ta;
+    int                fps;
+    int                vfr;
+    long               base;
+    int64_t            pts; /* pts of the next frame to write */
+    int                error; /* set once encoding or writing failed */
+
+    /* output frames are taken from the pool */
+    FramePool         *pool;
+
+    /* last converted frame, reused while the picture does not change,
+     * and the reference to it that is sent to the encoder */
+    AVFrame           *hold_frame;
+    AVFrame           *send_frame;
+
+    /* with a planar YUV output the touches are drawn after the
+     * conversion: clean_frame is the screenshot without them, and
+     * hold_frame a copy of it with the drawn boxes over it, or
+     * another reference to it when no touches are drawn */
+    int                yuv_overlay;
+    YUVFrame           yuv;     /* size and subsampling of the output */
+    AVFrame           *clean_frame;
+    TouchBox          *drawn;   /* boxes drawn into hold_frame */
+    int                n_drawn;
+    TouchBox          *boxes;   /* boxes of the touches being drawn */
+    int                boxes_size;
+
+    /* for other output formats, when the conversion does not scale,
+     * a touch change converts only the rows of the old and new
+     * touches, into strip_frame, and patches them into hold_frame */
+    int                unscaled; /* sc only converts the format */
+    int                strips;
+    int                in_pix_fmt;
+    int                scale_flags;
+    struct SwsContext *strip_sc;
+    AVFrame           *strip_frame;
+
+    /* pixel hash of the last screenshot, whose converted frame is
+     * kept when the next screenshot hashes the same (dedup only) */
+    int                dedup;
+    const DedupRegion *dedup_ignore;
+    int                n_dedup_ignore;
+    uint8_t            last_hash[DEDUP_HASH_SIZE];
+    int                have_hash;
+    int                conversions_skipped;
+
+    /* keyframes forced every key_interval of pts, as the frames
+     * may be too far apart for the encoder's GOP (0 for none) */
+    int64_t            key_interval;
+    int64_t            next_key_pts;
+
+    /* durations of frames still inside the encoder (vfr only) */
+    PendingDuration   *pending;
+    int                n_pending;
+    int                pending_size;
+} VideoOutput;
+
 int interval_to_frames(long interval, int fps);
 
 long pts_to_timestamp(long base, int pts, int fps);
 
+int write_packet(AVFormatContext *fmt_ctx, const AVRational *time_base,
+                 AVStream *st, AVPacket *pkt);
+
 int get_video_stream(AVFormatContext *fctx);
 
 AVFormatContext * get_fcontext(const char *filename);
 
 AVCodecContext * get_ccontext(AVFormatContext *fctx, int stream_no);
 
-AVCodec * get_codec(AVCodecContext *cctx);
+AVFormatContext * open_output(const char *dst_filename, const char *format);
 
-AVFrame * decode_picture(AVFormatContext * fctx, int stream_no,
-                     AVCodecContext *cctx);
+int write_header(AVFormatContext *oc, AVDictionary **options);
+
+void close_output(AVFormatContext *oc);
 
 int get_frames(long interval, int fps);
 
@@ -27,15 +139,50 @@ struct SwsContext * get_scale_ctx(int in_w, int in_h, int in_f, int out_w,
 
 AVFrame * alloc_frame(int width, int height, int pix_fmt);
 
-int write_frame(AVFormatContext *oc, AVStream *st,
-                struct SwsContext *sc, AVFrame *in_frame, TouchActualizer *ta,
-                int fps, int pts, long interval, long base);
+void scale_window(struct SwsContext *sc, int in_pix_fmt, AVFrame *frame,
+                  const AVFrame *in_frame, AVFrame *out_frame,
+                  int first, int end, int top, int rows);
+
+VideoOutput * video_output_new(AVFormatContext *oc, AVStream *st,
+                               struct SwsContext *sc, TouchActualizer *ta,
+                               int fps, int vfr, long base);
+
+VideoOutput * video_output_new_spool(AVCodecContext *enc, FILE *spool,
+                                     struct SwsContext *sc,
+                                     TouchActualizer *ta,
+                                     int fps, int vfr, long base);
+
+void video_output_free(VideoOutput *vo);
+
+void video_output_set_convert_threads(VideoOutput *vo, int n_threads);
+
+void video_output_set_dedup(VideoOutput *vo, const DedupRegion *ignore,
+                            int n_ignore);
+
+void video_output_set_keyframe_interval(VideoOutput *vo, long interval);
+
+int write_frame(VideoOutput *vo, AVFrame *in_frame,
+                long start, long interval);
+
+long write_frame_end(VideoOutput *vo, long start, long interval);
+
+AVFrame * convert_frame(VideoOutput *vo, AVFrame *in_frame);
+
+int write_converted_frame(VideoOutput *vo, AVFrame *out_frame,
+                          long start, long interval);
+
+void skip_frame(VideoOutput *vo, long start, long interval);
+
+AVCodec * get_encoder(const EncoderProfile *profile);
+
+void set_encoder_params(AVCodecContext *c, const EncoderProfile *profile,
+                        int width, int height, AVRational time_base);
 
-AVStream *add_video_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID codec_id,
-                     int bit_rate, int width, int height,
-                     int fps, int pix_fmt);
+AVStream *add_video_stream(AVFormatContext *oc, AVCodec **codec,
+                           const EncoderProfile *profile,
+                           int width, int height, AVRational time_base);
 
-void flush_video(AVFormatContext *oc, AVStream *st);
+void flush_video(VideoOutput *vo);
 
 void write_end_code(FILE *f);
 
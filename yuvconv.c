@@ -0,0 +1,454 @@
+#include "yuvconv.h"
+
+#include <libavutil/avutil.h>
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_YUV
+#include <immintrin.h>
+#endif
+
+#define YUV_SHIFT 15
+/* 16 and a half, then 128 and a half of the chroma sum of four */
+#define Y_OFFSET  ((16 << YUV_SHIFT) + (1 << (YUV_SHIFT - 1)))
+#define C_OFFSET  ((128 << (YUV_SHIFT + 2)) + (1 << (YUV_SHIFT + 1)))
+
+static int luma(const YUVConverter *conv, const uint8_t *p) {
+    return (conv->y_coeffs[0] * p[0] + conv->y_coeffs[1] * p[1] +
+            conv->y_coeffs[2] * p[2] + conv->y_coeffs[3] * p[3] +
+            Y_OFFSET) >> YUV_SHIFT;
+}
+
+static int chroma(const int16_t *coeffs, const int *sums) {
+    return (coeffs[0] * sums[0] + coeffs[1] * sums[1] +
+            coeffs[2] * sums[2] + coeffs[3] * sums[3] +
+            C_OFFSET) >> (YUV_SHIFT + 2);
+}
+
+/*
+ * rows_tail converts the columns from x on, repeating the
+ * last input column for a padding output column
+ */
+static void rows_tail(const YUVConverter *conv,
+                      const uint8_t *src0, const uint8_t *src1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                      int x) {
+    const uint8_t *p00, *p01, *p10, *p11;
+    int            xa, xb, c, sums[4];
+
+    for (; x < conv->out_width; x += 2) {
+        xa = x < conv->in_width ? x : conv->in_width - 1;
+        xb = x + 1 < conv->in_width ? x + 1 : conv->in_width - 1;
+        p00 = src0 + 4 * xa;
+        p01 = src0 + 4 * xb;
+        p10 = src1 + 4 * xa;
+        p11 = src1 + 4 * xb;
+
+        y0[x] = luma(conv, p00);
+        y1[x] = luma(conv, p10);
+        if (x + 1 < conv->out_width) {
+            y0[x + 1] = luma(conv, p01);
+            y1[x + 1] = luma(conv, p11);
+        }
+
+        for (c = 0; c < 4; c++) {
+            sums[c] = p00[c] + p01[c] + p10[c] + p11[c];
+        }
+        u[x / 2] = chroma(conv->u_coeffs, sums);
+        v[x / 2] = chroma(conv->v_coeffs, sums);
+    }
+}
+
+static void rows_c(const YUVConverter *conv,
+                   const uint8_t *src0, const uint8_t *src1,
+                   uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    rows_tail(conv, src0, src1, y0, y1, u, v, 0);
+}
+
+#ifdef HAVE_X86_YUV
+
+/*
+ * The SIMD kernels widen pixels to 16 bits, multiply and
+ * add them with the weights in pairs (madd), and add the
+ * pair sums of each pixel (hadd). Chroma adds the two rows
+ * first and the pixel sums of neighbouring columns last.
+ * The arithmetic is that of the C version, so the results
+ * are the same.
+ */
+
+__attribute__((target("sse4.1")))
+static __m128i luma4_sse4(__m128i px01, __m128i px23, __m128i coeffs) {
+    __m128i sum = _mm_hadd_epi32(_mm_madd_epi16(px01, coeffs),
+                                 _mm_madd_epi16(px23, coeffs));
+
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(Y_OFFSET)),
+                          YUV_SHIFT);
+}
+
+/* chroma of the four column pairs of eight row summed pixels */
+__attribute__((target("sse4.1")))
+static __m128i chroma4_sse4(__m128i px01, __m128i px23, __m128i px45,
+                            __m128i px67, __m128i coeffs) {
+    __m128i cols0123, cols4567, sum;
+
+    cols0123 = _mm_hadd_epi32(_mm_madd_epi16(px01, coeffs),
+                              _mm_madd_epi16(px23, coeffs));
+    cols4567 = _mm_hadd_epi32(_mm_madd_epi16(px45, coeffs),
+                              _mm_madd_epi16(px67, coeffs));
+    sum = _mm_hadd_epi32(cols0123, cols4567);
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(C_OFFSET)),
+                          YUV_SHIFT + 2);
+}
+
+__attribute__((target("sse4.1")))
+static void store4_sse4(uint8_t *dst, __m128i values) {
+    int32_t packed;
+
+    values = _mm_packus_epi32(values, values);
+    packed = _mm_cvtsi128_si32(_mm_packus_epi16(values, values));
+    memcpy(dst, &packed, 4);
+}
+
+/* the weights of two pixels, for madd */
+__attribute__((target("sse4.1")))
+static __m128i coeffs_sse4(const int16_t *c) {
+    return _mm_setr_epi16(c[0], c[1], c[2], c[3], c[0], c[1], c[2], c[3]);
+}
+
+/* converts the columns from x on, x being even */
+__attribute__((target("sse4.1")))
+static void rows_from_sse4(const YUVConverter *conv,
+                           const uint8_t *src0, const uint8_t *src1,
+                           uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                           int x) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i yc = coeffs_sse4(conv->y_coeffs);
+    __m128i uc = coeffs_sse4(conv->u_coeffs);
+    __m128i vc = coeffs_sse4(conv->v_coeffs);
+    __m128i a0, b0, a1, b1, luma;
+    __m128i r0[4], r1[4], sum[4];
+    int     i;
+
+    for (; x + 8 <= conv->in_width; x += 8) {
+        a0 = _mm_loadu_si128((const __m128i *)(src0 + 4 * x));
+        b0 = _mm_loadu_si128((const __m128i *)(src0 + 4 * x + 16));
+        a1 = _mm_loadu_si128((const __m128i *)(src1 + 4 * x));
+        b1 = _mm_loadu_si128((const __m128i *)(src1 + 4 * x + 16));
+
+        /* pixel pairs 01, 23, 45, 67 of each row in 16 bits */
+        r0[0] = _mm_unpacklo_epi8(a0, zero);
+        r0[1] = _mm_unpackhi_epi8(a0, zero);
+        r0[2] = _mm_unpacklo_epi8(b0, zero);
+        r0[3] = _mm_unpackhi_epi8(b0, zero);
+        r1[0] = _mm_unpacklo_epi8(a1, zero);
+        r1[1] = _mm_unpackhi_epi8(a1, zero);
+        r1[2] = _mm_unpacklo_epi8(b1, zero);
+        r1[3] = _mm_unpackhi_epi8(b1, zero);
+
+        luma = _mm_packus_epi32(luma4_sse4(r0[0], r0[1], yc),
+                                luma4_sse4(r0[2], r0[3], yc));
+        _mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(luma, luma));
+        luma = _mm_packus_epi32(luma4_sse4(r1[0], r1[1], yc),
+                                luma4_sse4(r1[2], r1[3], yc));
+        _mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(luma, luma));
+
+        for (i = 0; i < 4; i++) {
+            sum[i] = _mm_add_epi16(r0[i], r1[i]);
+        }
+        store4_sse4(u + x / 2, chroma4_sse4(sum[0], sum[1], sum[2], sum[3],
+                                            uc));
+        store4_sse4(v + x / 2, chroma4_sse4(sum[0], sum[1], sum[2], sum[3],
+                                            vc));
+    }
+
+    rows_tail(conv, src0, src1, y0, y1, u, v, x);
+}
+
+__attribute__((target("sse4.1")))
+static void rows_sse4(const YUVConverter *conv,
+                      const uint8_t *src0, const uint8_t *src1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    rows_from_sse4(conv, src0, src1, y0, y1, u, v, 0);
+}
+
+/*
+ * The AVX2 kernel does sixteen pixels of each row at once.
+ * Unpacking and hadd work within 128 bit lanes, so the
+ * results come out in lane order and are permuted back.
+ */
+
+__attribute__((target("avx2")))
+static __m256i luma8_avx2(__m256i px_lo, __m256i px_hi, __m256i coeffs) {
+    __m256i sum = _mm256_hadd_epi32(_mm256_madd_epi16(px_lo, coeffs),
+                                    _mm256_madd_epi16(px_hi, coeffs));
+
+    return _mm256_srai_epi32(_mm256_add_epi32(sum,
+                                              _mm256_set1_epi32(Y_OFFSET)),
+                             YUV_SHIFT);
+}
+
+/* stores the luma of sixteen pixels, given as two vectors of eight */
+__attribute__((target("avx2")))
+static void store16_avx2(uint8_t *dst, __m256i first, __m256i second) {
+    __m256i words, bytes;
+
+    words = _mm256_permute4x64_epi64(_mm256_packus_epi32(first, second),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+    bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(bytes));
+}
+
+/* chroma of the eight column pairs of sixteen row summed pixels */
+__attribute__((target("avx2")))
+static void chroma8_avx2(uint8_t *dst, __m256i a_lo, __m256i a_hi,
+                         __m256i b_lo, __m256i b_hi, __m256i coeffs) {
+    __m256i cols_a, cols_b, sum, bytes;
+
+    cols_a = _mm256_hadd_epi32(_mm256_madd_epi16(a_lo, coeffs),
+                               _mm256_madd_epi16(a_hi, coeffs));
+    cols_b = _mm256_hadd_epi32(_mm256_madd_epi16(b_lo, coeffs),
+                               _mm256_madd_epi16(b_hi, coeffs));
+    sum = _mm256_hadd_epi32(cols_a, cols_b);
+    sum = _mm256_srai_epi32(_mm256_add_epi32(sum,
+                                             _mm256_set1_epi32(C_OFFSET)),
+                            YUV_SHIFT + 2);
+
+    /* lanes hold samples 0 1 4 5 and 2 3 6 7 */
+    sum = _mm256_permutevar8x32_epi32(sum,
+                                      _mm256_setr_epi32(0, 1, 4, 5,
+                                                        2, 3, 6, 7));
+    sum = _mm256_packus_epi32(sum, sum);
+    bytes = _mm256_packus_epi16(sum, sum);
+    bytes = _mm256_permutevar8x32_epi32(bytes,
+                                        _mm256_setr_epi32(0, 4, 0, 4,
+                                                          0, 4, 0, 4));
+    _mm_storel_epi64((__m128i *)dst, _mm256_castsi256_si128(bytes));
+}
+
+__attribute__((target("avx2")))
+static void rows_avx2(const YUVConverter *conv,
+                      const uint8_t *src0, const uint8_t *src1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i yc = _mm256_broadcastsi128_si256(coeffs_sse4(conv->y_coeffs));
+    __m256i uc = _mm256_broadcastsi128_si256(coeffs_sse4(conv->u_coeffs));
+    __m256i vc = _mm256_broadcastsi128_si256(coeffs_sse4(conv->v_coeffs));
+    __m256i a0, b0, a1, b1;
+    __m256i r0[4], r1[4], sum[4];
+    int     x, i;
+
+    for (x = 0; x + 16 <= conv->in_width; x += 16) {
+        a0 = _mm256_loadu_si256((const __m256i *)(src0 + 4 * x));
+        b0 = _mm256_loadu_si256((const __m256i *)(src0 + 4 * x + 32));
+        a1 = _mm256_loadu_si256((const __m256i *)(src1 + 4 * x));
+        b1 = _mm256_loadu_si256((const __m256i *)(src1 + 4 * x + 32));
+
+        r0[0] = _mm256_unpacklo_epi8(a0, zero);
+        r0[1] = _mm256_unpackhi_epi8(a0, zero);
+        r0[2] = _mm256_unpacklo_epi8(b0, zero);
+        r0[3] = _mm256_unpackhi_epi8(b0, zero);
+        r1[0] = _mm256_unpacklo_epi8(a1, zero);
+        r1[1] = _mm256_unpackhi_epi8(a1, zero);
+        r1[2] = _mm256_unpacklo_epi8(b1, zero);
+        r1[3] = _mm256_unpackhi_epi8(b1, zero);
+
+        store16_avx2(y0 + x, luma8_avx2(r0[0], r0[1], yc),
+                     luma8_avx2(r0[2], r0[3], yc));
+        store16_avx2(y1 + x, luma8_avx2(r1[0], r1[1], yc),
+                     luma8_avx2(r1[2], r1[3], yc));
+
+        for (i = 0; i < 4; i++) {
+            sum[i] = _mm256_add_epi16(r0[i], r1[i]);
+        }
+        chroma8_avx2(u + x / 2, sum[0], sum[1], sum[2], sum[3], uc);
+        chroma8_avx2(v + x / 2, sum[0], sum[1], sum[2], sum[3], vc);
+    }
+
+    /* the last pixels of less than sixteen, without the
+     * penalty of SSE code after AVX code */
+    _mm256_zeroupper();
+    rows_from_sse4(conv, src0, src1, y0, y1, u, v, x);
+}
+
+#endif // HAVE_X86_YUV
+
+/*
+ * set_coeffs fills the weights of each pixel byte for the
+ * limited range matrix, bgr if the bytes are blue first
+ */
+static void set_coeffs(YUVConverter *conv, enum YUVColorspace colorspace,
+                       int bgr) {
+    double kr = colorspace == YUV_BT709 ? 0.2126 : 0.299;
+    double kb = colorspace == YUV_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ys = 219.0 / 255.0 * (1 << YUV_SHIFT);
+    double cs = 224.0 / 255.0 * (1 << YUV_SHIFT);
+    int    r = bgr ? 2 : 0, g = 1, b = bgr ? 0 : 2;
+
+    memset(conv->y_coeffs, 0, sizeof(conv->y_coeffs));
+    memset(conv->u_coeffs, 0, sizeof(conv->u_coeffs));
+    memset(conv->v_coeffs, 0, sizeof(conv->v_coeffs));
+
+    conv->y_coeffs[r] = lrint(kr * ys);
+    conv->y_coeffs[g] = lrint(kg * ys);
+    conv->y_coeffs[b] = lrint(kb * ys);
+    conv->u_coeffs[r] = lrint(-kr / (1.0 - kb) / 2.0 * cs);
+    conv->u_coeffs[g] = lrint(-kg / (1.0 - kb) / 2.0 * cs);
+    conv->u_coeffs[b] = lrint(cs / 2.0);
+    conv->v_coeffs[r] = lrint(cs / 2.0);
+    conv->v_coeffs[g] = lrint(-kg / (1.0 - kr) / 2.0 * cs);
+    conv->v_coeffs[b] = lrint(-kb / (1.0 - kr) / 2.0 * cs);
+}
+
+/*
+ * pick_rows sets the row kernel, kernel being one the CPU
+ * supports or YUV_KERNEL_AUTO
+ *
+ * returns 0 on success, -1 if the CPU does not support it
+ */
+static int pick_rows(YUVConverter *conv, enum YUVKernel kernel) {
+    int sse4 = 0, avx2 = 0;
+
+#ifdef HAVE_X86_YUV
+    __builtin_cpu_init();
+    sse4 = __builtin_cpu_supports("sse4.1");
+    avx2 = sse4 && __builtin_cpu_supports("avx2");
+#endif
+
+    if (kernel == YUV_KERNEL_AUTO) {
+        kernel = avx2 ? YUV_KERNEL_AVX2 :
+                 sse4 ? YUV_KERNEL_SSE4 : YUV_KERNEL_C;
+    }
+
+    switch (kernel) {
+#ifdef HAVE_X86_YUV
+    case YUV_KERNEL_AVX2:
+        if (!avx2) return -1;
+        conv->rows = rows_avx2;
+        conv->kernel_name = "avx2";
+        return 0;
+    case YUV_KERNEL_SSE4:
+        if (!sse4) return -1;
+        conv->rows = rows_sse4;
+        conv->kernel_name = "sse4";
+        return 0;
+#endif
+    case YUV_KERNEL_C:
+        conv->rows = rows_c;
+        conv->kernel_name = "c";
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * fits tells if out is the size in, or in padded to even
+ */
+static int fits(int in, int out) {
+    return in > 0 && (out == in || (in % 2 != 0 && out == in + 1));
+}
+
+/*
+ * yuv_converter_new sets up the conversion of in_f frames of
+ * in_w x in_h to out_f frames of out_w x out_h
+ *
+ * returns NULL if it is not one the converter does, or the
+ * CPU does not support the kernel
+ *
+ * side effects: allocates a YUVConverter, must be freed with
+ * yuv_converter_free
+ */
+YUVConverter * yuv_converter_new(int in_w, int in_h, int in_f,
+                                 int out_w, int out_h, int out_f,
+                                 enum YUVColorspace colorspace,
+                                 enum YUVKernel kernel) {
+    YUVConverter *conv;
+    int           bgr;
+
+    switch (in_f) {
+    case AV_PIX_FMT_RGBA:
+    case AV_PIX_FMT_RGB0:
+        bgr = 0;
+        break;
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_BGR0:
+        bgr = 1;
+        break;
+    default:
+        return NULL;
+    }
+    if (out_f != AV_PIX_FMT_YUV420P || !fits(in_w, out_w) ||
+        !fits(in_h, out_h)) {
+        return NULL;
+    }
+
+    conv = calloc(1, sizeof(YUVConverter));
+    if (!conv) {
+        fprintf(stderr, "Fatal: could not allocate converter\n");
+        exit(1);
+    }
+    conv->in_width = in_w;
+    conv->in_height = in_h;
+    conv->out_width = out_w;
+    conv->out_height = out_h;
+    set_coeffs(conv, colorspace, bgr);
+
+    if (pick_rows(conv, kernel) != 0) {
+        free(conv);
+        return NULL;
+    }
+    return conv;
+}
+
+/*
+ * yuv_converter_convert converts in_frame into out_frame, of
+ * the sizes and formats the converter was set up for
+ */
+void yuv_converter_convert(const YUVConverter *conv, const AVFrame *in_frame,
+                           AVFrame *out_frame) {
+    yuv_converter_convert_rows(conv, in_frame, out_frame,
+                               0, conv->out_height);
+}
+
+/*
+ * yuv_converter_convert_rows converts the output rows
+ * [first, end) of in_frame into out_frame, first being even
+ * and end even or the output height, as each pair of rows
+ * shares a chroma row
+ */
+void yuv_converter_convert_rows(const YUVConverter *conv,
+                                const AVFrame *in_frame, AVFrame *out_frame,
+                                int first, int end) {
+    const uint8_t *src0, *src1;
+    uint8_t       *y0, *y1;
+    int            y, last = conv->in_height - 1;
+
+    if (end > conv->out_height) end = conv->out_height;
+    assert(first % 2 == 0 && (end % 2 == 0 || end == conv->out_height));
+
+    for (y = first; y < end; y += 2) {
+        /* a padding row repeats the last one */
+        src0 = in_frame->data[0] +
+               (y < last ? y : last) * in_frame->linesize[0];
+        src1 = in_frame->data[0] +
+               (y + 1 < last ? y + 1 : last) * in_frame->linesize[0];
+        y0 = out_frame->data[0] + y * out_frame->linesize[0];
+        y1 = y + 1 < end ? y0 + out_frame->linesize[0] : y0;
+
+        conv->rows(conv, src0, src1, y0, y1,
+                   out_frame->data[1] + y / 2 * out_frame->linesize[1],
+                   out_frame->data[2] + y / 2 * out_frame->linesize[2]);
+    }
+}
+
+void yuv_converter_free(YUVConverter *conv) {
+    free(conv);
+}
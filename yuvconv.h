@@ -0,0 +1,69 @@
+#ifndef _YUVCONV_H_
+#define _YUVCONV_H_
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+/*
+ * A YUVConverter converts RGBA, BGRA, RGB0 and BGR0 frames
+ * to limited range YUV420P of the same size, the conversion
+ * fast bilinear renders do. Chroma is the average of each
+ * 2x2 block, as swscale's fast bilinear scaler computes it,
+ * and the output is within 1 of its output. The bilinear
+ * scaler filters chroma over a few more pixels, so it is not
+ * replaced. An output one pixel wider or taller than an odd
+ * sized input is padded by repeating the last column or row,
+ * where swscale would scale.
+ *
+ * The rows are converted by AVX2 or SSE4.1 kernels where
+ * the CPU has them, picked at runtime, and by portable C
+ * otherwise. Other conversions are left to swscale.
+ */
+
+enum YUVColorspace {
+    YUV_BT601,
+    YUV_BT709
+};
+
+enum YUVKernel {
+    YUV_KERNEL_AUTO, /* the widest the CPU supports */
+    YUV_KERNEL_C,
+    YUV_KERNEL_SSE4,
+    YUV_KERNEL_AVX2
+};
+
+typedef struct YUVConverter YUVConverter;
+
+/* converts two input rows into two luma rows and one chroma row */
+typedef void (*YUVRowsFunc)(const YUVConverter *conv,
+                            const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1,
+                            uint8_t *u, uint8_t *v);
+
+struct YUVConverter {
+    int          in_width, in_height;
+    int          out_width, out_height;
+    /* 15 bit fixed point weights of the four bytes of a pixel */
+    int16_t      y_coeffs[4];
+    int16_t      u_coeffs[4];
+    int16_t      v_coeffs[4];
+    YUVRowsFunc  rows;
+    const char  *kernel_name;
+};
+
+YUVConverter * yuv_converter_new(int in_w, int in_h, int in_f,
+                                 int out_w, int out_h, int out_f,
+                                 enum YUVColorspace colorspace,
+                                 enum YUVKernel kernel);
+
+void yuv_converter_convert(const YUVConverter *conv, const AVFrame *in_frame,
+                           AVFrame *out_frame);
+
+void yuv_converter_convert_rows(const YUVConverter *conv,
+                                const AVFrame *in_frame, AVFrame *out_frame,
+                                int first, int end);
+
+void yuv_converter_free(YUVConverter *conv);
+
+#endif